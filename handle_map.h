@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+// flat open-addressing hash table keyed on a Vulkan handle value, with the
+// values stored inline so that inserting an entry never allocates on its own.
+// keys and values live in separate arrays, so probing only touches the keys.
+//
+// collisions are resolved by linear probing, and erasing shifts the following
+// entries back instead of leaving tombstones, so lookups stay short no matter
+// how many entries have come and gone. the null handle marks an empty slot and
+// can't be used as a key. the table grows as needed, but only ever shrinks
+// when Shrink() is called.
+template<typename Value>
+class HandleMap
+{
+public:
+  HandleMap() : count(0), mask(0) {}
+
+  size_t Size() const { return count; }
+  size_t Capacity() const { return keys.size(); }
+
+  Value *Find(uint64_t key)
+  {
+    if (count == 0 || key == 0)
+      return NULL;
+
+    for (size_t i = Hash(key) & mask;; i = (i + 1) & mask)
+    {
+      if (keys[i] == key)
+        return &values[i];
+      if (keys[i] == 0)
+        return NULL;
+    }
+  }
+
+  // returns the value stored for key, default-constructing it if it's new
+  Value &Insert(uint64_t key)
+  {
+    if ((count + 1) * MaxLoadDen > keys.size() * MaxLoadNum)
+      Rehash(keys.empty() ? MinCapacity : keys.size() * 2);
+
+    size_t i = Hash(key) & mask;
+    for (; keys[i] != 0; i = (i + 1) & mask)
+    {
+      if (keys[i] == key)
+        return values[i];
+    }
+
+    keys[i] = key;
+    count++;
+    return values[i];
+  }
+
+  // removes key from the table, moving its value into *out if given.
+  // returns false if the key wasn't present
+  bool Erase(uint64_t key, Value *out = NULL)
+  {
+    if (count == 0 || key == 0)
+      return false;
+
+    size_t i = Hash(key) & mask;
+    for (; keys[i] != key; i = (i + 1) & mask)
+    {
+      if (keys[i] == 0)
+        return false;
+    }
+
+    if (out)
+      *out = std::move(values[i]);
+
+    // close the hole by pulling back any later entry of the same probe run
+    // whose home slot doesn't lie between the hole and itself
+    for (size_t j = (i + 1) & mask; keys[j] != 0; j = (j + 1) & mask)
+    {
+      size_t home = Hash(keys[j]) & mask;
+      if (((j - home) & mask) >= ((j - i) & mask))
+      {
+        keys[i] = keys[j];
+        values[i] = std::move(values[j]);
+        i = j;
+      }
+    }
+
+    keys[i] = 0;
+    values[i] = Value();
+    count--;
+    return true;
+  }
+
+  template<typename Func>
+  void ForEach(Func func)
+  {
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+      if (keys[i] != 0)
+        func(keys[i], values[i]);
+    }
+  }
+
+  // release the capacity that is no longer needed for the current entries
+  void Shrink()
+  {
+    if (count == 0)
+    {
+      std::vector<uint64_t>().swap(keys);
+      std::vector<Value>().swap(values);
+      mask = 0;
+      return;
+    }
+
+    size_t capacity = MinCapacity;
+    while (count * MaxLoadDen > capacity * MaxLoadNum)
+      capacity *= 2;
+
+    if (capacity < keys.size())
+      Rehash(capacity);
+  }
+
+private:
+  // the table is kept at most 3/4 full, which keeps linear probe runs short
+  static const size_t MaxLoadNum = 3;
+  static const size_t MaxLoadDen = 4;
+  static const size_t MinCapacity = 16;
+
+  static size_t Hash(uint64_t key)
+  {
+    // handles are usually aligned pointers or small counters, so mix all the
+    // bits down (murmur3 finalizer) before masking
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (size_t) key;
+  }
+
+  void Rehash(size_t capacity)
+  {
+    std::vector<uint64_t> oldKeys(capacity, 0);
+    std::vector<Value> oldValues(capacity);
+    oldKeys.swap(keys);
+    oldValues.swap(values);
+    mask = capacity - 1;
+
+    for (size_t j = 0; j < oldKeys.size(); j++)
+    {
+      if (oldKeys[j] == 0)
+        continue;
+
+      size_t i = Hash(oldKeys[j]) & mask;
+      while (keys[i] != 0)
+        i = (i + 1) & mask;
+
+      keys[i] = oldKeys[j];
+      values[i] = std::move(oldValues[j]);
+    }
+  }
+
+  std::vector<uint64_t> keys;
+  std::vector<Value> values;
+  size_t count;
+  size_t mask;
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// the buckets of the layer's histograms, kept apart from the layer so that
+// the tests can check them directly. histograms are plain arrays of counts,
+// indexed by these functions.
+
+// index of the highest set bit, value must not be 0
+inline uint32_t FloorLog2(uint64_t value)
+{
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanReverse64(&index, value);
+  return index;
+#else
+  return 63 - __builtin_clzll(value);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Allocation sizes and lifetimes
+
+// size class c holds sizes of [2^(12 + c), 2^(13 + c)) bytes, except that the
+// first also holds everything smaller and the last everything larger
+static const uint32_t SizeClassCount = 21;
+static const uint32_t MinSizeClassLog2 = 12;
+
+// lifetime bucket 0 holds lifetimes under a microsecond, bucket b > 0 holds
+// [2^(b - 1), 2^b) microseconds, and the last one everything longer
+static const uint32_t LifetimeBucketCount = 28;
+
+inline uint32_t GetSizeClass(uint64_t size)
+{
+  uint32_t log2 = size == 0 ? 0 : FloorLog2(size);
+  return std::min(std::max(log2, MinSizeClassLog2) - MinSizeClassLog2, SizeClassCount - 1);
+}
+
+inline uint64_t GetSizeClassStart(uint32_t sizeClass)
+{
+  return sizeClass == 0 ? 0 : 1ULL << (MinSizeClassLog2 + sizeClass);
+}
+
+inline uint32_t GetLifetimeBucket(uint64_t microseconds)
+{
+  return microseconds == 0 ? 0 : std::min(FloorLog2(microseconds) + 1, LifetimeBucketCount - 1);
+}
+
+inline uint64_t GetLifetimeBucketStart(uint32_t bucket)
+{
+  return bucket == 0 ? 0 : 1ULL << (bucket - 1);
+}
+
+// the bucket that holds the middle one of total counts
+inline uint32_t GetMedianBucket(const uint64_t *counts, uint64_t total)
+{
+  uint32_t median = 0;
+  for (uint64_t seen = counts[0]; seen * 2 < total; seen += counts[median])
+    median++;
+  return median;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Call latencies
+//
+// log-linear like HdrHistogram's: every power of two of nanoseconds is split
+// into LatencySubBuckets even buckets, so every time is known to within an
+// eighth of itself, and times under LatencySubBuckets nanoseconds get a
+// bucket each
+
+static const uint32_t LatencySubBucketBits = 3;
+static const uint32_t LatencySubBuckets = 1 << LatencySubBucketBits;
+// times from 2^36 ns, about a minute, all land in the last bucket
+static const uint32_t MaxLatencyLog2 = 35;
+static const uint32_t LatencyBucketCount = (MaxLatencyLog2 - LatencySubBucketBits + 2) * LatencySubBuckets;
+
+inline uint32_t GetLatencyBucket(uint64_t nanoseconds)
+{
+  if (nanoseconds < LatencySubBuckets)
+    return (uint32_t)nanoseconds;
+
+  uint32_t log2 = FloorLog2(nanoseconds);
+  if (log2 > MaxLatencyLog2)
+    return LatencyBucketCount - 1;
+
+  // the leading LatencySubBucketBits + 1 bits pick the bucket within the power of two
+  return (log2 - LatencySubBucketBits) * LatencySubBuckets + (uint32_t)(nanoseconds >> (log2 - LatencySubBucketBits));
+}
+
+inline uint64_t GetLatencyBucketStart(uint32_t bucket)
+{
+  if (bucket < 2 * LatencySubBuckets)
+    return bucket;
+
+  uint32_t log2 = bucket / LatencySubBuckets + LatencySubBucketBits - 1;
+  return (uint64_t)(bucket % LatencySubBuckets + LatencySubBuckets) << (log2 - LatencySubBucketBits);
+}
+
+// the time that fraction of the calls took at most, as the end of the bucket
+// holding it, but never more than the longest call
+inline uint64_t GetLatencyPercentile(const uint64_t (&counts)[LatencyBucketCount], uint64_t total, uint64_t maximum,
+                                     double fraction)
+{
+  uint64_t rank = std::max<uint64_t>((uint64_t)ceil(fraction * total), 1), seen;
+  uint32_t bucket = 0;
+  for (seen = counts[0]; seen < rank && bucket + 1 < LatencyBucketCount; seen += counts[bucket])
+    bucket++;
+
+  uint64_t end = bucket + 1 < LatencyBucketCount ? GetLatencyBucketStart(bucket + 1) - 1 : maximum;
+  return std::min(end, maximum);
+}
@@ -1,14 +1,45 @@
 #include "vulkan.h"
 #include "vk_layer.h"
+#include "handle_map.h"
+#include "histogram.h"
+#include "range_index.h"
+#include "memory_track_trace.h"
+#include "memory_track_shm.h"
+#include "memory_track_ext.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
+#include <stdlib.h>
 #include <inttypes.h>
+#include <math.h>
 #include <cstdio>
+#include <algorithm>
 #include <vector>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <new>
 #include <mutex>
-#include <map>
+#include <string>
+#include <thread>
+
+#if defined(WIN32)
+#include <windows.h>
+#include <intrin.h>
+#include <malloc.h>
+#else
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #undef VK_LAYER_EXPORT
 #if defined(WIN32)
@@ -17,241 +48,4117 @@
 #define VK_LAYER_EXPORT extern "C"
 #endif
 
-// single global lock, for simplicity
-std::mutex global_lock;
-typedef std::lock_guard<std::mutex> scoped_lock;
+// global lock, serialising instance and device creation and destruction. the
+// intercepted calls in between never take it
+std::mutex global_lock;
+typedef std::lock_guard<std::mutex> scoped_lock;
+
+// use the loader's dispatch table pointer as a key for dispatch map lookups
+template<typename DispatchableType>
+void *GetKey(DispatchableType inst)
+{
+  return *(void **)inst;
+}
+
+// counters that are written from many threads get a cache line each, so that
+// unrelated counters never bounce the same line between cores
+static const size_t CacheLineSize = 64;
+
+void *AlignedAlloc(size_t size, size_t alignment)
+{
+#if defined(WIN32)
+  return _aligned_malloc(size, alignment);
+#else
+  void *ptr = NULL;
+  if (posix_memalign(&ptr, alignment, size) != 0)
+    return NULL;
+  return ptr;
+#endif
+}
+
+void AlignedFree(void *ptr)
+{
+#if defined(WIN32)
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+// base for objects holding cache line aligned members, since plain new does
+// not honour extended alignment before C++17
+struct CacheAligned
+{
+  static void *operator new(size_t size)
+  {
+    void *ptr = AlignedAlloc(size, CacheLineSize);
+    if (ptr == NULL)
+      throw std::bad_alloc();
+    return ptr;
+  }
+
+  static void operator delete(void *ptr)
+  {
+    AlignedFree(ptr);
+  }
+};
+
+// raise a high-water mark to at least value, without taking any lock
+void UpdateMaximum(std::atomic<uint64_t> &maximum, uint64_t value)
+{
+  uint64_t current = maximum.load(std::memory_order_relaxed);
+  while (value > current &&
+         !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed))
+  {
+  }
+}
+
+// monotonic time since the layer was loaded, used to timestamp allocations
+std::chrono::steady_clock::time_point layer_start_time = std::chrono::steady_clock::now();
+
+uint64_t NowMicroseconds()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - layer_start_time).count();
+}
+
+// absolute monotonic time, so that traces line up with other tools' timestamps
+uint64_t NowNanoseconds()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the operating system's ids, as other tracing tools show them
+uint64_t GetOsProcessId()
+{
+#if defined(WIN32)
+  return GetCurrentProcessId();
+#else
+  return getpid();
+#endif
+}
+
+uint64_t GetOsThreadId()
+{
+#if defined(WIN32)
+  return GetCurrentThreadId();
+#else
+  return syscall(SYS_gettid);
+#endif
+}
+
+// a small, fast generator for sampling decisions, meant to be kept per thread.
+// xorshift64* seeded from the object's address and the time
+class Random
+{
+public:
+  Random()
+  {
+    // splitmix64 spreads the seed over all bits
+    uint64_t seed = (uint64_t)(uintptr_t)this ^ (NowMicroseconds() << 20);
+    seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+    state = (seed ^ (seed >> 31)) | 1;
+  }
+
+  uint64_t Next()
+  {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+  }
+
+  // uniform in (0, 1], from the top 53 bits
+  double Uniform()
+  {
+    return ((Next() >> 11) + 1) * (1.0 / 9007199254740992.0);
+  }
+
+private:
+  uint64_t state;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Configuration, read from the environment when the layer is loaded
+//
+//   MEMORY_TRACK_TRACE_FILE     record every allocate/free/bind/map event into
+//                               this file, see memory_track_trace.h
+//   MEMORY_TRACK_CHROME_TRACE   record the same events into this file as Chrome
+//                               trace event JSON, see memory_track_trace.h
+//   MEMORY_TRACK_SHM_NAME       publish live statistics in the POSIX shared memory
+//                               segment of this name, replacing one left there
+//                               by a process that exited, see memory_track_shm.h
+//   MEMORY_TRACK_SHM_INTERVAL   milliseconds between shared memory updates (10)
+//   MEMORY_TRACK_FRAME_HISTORY  number of recent frames kept per device (256)
+//   MEMORY_TRACK_WORST_FRAMES   number of frames with the most churn listed in
+//                               the report, 0 to leave them out (10)
+//   MEMORY_TRACK_CHURN_LIFETIME allocations whose median lifetime is below this
+//                               many milliseconds are reported as churn (100)
+//   MEMORY_TRACK_STACK_DEPTH    capture up to this many return addresses on every
+//                               allocation and report usage per call stack, 0 to
+//                               turn it off (0, at most 32). needs frame pointers
+//   MEMORY_TRACK_SAMPLE_BYTES   only capture a stack about once every this many
+//                               bytes allocated, and scale the per call stack
+//                               figures up to match, 0 to capture every
+//                               allocation (0). turns stacks on at a depth of 16
+//                               if MEMORY_TRACK_STACK_DEPTH isn't set
+//   MEMORY_TRACK_HEAP_BUDGET    comma separated bytes per memory heap, by heap
+//                               index. allocations that would take a heap past
+//                               its budget fail with VK_ERROR_OUT_OF_DEVICE_MEMORY
+//                               without reaching the driver. 0 or left out for no
+//                               budget (none)
+//   MEMORY_TRACK_FAIL_EVERY     fail every this many allocations on a device the
+//                               same way, 0 to never (0)
+//   MEMORY_TRACK_FAIL_PROBABILITY  fail allocations at random with this
+//                               probability, between 0 and 1 (0)
+//   MEMORY_TRACK_RECYCLE_BYTES  keep up to this many bytes of freed memory per
+//                               device to hand out again instead of calling the
+//                               driver, 0 to turn it off (0)
+//   MEMORY_TRACK_DEFERRED_FREE  hand freed memory to the driver from a background
+//                               thread, in batches this many milliseconds apart,
+//                               0 to free it right away (0)
+//   MEMORY_TRACK_HOST_MEMORY    1 to count the host memory the driver allocates
+//                               through allocation callbacks, by scope and by
+//                               the kind of object being created (0)
+
+struct LayerConfig
+{
+  std::string traceFile;
+  std::string chromeTrace;
+  std::string shmName;
+  uint64_t shmInterval;
+  uint64_t frameHistory;
+  uint64_t worstFrames;
+  uint64_t churnLifetime;
+  uint64_t stackDepth;
+  uint64_t sampleBytes;
+  std::vector<uint64_t> heapBudgets;
+  uint64_t failEvery;
+  double failProbability;
+  uint64_t recycleBytes;
+  uint64_t deferredFree;
+  bool hostMemory;
+};
+
+std::string GetEnvString(const char *name)
+{
+  const char *value = getenv(name);
+  return value ? value : "";
+}
+
+uint64_t GetEnvU64(const char *name, uint64_t defaultValue)
+{
+  const char *value = getenv(name);
+  if (value == NULL || *value == 0)
+    return defaultValue;
+
+  return strtoull(value, NULL, 0);
+}
+
+double GetEnvDouble(const char *name, double defaultValue)
+{
+  const char *value = getenv(name);
+  if (value == NULL || *value == 0)
+    return defaultValue;
+
+  return strtod(value, NULL);
+}
+
+std::vector<uint64_t> GetEnvU64List(const char *name)
+{
+  std::vector<uint64_t> list;
+  const char *value = getenv(name);
+  while (value != NULL && *value != 0)
+  {
+    char *end;
+    list.push_back(strtoull(value, &end, 0));
+    value = *end == ',' ? end + 1 : NULL;
+  }
+  return list;
+}
+
+LayerConfig ReadConfig()
+{
+  LayerConfig config;
+  config.traceFile = GetEnvString("MEMORY_TRACK_TRACE_FILE");
+  config.chromeTrace = GetEnvString("MEMORY_TRACK_CHROME_TRACE");
+  config.shmName = GetEnvString("MEMORY_TRACK_SHM_NAME");
+  config.shmInterval = GetEnvU64("MEMORY_TRACK_SHM_INTERVAL", 10);
+  config.frameHistory = GetEnvU64("MEMORY_TRACK_FRAME_HISTORY", 256);
+  config.worstFrames = GetEnvU64("MEMORY_TRACK_WORST_FRAMES", 10);
+  config.churnLifetime = GetEnvU64("MEMORY_TRACK_CHURN_LIFETIME", 100) * 1000;
+  config.sampleBytes = GetEnvU64("MEMORY_TRACK_SAMPLE_BYTES", 0);
+  config.stackDepth = std::min<uint64_t>(GetEnvU64("MEMORY_TRACK_STACK_DEPTH", config.sampleBytes ? 16 : 0), 32);
+  config.heapBudgets = GetEnvU64List("MEMORY_TRACK_HEAP_BUDGET");
+  config.failEvery = GetEnvU64("MEMORY_TRACK_FAIL_EVERY", 0);
+  config.failProbability = GetEnvDouble("MEMORY_TRACK_FAIL_PROBABILITY", 0.0);
+  config.recycleBytes = GetEnvU64("MEMORY_TRACK_RECYCLE_BYTES", 0);
+  config.deferredFree = GetEnvU64("MEMORY_TRACK_DEFERRED_FREE", 0);
+  config.hostMemory = GetEnvU64("MEMORY_TRACK_HOST_MEMORY", 0) != 0;
+  return config;
+}
+
+const LayerConfig config = ReadConfig();
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Event tracing
+//
+// every thread recording events gets its own single-producer ring, so that
+// recording an event is a copy and a release store, without any lock or
+// syscall. a background thread drains the rings every few milliseconds and
+// writes the events out in large sequential blocks, to the binary trace file,
+// the Chrome trace JSON file or both. turning events into JSON is left to the
+// background thread as well. when a ring is full the event is dropped rather
+// than stalling the caller, and the drops are counted.
+
+struct TraceRing : CacheAligned
+{
+  static const uint64_t Capacity = 4096;
+
+  TraceRing() : head(0), tail(0), dropped(0), retired(false), threadId(0), osThreadId(0) {}
+
+  // head is only written by the owning thread, tail only by the writer
+  alignas(CacheLineSize) std::atomic<uint64_t> head;
+  alignas(CacheLineSize) std::atomic<uint64_t> tail;
+  alignas(CacheLineSize) std::atomic<uint64_t> dropped;
+  // set once the owning thread has exited
+  std::atomic<bool> retired;
+  uint32_t threadId;
+  uint64_t osThreadId;
+  TraceEvent events[Capacity];
+};
+
+// hands the ring back to the writer when the thread exits
+struct TraceThread
+{
+  TraceRing *ring;
+
+  ~TraceThread()
+  {
+    if (ring)
+      ring->retired.store(true, std::memory_order_release);
+  }
+};
+
+thread_local TraceThread trace_thread;
+
+class TraceWriter
+{
+public:
+  TraceWriter() : enabled(false), stop(false), lastWrite(0), processId(0), chromeEvents(0), nextThreadId(0), dropped(0) {}
+
+  ~TraceWriter()
+  {
+    Stop();
+  }
+
+  bool Enabled() const
+  {
+    return enabled.load(std::memory_order_relaxed);
+  }
+
+  // opens the files whose paths aren't empty and starts the writer thread, if
+  // it isn't already running. must be called with global_lock held
+  void Start(const std::string &path, const std::string &chromePath)
+  {
+    if (Enabled())
+      return;
+
+    if (!path.empty() && binary.file == NULL && (binary.file = Open(path)))
+    {
+      TraceFileHeader header = {};
+      strcpy(header.magic, MEMORY_TRACK_TRACE_MAGIC);
+      header.version = MEMORY_TRACK_TRACE_VERSION;
+      header.eventSize = sizeof(TraceEvent);
+      fwrite(&header, sizeof(header), 1, binary.file);
+    }
+
+    if (!chromePath.empty() && chrome.file == NULL && (chrome.file = Open(chromePath)))
+      fputs("[\n", chrome.file);
+
+    if (binary.file == NULL && chrome.file == NULL)
+      return;
+
+    processId = GetOsProcessId();
+    binary.buffer.reserve(BufferSize);
+    chrome.buffer.reserve(BufferSize);
+    thread = std::thread(&TraceWriter::Run, this);
+    enabled.store(true, std::memory_order_release);
+  }
+
+  void Record(const TraceEvent &event)
+  {
+    TraceRing *ring = trace_thread.ring;
+    if (ring == NULL)
+      ring = trace_thread.ring = RegisterThread();
+
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == TraceRing::Capacity)
+    {
+      ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    TraceEvent &slot = ring->events[head % TraceRing::Capacity];
+    slot = event;
+    slot.threadId = ring->threadId;
+    ring->head.store(head + 1, std::memory_order_release);
+  }
+
+  // writes out everything recorded so far
+  void Flush()
+  {
+    if (Enabled())
+      Drain(true);
+  }
+
+private:
+  static const size_t BufferSize = 1 << 20;
+  // how long drained events may sit in the buffer before being written anyway
+  static const uint64_t MaxWriteDelay = 1000000;
+  // longer than any one event's JSON, counter included
+  static const size_t MaxChromeEventSize = 1024;
+
+  struct Output
+  {
+    FILE *file = NULL;
+    std::vector<char> buffer;
+  };
+
+  static FILE *Open(const std::string &path)
+  {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == NULL)
+      fprintf(stderr, "memory_track: can't open trace file %s\n", path.c_str());
+    return file;
+  }
+
+  // runs on the thread the ring is for
+  TraceRing *RegisterThread()
+  {
+    TraceRing *ring = new TraceRing();
+    ring->osThreadId = GetOsThreadId();
+    scoped_lock l(ringsLock);
+    ring->threadId = nextThreadId++;
+    rings.push_back(ring);
+    return ring;
+  }
+
+  void Run()
+  {
+    std::unique_lock<std::mutex> l(stopLock);
+    while (!stop)
+    {
+      stopCondition.wait_for(l, std::chrono::milliseconds(10));
+      l.unlock();
+      Drain(false);
+      l.lock();
+    }
+  }
+
+  void Drain(bool force)
+  {
+    scoped_lock l(drainLock);
+
+    std::vector<TraceRing *> snapshot;
+    {
+      scoped_lock rl(ringsLock);
+      snapshot = rings;
+    }
+
+    for (TraceRing *ring : snapshot)
+    {
+      // check for retirement first, so that nothing can be recorded after the final drain
+      bool retired = ring->retired.load(std::memory_order_acquire);
+      uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+      uint64_t head = ring->head.load(std::memory_order_acquire);
+      for (; tail != head; tail++)
+      {
+        const TraceEvent &event = ring->events[tail % TraceRing::Capacity];
+        if (binary.file)
+          AppendBinary(event);
+        if (chrome.file)
+          AppendChrome(event, ring->osThreadId);
+      }
+      ring->tail.store(tail, std::memory_order_release);
+
+      if (retired)
+      {
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+        {
+          scoped_lock rl(ringsLock);
+          rings.erase(std::find(rings.begin(), rings.end(), ring));
+        }
+        delete ring;
+      }
+    }
+
+    if (force || NowMicroseconds() - lastWrite >= MaxWriteDelay)
+    {
+      Write(binary);
+      Write(chrome);
+      lastWrite = NowMicroseconds();
+    }
+  }
+
+  void AppendBinary(const TraceEvent &event)
+  {
+    if (binary.buffer.size() + sizeof(event) > BufferSize)
+      Write(binary);
+
+    const char *bytes = (const char *)&event;
+    binary.buffer.insert(binary.buffer.end(), bytes, bytes + sizeof(event));
+  }
+
+  // every event goes on a line of its own, separated by commas
+  void AppendChrome(const TraceEvent &event, uint64_t osThreadId)
+  {
+    if (chrome.buffer.size() + MaxChromeEventSize > BufferSize)
+      Write(chrome);
+
+    char line[MaxChromeEventSize];
+    int length = 0;
+    double ts = event.timestamp / 1000.0;
+
+    switch (event.type)
+    {
+    case TraceEventAllocate:
+    case TraceEventFree:
+      length = snprintf(line, sizeof(line),
+                        "{\"name\":\"allocation\",\"cat\":\"memory\",\"ph\":\"%c\",\"id\":\"0x%" PRIx64 "\","
+                        "\"ts\":%.3f,\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"args\":{\"device\":%u,"
+                        "\"memoryType\":%u,\"heap\":%u,\"size\":%" PRIu64 "}},\n"
+                        "{\"name\":\"device %u heap %u\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%" PRIu64 ","
+                        "\"args\":{\"bytes\":%" PRIu64 "}}",
+                        event.type == TraceEventAllocate ? 'b' : 'e', event.memory, ts, processId, osThreadId,
+                        event.deviceIndex, event.memoryTypeIndex, event.heapIndex, event.size,
+                        event.deviceIndex, event.heapIndex, ts, processId, event.heapUsage);
+      break;
+    case TraceEventMap:
+    case TraceEventUnmap:
+      length = snprintf(line, sizeof(line),
+                        "{\"name\":\"mapping\",\"cat\":\"map\",\"ph\":\"%c\",\"id\":\"0x%" PRIx64 "\","
+                        "\"ts\":%.3f,\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"args\":{\"device\":%u,"
+                        "\"offset\":%" PRIu64 ",\"size\":%" PRIu64 "}}",
+                        event.type == TraceEventMap ? 'b' : 'e', event.memory, ts, processId, osThreadId,
+                        event.deviceIndex, event.offset, event.size);
+      break;
+    case TraceEventBindBuffer:
+    case TraceEventBindImage:
+    case TraceEventUnbindBuffer:
+    case TraceEventUnbindImage:
+    {
+      static const char *const names[] = { "bind buffer", "bind image", "unbind buffer", "unbind image" };
+      length = snprintf(line, sizeof(line),
+                        "{\"name\":\"%s\",\"cat\":\"memory\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                        "\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"args\":{\"device\":%u,\"memory\":\"0x%" PRIx64 "\","
+                        "\"object\":\"0x%" PRIx64 "\",\"offset\":%" PRIu64 ",\"size\":%" PRIu64 "}}",
+                        names[event.type - TraceEventBindBuffer], ts, processId, osThreadId, event.deviceIndex,
+                        event.memory, event.object, event.offset, event.size);
+      break;
+    }
+    case TraceEventPresent:
+      length = snprintf(line, sizeof(line),
+                        "{\"name\":\"present\",\"cat\":\"frame\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,"
+                        "\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"args\":{\"device\":%u,\"frame\":%" PRIu64 "}}",
+                        ts, processId, osThreadId, event.deviceIndex, event.object);
+      break;
+    default:
+      break;
+    }
+
+    if (length <= 0)
+      return;
+
+    if (chromeEvents++ != 0)
+      chrome.buffer.insert(chrome.buffer.end(), { ',', '\n' });
+    chrome.buffer.insert(chrome.buffer.end(), line, line + std::min<size_t>(length, sizeof(line) - 1));
+  }
+
+  static void Write(Output &output)
+  {
+    if (output.file == NULL)
+      return;
+
+    if (!output.buffer.empty())
+      fwrite(output.buffer.data(), 1, output.buffer.size(), output.file);
+    output.buffer.clear();
+    fflush(output.file);
+  }
+
+  void Stop()
+  {
+    if (!thread.joinable())
+      return;
+
+    {
+      scoped_lock l(stopLock);
+      stop = true;
+    }
+    stopCondition.notify_one();
+    thread.join();
+
+    Drain(true);
+    enabled.store(false, std::memory_order_relaxed);
+
+    // rings of threads that are still alive are left alone, they may still write to them
+    {
+      scoped_lock l(ringsLock);
+      for (TraceRing *ring : rings)
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    }
+
+    if (dropped)
+      fprintf(stderr, "memory_track: %" PRIu64 " trace events dropped, the writer fell behind\n", dropped);
+
+    if (chrome.file)
+      fputs("\n]\n", chrome.file);
+
+    for (Output *output : { &binary, &chrome })
+    {
+      if (output->file)
+        fclose(output->file);
+      output->file = NULL;
+    }
+  }
+
+  std::atomic<bool> enabled;
+  std::thread thread;
+
+  std::mutex stopLock;
+  std::condition_variable stopCondition;
+  bool stop;
+
+  // serialises draining between the writer thread and Flush
+  std::mutex drainLock;
+  Output binary;
+  Output chrome;
+  uint64_t lastWrite;
+  uint64_t processId;
+  uint64_t chromeEvents;
+
+  std::mutex ringsLock;
+  std::vector<TraceRing *> rings;
+  uint32_t nextThreadId;
+  uint64_t dropped;
+};
+
+TraceWriter trace_writer;
+
+// read-mostly table from a loader dispatch pointer to our data for that object.
+// lookups are lock-free: writers, serialised by global_lock, copy the current
+// snapshot, change the copy and publish it with a single atomic store, RCU
+// style. readers never announce themselves, so there is no point at which an
+// old snapshot is known to be unused, and retired snapshots are only freed
+// when the layer is unloaded. instances and devices are created rarely enough
+// that this costs next to nothing.
+template<typename Data>
+class DispatchKeyTable
+{
+public:
+  DispatchKeyTable() : current(new Snapshot()) {}
+
+  ~DispatchKeyTable()
+  {
+    delete current.load();
+    for (const Snapshot *snapshot : retired)
+      delete snapshot;
+  }
+
+  Data *Find(void *key) const
+  {
+    const Snapshot *snapshot = current.load(std::memory_order_acquire);
+    for (const Entry &entry : *snapshot)
+    {
+      if (entry.key == key)
+        return entry.data;
+    }
+    return NULL;
+  }
+
+  // must be called with global_lock held
+  void Insert(void *key, Data *data)
+  {
+    Snapshot *snapshot = new Snapshot(*current.load(std::memory_order_relaxed));
+    Entry entry = { key, data };
+    snapshot->push_back(entry);
+    Publish(snapshot);
+  }
+
+  template<typename Func>
+  void ForEach(Func func) const
+  {
+    for (const Entry &entry : *current.load(std::memory_order_acquire))
+      func(entry.data);
+  }
+
+  // must be called with global_lock held, returns the removed data
+  Data *Erase(void *key)
+  {
+    Snapshot *snapshot = new Snapshot(*current.load(std::memory_order_relaxed));
+    Data *data = NULL;
+    for (auto it = snapshot->begin(); it != snapshot->end(); ++it)
+    {
+      if (it->key == key)
+      {
+        data = it->data;
+        snapshot->erase(it);
+        break;
+      }
+    }
+    Publish(snapshot);
+    return data;
+  }
+
+private:
+  struct Entry
+  {
+    void *key;
+    Data *data;
+  };
+
+  typedef std::vector<Entry> Snapshot;
+
+  void Publish(Snapshot *snapshot)
+  {
+    retired.push_back(current.exchange(snapshot, std::memory_order_acq_rel));
+  }
+
+  std::atomic<const Snapshot *> current;
+  std::vector<const Snapshot *> retired;
+};
+
+// everything we know about a single instance, owned by the instances table
+struct InstanceData
+{
+  VkLayerInstanceDispatchTable dispatch;
+};
+
+DispatchKeyTable<InstanceData> instances;
+
+// works for physical devices too, as they share their instance's dispatch table
+template<typename DispatchableType>
+InstanceData *GetInstanceData(DispatchableType object)
+{
+  return instances.Find(GetKey(object));
+}
+
+// actual data we're recording in this layer. the usage counters are atomics
+// updated without any lock
+struct alignas(CacheLineSize) MemoryTypeInfo
+{
+  VkMemoryType memoryType;
+  std::atomic<uint64_t> currentUsage;
+  std::atomic<uint64_t> maximumUsage;
+  std::atomic<uint64_t> allocationCount;
+  std::atomic<uint64_t> totalAllocations;
+};
+
+struct alignas(CacheLineSize) MemoryHeapInfo
+{
+  VkMemoryHeap memoryHeap;
+  std::atomic<uint64_t> currentUsage;
+  std::atomic<uint64_t> maximumUsage;
+  std::atomic<uint64_t> allocationCount;
+  std::atomic<uint64_t> totalAllocations;
+  // only ever grow, so the difference between two presents is what happened in that frame
+  std::atomic<uint64_t> totalAllocatedBytes;
+  std::atomic<uint64_t> totalFreedBytes;
+  std::atomic<uint64_t> totalFrees;
+  // the part of currentUsage that buffers and images are bound to
+  std::atomic<uint64_t> currentBound;
+  std::atomic<uint64_t> maximumBound;
+  // from MEMORY_TRACK_HEAP_BUDGET, 0 for none. reserved is currentUsage plus
+  // the allocations still on their way through the driver
+  uint64_t budget;
+  std::atomic<uint64_t> reserved;
+  std::atomic<uint64_t> budgetFailures;
+  // counted up before and after every change of the counters, see HeapChange
+  std::atomic<uint64_t> changesStarted;
+  std::atomic<uint64_t> changesFinished;
+};
+
+struct DeviceStats
+{
+    uint32_t memoryTypeCount;
+    uint32_t memoryHeapCount;
+    MemoryTypeInfo memoryTypes[VK_MAX_MEMORY_TYPES];
+    MemoryHeapInfo memoryHeaps[VK_MAX_MEMORY_HEAPS];
+};
+
+MemoryHeapInfo &GetMemoryHeapInfo(DeviceStats &deviceStats, uint32_t memoryTypeIndex)
+{
+  return deviceStats.memoryHeaps[deviceStats.memoryTypes[memoryTypeIndex].memoryType.heapIndex];
+}
+
+// brackets a change of a heap's counters, so that ReadHeapCounters can tell
+// whether it read all of them between changes. the counters themselves stay
+// lock-free, a change only costs two more atomic adds
+struct HeapChange
+{
+  HeapChange(MemoryHeapInfo &memoryHeapInfo) : memoryHeapInfo(memoryHeapInfo)
+  {
+    memoryHeapInfo.changesStarted.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  ~HeapChange()
+  {
+    memoryHeapInfo.changesFinished.fetch_add(1, std::memory_order_release);
+  }
+
+  MemoryHeapInfo &memoryHeapInfo;
+};
+
+struct HeapCounters
+{
+  uint64_t currentUsage;
+  uint64_t maximumUsage;
+  uint64_t currentBound;
+  uint64_t maximumBound;
+  uint64_t allocationCount;
+  uint64_t totalAllocations;
+};
+
+// a heap's counters as they were at one moment. if a change was under way or
+// started while they were read, they are read again
+HeapCounters ReadHeapCounters(const MemoryHeapInfo &memoryHeapInfo)
+{
+  HeapCounters counters;
+  for (;;)
+  {
+    uint64_t finished = memoryHeapInfo.changesFinished.load(std::memory_order_acquire);
+    counters.currentUsage = memoryHeapInfo.currentUsage.load(std::memory_order_relaxed);
+    counters.maximumUsage = memoryHeapInfo.maximumUsage.load(std::memory_order_relaxed);
+    counters.currentBound = memoryHeapInfo.currentBound.load(std::memory_order_relaxed);
+    counters.maximumBound = memoryHeapInfo.maximumBound.load(std::memory_order_relaxed);
+    counters.allocationCount = memoryHeapInfo.allocationCount.load(std::memory_order_relaxed);
+    counters.totalAllocations = memoryHeapInfo.totalAllocations.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (memoryHeapInfo.changesStarted.load(std::memory_order_relaxed) == finished)
+      return counters;
+  }
+}
+
+void AddUsage(DeviceStats &deviceStats, uint32_t memoryTypeIndex, uint64_t size)
+{
+  auto &memoryTypeInfo = deviceStats.memoryTypes[memoryTypeIndex];
+  auto &memoryHeapInfo = deviceStats.memoryHeaps[memoryTypeInfo.memoryType.heapIndex];
+  HeapChange change(memoryHeapInfo);
+
+  UpdateMaximum(memoryTypeInfo.maximumUsage,
+                memoryTypeInfo.currentUsage.fetch_add(size, std::memory_order_relaxed) + size);
+  UpdateMaximum(memoryHeapInfo.maximumUsage,
+                memoryHeapInfo.currentUsage.fetch_add(size, std::memory_order_relaxed) + size);
+  memoryTypeInfo.allocationCount.fetch_add(1, std::memory_order_relaxed);
+  memoryTypeInfo.totalAllocations.fetch_add(1, std::memory_order_relaxed);
+  memoryHeapInfo.allocationCount.fetch_add(1, std::memory_order_relaxed);
+  memoryHeapInfo.totalAllocations.fetch_add(1, std::memory_order_relaxed);
+  memoryHeapInfo.totalAllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+// takes the bytes still bound in the allocation out along with it, so that
+// the heap is never seen with more bound than allocated
+void SubtractUsage(DeviceStats &deviceStats, uint32_t memoryTypeIndex, uint64_t size, uint64_t boundSize)
+{
+  auto &memoryTypeInfo = deviceStats.memoryTypes[memoryTypeIndex];
+  auto &memoryHeapInfo = deviceStats.memoryHeaps[memoryTypeInfo.memoryType.heapIndex];
+  HeapChange change(memoryHeapInfo);
+
+  memoryTypeInfo.currentUsage.fetch_sub(size, std::memory_order_relaxed);
+  memoryHeapInfo.currentUsage.fetch_sub(size, std::memory_order_relaxed);
+  memoryTypeInfo.allocationCount.fetch_sub(1, std::memory_order_relaxed);
+  memoryHeapInfo.allocationCount.fetch_sub(1, std::memory_order_relaxed);
+  memoryHeapInfo.totalFrees.fetch_add(1, std::memory_order_relaxed);
+  memoryHeapInfo.totalFreedBytes.fetch_add(size, std::memory_order_relaxed);
+  memoryHeapInfo.currentBound.fetch_sub(boundSize, std::memory_order_relaxed);
+}
+
+// takes size bytes out of the heap's budget before the allocation is passed
+// down, so that allocations racing each other can't overshoot it together
+bool ReserveBudget(MemoryHeapInfo &memoryHeapInfo, uint64_t size)
+{
+  if (memoryHeapInfo.budget == 0)
+    return true;
+
+  uint64_t reserved = memoryHeapInfo.reserved.load(std::memory_order_relaxed);
+  do
+  {
+    if (size > memoryHeapInfo.budget - reserved)
+    {
+      memoryHeapInfo.budgetFailures.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!memoryHeapInfo.reserved.compare_exchange_weak(reserved, reserved + size, std::memory_order_relaxed));
+
+  return true;
+}
+
+void ReleaseBudget(MemoryHeapInfo &memoryHeapInfo, uint64_t size)
+{
+  if (memoryHeapInfo.budget != 0)
+    memoryHeapInfo.reserved.fetch_sub(size, std::memory_order_relaxed);
+}
+
+void AddBoundUsage(DeviceStats &deviceStats, uint32_t memoryTypeIndex, uint64_t size)
+{
+  auto &memoryHeapInfo = deviceStats.memoryHeaps[deviceStats.memoryTypes[memoryTypeIndex].memoryType.heapIndex];
+  HeapChange change(memoryHeapInfo);
+
+  UpdateMaximum(memoryHeapInfo.maximumBound,
+                memoryHeapInfo.currentBound.fetch_add(size, std::memory_order_relaxed) + size);
+}
+
+void SubtractBoundUsage(DeviceStats &deviceStats, uint32_t memoryTypeIndex, uint64_t size)
+{
+  auto &memoryHeapInfo = deviceStats.memoryHeaps[deviceStats.memoryTypes[memoryTypeIndex].memoryType.heapIndex];
+  HeapChange change(memoryHeapInfo);
+
+  memoryHeapInfo.currentBound.fetch_sub(size, std::memory_order_relaxed);
+}
+
+// devices are numbered so that allocation records can refer to their owner
+// in a few bits
+static const uint32_t MaxDevices = 256;
+bool device_index_used[MaxDevices];
+
+enum AllocationFlags
+{
+  // VK_NV_dedicated_allocation, with an image or buffer given
+  AllocationFlagDedicated = 0x1,
+  // VK_NV_external_memory, exportable to other APIs or processes
+  AllocationFlagExported = 0x2,
+  // VK_NV_external_memory_win32, imported from a handle
+  AllocationFlagImported = 0x4,
+};
+
+// what we remember about a live allocation, packed so that four records fit
+// in a cache line. pNext chains are only valid during vkAllocateMemory, so
+// whatever we need from them is boiled down to flags when the record is made.
+// sizes are limited to 256 TiB, far beyond any real heap, and timestamps wrap
+// around after about 12 days, so only compare them or subtract them modulo
+// TimestampMask
+struct AllocationRecord
+{
+  uint64_t size : 48;
+  uint64_t memoryTypeIndex : 5;
+  uint64_t flags : 3;
+  uint64_t deviceIndex : 8;
+  uint64_t timestamp : 40; // see NowMicroseconds
+  uint64_t extended : 1;   // allocated with a pNext chain, see RecycleCache
+  uint64_t stackId : 23;   // see StackTable, 0 if no stack was captured
+};
+
+static const uint64_t TimestampMask = (1ULL << 40) - 1;
+
+static_assert(sizeof(AllocationRecord) * 4 <= CacheLineSize, "allocation records should stay compact");
+
+// the common head of all Vulkan structures, for walking pNext chains
+struct StructureHeader
+{
+  VkStructureType sType;
+  const void *pNext;
+};
+
+uint32_t GetAllocationFlags(const VkMemoryAllocateInfo *pAllocateInfo)
+{
+  uint32_t flags = 0;
+  for (const StructureHeader *next = (const StructureHeader *)pAllocateInfo->pNext; next;
+       next = (const StructureHeader *)next->pNext)
+  {
+    switch (next->sType)
+    {
+      case VK_STRUCTURE_TYPE_DEDICATED_ALLOCATION_MEMORY_ALLOCATE_INFO_NV:
+      {
+        const auto *dedicated = (const VkDedicatedAllocationMemoryAllocateInfoNV *)next;
+        if (dedicated->image != VK_NULL_HANDLE || dedicated->buffer != VK_NULL_HANDLE)
+          flags |= AllocationFlagDedicated;
+        break;
+      }
+      case VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO_NV:
+        flags |= AllocationFlagExported;
+        break;
+      case VK_STRUCTURE_TYPE_IMPORT_MEMORY_WIN32_HANDLE_INFO_NV:
+        flags |= AllocationFlagImported;
+        break;
+      default:
+        break;
+    }
+  }
+  return flags;
+}
+
+// how an allocation has been mapped. only allocations that were mapped at
+// least once get one of these, and keep it until they are freed
+struct MappingRecord
+{
+  uint64_t mapOffset;
+  uint64_t mappedBytes;   // 0 while not mapped
+  uint64_t mapTimestamp;  // see NowMicroseconds
+  uint64_t mapCount;
+  uint64_t mappedTime;    // microseconds, over all mappings that ended
+  // frames in a row in which the whole mapping was flushed or invalidated
+  uint64_t wholeFlushFrame;
+  uint32_t wholeFlushStreak;
+  uint32_t maximumWholeFlushStreak;
+};
+
+// which parts of an allocation are occupied by the resources bound to it.
+// only allocations that have something bound get one of these
+struct AllocationUsage
+{
+  uint64_t boundBytes;
+  RangeIndex ranges;
+};
+
+// keep track of all allocations so we can properly account them on free.
+// allocations are spread over several shards by handle, so that threads
+// allocating from the same device rarely wait on each other
+struct AllocationShard
+{
+  std::mutex lock;
+  HandleMap<AllocationRecord> allocations;
+  HandleMap<AllocationUsage> usage;
+  HandleMap<MappingRecord> mappings;
+};
+
+// what we remember about a buffer or image
+struct ResourceRecord
+{
+  // from the memory requirements, 0 until the app or we have queried them
+  uint64_t size;
+  // the allocation it's bound to, or 0 while unbound. the allocation's
+  // timestamp tells it apart from a later allocation reusing the handle
+  uint64_t memory;
+  uint64_t memoryTimestamp;
+  uint64_t offset;
+};
+
+// buffers and images are sharded the same way as allocations
+struct ResourceShard
+{
+  std::mutex lock;
+  HandleMap<ResourceRecord> resources;
+};
+
+static const uint32_t ShardCount = 16;
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Per-frame statistics
+//
+// a frame ends whenever the app presents. the heap counters only ever grow, so
+// at each present we take the difference to the previous one instead of
+// resetting anything, which keeps allocating and freeing free of any extra
+// synchronisation with the presenting thread
+
+// what one heap saw during one frame
+struct FrameHeapStats
+{
+  uint64_t allocatedBytes;
+  uint64_t freedBytes;
+  uint64_t currentUsage;      // at the end of the frame
+  uint32_t allocations;
+  uint32_t frees;
+};
+
+struct FrameInfo
+{
+  uint64_t frame;             // counted from the device's first present
+  uint64_t duration;          // microseconds since the previous present
+  uint64_t churn;             // bytes allocated plus bytes freed, over all heaps
+};
+
+// a list of frames, each with heapCount heap entries stored back to back
+struct FrameList
+{
+  std::vector<FrameInfo> frames;
+  std::vector<FrameHeapStats> heaps;
+
+  FrameHeapStats *Heaps(size_t index, uint32_t heapCount)
+  {
+    return &heaps[index * heapCount];
+  }
+};
+
+struct FrameStats
+{
+  std::mutex lock;
+  uint64_t frameCount;
+  // frameCount, for reading without the lock
+  std::atomic<uint64_t> currentFrame;
+  uint64_t lastPresent;
+  // heap counters at the previous present
+  uint64_t lastAllocations[VK_MAX_MEMORY_HEAPS];
+  uint64_t lastFrees[VK_MAX_MEMORY_HEAPS];
+  uint64_t lastAllocatedBytes[VK_MAX_MEMORY_HEAPS];
+  uint64_t lastFreedBytes[VK_MAX_MEMORY_HEAPS];
+
+  // the most recent frames as a ring, indexed by frame number
+  FrameList history;
+  // the frames with the most churn so far, in no particular order
+  FrameList worst;
+};
+
+void InitFrameStats(FrameStats &frameStats, uint32_t heapCount)
+{
+  frameStats.frameCount = 0;
+  frameStats.currentFrame.store(0, std::memory_order_relaxed);
+  frameStats.lastPresent = NowMicroseconds();
+  memset(frameStats.lastAllocations, 0, sizeof(frameStats.lastAllocations));
+  memset(frameStats.lastFrees, 0, sizeof(frameStats.lastFrees));
+  memset(frameStats.lastAllocatedBytes, 0, sizeof(frameStats.lastAllocatedBytes));
+  memset(frameStats.lastFreedBytes, 0, sizeof(frameStats.lastFreedBytes));
+
+  frameStats.history.frames.resize(config.frameHistory);
+  frameStats.history.heaps.resize(config.frameHistory * heapCount);
+  frameStats.worst.frames.reserve(config.worstFrames);
+  frameStats.worst.heaps.reserve(config.worstFrames * heapCount);
+}
+
+// closes the current frame and starts the next one
+void EndFrame(const DeviceStats &deviceStats, FrameStats &frameStats)
+{
+  const uint32_t heapCount = deviceStats.memoryHeapCount;
+  FrameInfo info;
+  FrameHeapStats heaps[VK_MAX_MEMORY_HEAPS];
+
+  scoped_lock l(frameStats.lock);
+
+  uint64_t now = NowMicroseconds();
+  info.frame = frameStats.frameCount++;
+  frameStats.currentFrame.store(frameStats.frameCount, std::memory_order_relaxed);
+  info.duration = now - frameStats.lastPresent;
+  info.churn = 0;
+  frameStats.lastPresent = now;
+
+  for (uint32_t i = 0; i < heapCount; i++)
+  {
+    const auto &heapInfo = deviceStats.memoryHeaps[i];
+    uint64_t allocations = heapInfo.totalAllocations.load(std::memory_order_relaxed);
+    uint64_t frees = heapInfo.totalFrees.load(std::memory_order_relaxed);
+    uint64_t allocatedBytes = heapInfo.totalAllocatedBytes.load(std::memory_order_relaxed);
+    uint64_t freedBytes = heapInfo.totalFreedBytes.load(std::memory_order_relaxed);
+
+    heaps[i].allocations = (uint32_t)(allocations - frameStats.lastAllocations[i]);
+    heaps[i].frees = (uint32_t)(frees - frameStats.lastFrees[i]);
+    heaps[i].allocatedBytes = allocatedBytes - frameStats.lastAllocatedBytes[i];
+    heaps[i].freedBytes = freedBytes - frameStats.lastFreedBytes[i];
+    heaps[i].currentUsage = heapInfo.currentUsage.load(std::memory_order_relaxed);
+    info.churn += heaps[i].allocatedBytes + heaps[i].freedBytes;
+
+    frameStats.lastAllocations[i] = allocations;
+    frameStats.lastFrees[i] = frees;
+    frameStats.lastAllocatedBytes[i] = allocatedBytes;
+    frameStats.lastFreedBytes[i] = freedBytes;
+  }
+
+  FrameList &history = frameStats.history;
+  if (!history.frames.empty())
+  {
+    size_t slot = info.frame % history.frames.size();
+    history.frames[slot] = info;
+    std::copy(heaps, heaps + heapCount, history.Heaps(slot, heapCount));
+  }
+
+  // replace the least busy of the worst frames once the list is full
+  FrameList &worst = frameStats.worst;
+  if (worst.frames.size() < config.worstFrames)
+  {
+    worst.frames.push_back(info);
+    worst.heaps.insert(worst.heaps.end(), heaps, heaps + heapCount);
+  }
+  else if (!worst.frames.empty())
+  {
+    size_t least = 0;
+    for (size_t i = 1; i < worst.frames.size(); i++)
+    {
+      if (worst.frames[i].churn < worst.frames[least].churn)
+        least = i;
+    }
+
+    if (info.churn > worst.frames[least].churn)
+    {
+      worst.frames[least] = info;
+      std::copy(heaps, heaps + heapCount, worst.Heaps(least, heapCount));
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Allocation lifetimes
+//
+// every free counts the allocation's lifetime into a histogram per memory type
+// and size class, to find code that allocates and frees the same sizes over
+// and over instead of keeping the memory around. the size classes and
+// lifetime buckets are in histogram.h
+
+struct LifetimeStats
+{
+  std::atomic<uint64_t> counts[VK_MAX_MEMORY_TYPES][SizeClassCount][LifetimeBucketCount];
+};
+
+void RecordLifetime(LifetimeStats &lifetimeStats, const AllocationRecord &record, uint64_t now)
+{
+  uint64_t lifetime = (now - record.timestamp) & TimestampMask;
+  lifetimeStats.counts[record.memoryTypeIndex][GetSizeClass(record.size)][GetLifetimeBucket(lifetime)]
+      .fetch_add(1, std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Driver call latencies
+//
+// every vkAllocateMemory and vkFreeMemory that reaches the driver is timed on
+// its own, to tell how slow the driver is apart from what the layer adds. the
+// times go into histograms per memory type and per size class, to show which
+// memory is worth pooling first. the clock is steady_clock, which on Linux is
+// clock_gettime reading the TSC through the vDSO, a few tens of nanoseconds
+// without a syscall. the histograms' buckets are in histogram.h
+
+// freeing memory the layer doesn't know the type of isn't timed
+static const uint32_t UnknownMemoryType = VK_MAX_MEMORY_TYPES;
+
+struct LatencyHistogram
+{
+  std::atomic<uint64_t> counts[LatencyBucketCount];
+  std::atomic<uint64_t> totalTime;
+  std::atomic<uint64_t> maximumTime;
+};
+
+struct DriverCallStats
+{
+  LatencyHistogram memoryTypes[VK_MAX_MEMORY_TYPES];
+  LatencyHistogram sizeClasses[SizeClassCount];
+};
+
+struct DriverLatencyStats
+{
+  DriverCallStats allocations;
+  DriverCallStats frees;
+};
+
+void RecordLatency(LatencyHistogram &histogram, uint64_t nanoseconds)
+{
+  histogram.counts[GetLatencyBucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+  histogram.totalTime.fetch_add(nanoseconds, std::memory_order_relaxed);
+  UpdateMaximum(histogram.maximumTime, nanoseconds);
+}
+
+void RecordDriverCall(DriverCallStats &callStats, uint32_t memoryTypeIndex, uint64_t size, uint64_t nanoseconds)
+{
+  if (memoryTypeIndex == UnknownMemoryType)
+    return;
+
+  RecordLatency(callStats.memoryTypes[memoryTypeIndex], nanoseconds);
+  RecordLatency(callStats.sizeClasses[GetSizeClass(size)], nanoseconds);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Mappings
+//
+// mapped bytes and the lifetime of every mapping are counted per heap, and
+// allocations that are mapped and unmapped over and over are remembered as
+// candidates for mapping once and staying mapped, since mapping costs a
+// kernel call or more on some drivers
+
+// allocations mapped at least this many times are candidates
+static const uint64_t MinRemapCount = 8;
+
+struct alignas(CacheLineSize) HeapMapStats
+{
+  std::atomic<uint64_t> currentMapped;
+  std::atomic<uint64_t> maximumMapped;
+  std::atomic<uint64_t> maps;
+  // by GetLifetimeBucket
+  std::atomic<uint64_t> lifetimes[LifetimeBucketCount];
+};
+
+// an allocation worth reporting for how it was mapped
+struct MappedAllocation
+{
+  uint64_t memory;
+  uint64_t size;
+  uint32_t memoryTypeIndex;
+  uint32_t stackId;
+  MappingRecord mapping;
+  bool freed;
+};
+
+struct MapStats
+{
+  HeapMapStats heaps[VK_MAX_MEMORY_HEAPS];
+
+  // the freed candidates with the highest counts, live ones are looked up
+  // when reporting
+  static const size_t MaxFreedCandidates = 20;
+  std::mutex lock;
+  std::vector<MappedAllocation> freedRemapped;
+  std::vector<MappedAllocation> freedOverflushed;
+};
+
+void AddMapping(MapStats &mapStats, uint32_t heapIndex, uint64_t size)
+{
+  HeapMapStats &heap = mapStats.heaps[heapIndex];
+  UpdateMaximum(heap.maximumMapped, heap.currentMapped.fetch_add(size, std::memory_order_relaxed) + size);
+  heap.maps.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RemoveMapping(MapStats &mapStats, uint32_t heapIndex, uint64_t size, uint64_t lifetime)
+{
+  HeapMapStats &heap = mapStats.heaps[heapIndex];
+  heap.currentMapped.fetch_sub(size, std::memory_order_relaxed);
+  heap.lifetimes[GetLifetimeBucket(lifetime)].fetch_add(1, std::memory_order_relaxed);
+}
+
+// keeps the freed allocations with the highest count in a bounded list
+template<typename Count>
+void AddFreedCandidate(MapStats &mapStats, std::vector<MappedAllocation> &candidates,
+                       const MappedAllocation &candidate, Count count)
+{
+  scoped_lock l(mapStats.lock);
+  if (candidates.size() < MapStats::MaxFreedCandidates)
+  {
+    candidates.push_back(candidate);
+    return;
+  }
+
+  auto lowest = std::min_element(candidates.begin(), candidates.end(), [&count](const MappedAllocation &a, const MappedAllocation &b)
+  {
+    return count(a) < count(b);
+  });
+  if (count(*lowest) < count(candidate))
+    *lowest = candidate;
+}
+
+uint64_t GetMapCount(const MappedAllocation &allocation)
+{
+  return allocation.mapping.mapCount;
+}
+
+uint64_t GetWholeFlushStreak(const MappedAllocation &allocation)
+{
+  return allocation.mapping.maximumWholeFlushStreak;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Flushes and invalidations
+//
+// flushes and invalidations of non-coherent memory are counted per memory
+// type along with how much of their allocations they cover, and allocations
+// that are flushed or invalidated whole frame after frame are reported, as
+// flushing more than was written costs real time on non-coherent hardware
+
+// allocations flushed or invalidated whole for this many frames in a row are reported
+static const uint32_t MinWholeFlushStreak = 8;
+
+struct alignas(CacheLineSize) RangeStats
+{
+  std::atomic<uint64_t> calls;
+  std::atomic<uint64_t> ranges;
+  std::atomic<uint64_t> bytes;
+  // sizes of the allocations the ranges are in, to relate bytes to
+  std::atomic<uint64_t> allocationBytes;
+  // ranges that cover the whole mapping, by VK_WHOLE_SIZE or otherwise
+  std::atomic<uint64_t> wholeRanges;
+};
+
+struct FlushStats
+{
+  RangeStats flushes[VK_MAX_MEMORY_TYPES];
+  RangeStats invalidations[VK_MAX_MEMORY_TYPES];
+};
+
+// counts a flushed or invalidated range into the mapping it falls into,
+// returns the bytes it covers and whether that is the whole mapping
+uint64_t RecordFlushRange(MappingRecord &mapping, const VkMappedMemoryRange &range, uint64_t frame, bool *whole)
+{
+  uint64_t mapEnd = mapping.mapOffset + mapping.mappedBytes;
+  uint64_t end = range.size == VK_WHOLE_SIZE ? mapEnd : range.offset + range.size;
+  *whole = range.offset <= mapping.mapOffset && end >= mapEnd;
+
+  if (*whole && (mapping.wholeFlushStreak == 0 || mapping.wholeFlushFrame != frame))
+  {
+    bool consecutive = mapping.wholeFlushStreak != 0 && mapping.wholeFlushFrame + 1 == frame;
+    mapping.wholeFlushStreak = consecutive ? mapping.wholeFlushStreak + 1 : 1;
+    mapping.wholeFlushFrame = frame;
+    mapping.maximumWholeFlushStreak = std::max(mapping.maximumWholeFlushStreak, mapping.wholeFlushStreak);
+  }
+
+  return end > range.offset ? end - range.offset : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Allocation call stacks
+//
+// when MEMORY_TRACK_STACK_DEPTH is set, every allocation captures the return
+// addresses of its callers by following the chain of frame pointers, which
+// only costs a few loads per frame. code built without frame pointers simply
+// ends the stack early. the addresses are only turned into names when the
+// report is printed
+//
+// with MEMORY_TRACK_SAMPLE_BYTES set, stacks are sampled by bytes rather than
+// by allocation, like tcmalloc's heap profiler: picture a sample point dropped
+// at random on average every N allocated bytes, and capture the stack of any
+// allocation that one lands in. an allocation of S bytes is then sampled with
+// probability 1 - exp(-S/N), and counting it as 1 / that many allocations of S
+// bytes keeps the totals per stack unbiased. large allocations are nearly
+// always sampled, and the cost stays about one capture per N bytes
+
+static const uint32_t MaxStackDepth = 32; // keep in sync with ReadConfig
+
+struct CallStack
+{
+  uint32_t depth;
+  void *frames[MaxStackDepth];
+};
+
+#if defined(WIN32)
+
+__declspec(noinline) void CaptureStack(CallStack &stack, uint32_t maxDepth)
+{
+  // skip ourselves, so the stack starts at whoever called vkAllocateMemory
+  stack.depth = RtlCaptureStackBackTrace(2, maxDepth, stack.frames, NULL);
+}
+
+#elif defined(__linux__)
+
+// the bounds of the calling thread's stack, so a frame pointer that was
+// reused as a general register can't send the walk off into the weeds
+struct StackBounds
+{
+  StackBounds() : low(0), high(0)
+  {
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+      return;
+
+    void *address;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &address, &size) == 0)
+    {
+      low = (uintptr_t)address;
+      high = low + size;
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  uintptr_t low, high;
+};
+
+thread_local StackBounds stack_bounds;
+
+// the walk reads whatever the frame pointers point at, which in code built
+// without them can be any word on the stack, so AddressSanitizer is kept out
+__attribute__((noinline, no_sanitize_address)) void CaptureStack(CallStack &stack, uint32_t maxDepth)
+{
+  const StackBounds &bounds = stack_bounds;
+  stack.depth = 0;
+
+  // every frame starts with the caller's frame pointer, followed by the
+  // return address. skip our own frame and MemoryTrack_AllocateMemory's return
+  // address, so the stack starts at whoever called vkAllocateMemory
+  uintptr_t *frame = (uintptr_t *)__builtin_frame_address(0);
+  bool skip = true;
+  while (stack.depth < maxDepth)
+  {
+    uintptr_t address = (uintptr_t)frame;
+    if (address < bounds.low || address + 2 * sizeof(uintptr_t) > bounds.high ||
+        address % sizeof(uintptr_t) != 0)
+      break;
+
+    uintptr_t returnAddress = frame[1];
+    if (returnAddress == 0)
+      break;
+
+    if (!skip)
+      stack.frames[stack.depth++] = (void *)returnAddress;
+    skip = false;
+
+    // stacks grow down, so callers' frames are always at higher addresses
+    uintptr_t *next = (uintptr_t *)frame[0];
+    if (next <= frame)
+      break;
+    frame = next;
+  }
+}
+
+#else
+
+void CaptureStack(CallStack &stack, uint32_t maxDepth)
+{
+  stack.depth = 0;
+}
+
+#endif
+
+uint64_t HashStack(const CallStack &stack)
+{
+  // FNV-1a over the addresses
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (uint32_t i = 0; i < stack.depth; i++)
+  {
+    hash ^= (uint64_t)(uintptr_t)stack.frames[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// decides which allocations of a thread get their stack captured. the
+// distance to the next sample point is exponentially distributed, which has
+// no memory, so it can be drawn afresh after every sample
+class StackSampler
+{
+public:
+  StackSampler() : bytesUntilSample(NextInterval())
+  {
+  }
+
+  bool Sample(uint64_t size)
+  {
+    if (config.sampleBytes == 0)
+      return true;
+
+    if (size < bytesUntilSample)
+    {
+      bytesUntilSample -= size;
+      return false;
+    }
+
+    bytesUntilSample = NextInterval();
+    return true;
+  }
+
+private:
+  uint64_t NextInterval()
+  {
+    return (uint64_t)(-log(random.Uniform()) * config.sampleBytes) + 1;
+  }
+
+  Random random;
+  uint64_t bytesUntilSample;
+};
+
+bool SampleStack(uint64_t size)
+{
+  static thread_local StackSampler sampler;
+  return sampler.Sample(size);
+}
+
+// allocation counts per stack are kept in fixed point, as sampled ones count
+// for a fraction more than one
+static const uint64_t StackCountScale = 1 << 16;
+
+struct StackWeight
+{
+  uint64_t bytes;
+  uint64_t count;   // in units of 1 / StackCountScale
+};
+
+// how much a captured allocation of this size stands for. the same size always
+// gives the same weight, so a free takes away exactly what its allocation added
+StackWeight GetStackWeight(uint64_t size)
+{
+  StackWeight weight = { size, StackCountScale };
+  if (config.sampleBytes == 0 || size == 0)
+    return weight;
+
+  double probability = -expm1(-(double)size / config.sampleBytes);
+  weight.bytes = (uint64_t)(size / probability + 0.5);
+  weight.count = (uint64_t)(StackCountScale / probability + 0.5);
+  return weight;
+}
+
+// what was allocated from one call stack, estimated when sampling
+struct StackEntry
+{
+  CallStack stack;
+  std::atomic<uint64_t> liveBytes;
+  std::atomic<uint64_t> peakBytes;
+  std::atomic<uint64_t> allocations;   // in units of 1 / StackCountScale
+  std::atomic<uint64_t> samples;       // allocations actually captured
+};
+
+// every distinct call stack seen on a device, stored once and referred to by
+// a small id. looking up or adding a stack takes one of a few locks chosen by
+// the stack's hash; the entries themselves never move once created, so
+// updating a stack's counters by id needs no lock at all
+class StackTable
+{
+public:
+  StackTable() : nextId(1)
+  {
+    for (auto &chunk : chunks)
+      chunk.store(NULL, std::memory_order_relaxed);
+  }
+
+  ~StackTable()
+  {
+    for (auto &chunk : chunks)
+      delete[] chunk.load(std::memory_order_relaxed);
+  }
+
+  // returns the id of the stack, adding it if it's new. 0 if the table is full.
+  // the stack must have at least one frame, empty entries are skipped by ForEach
+  uint32_t Intern(const CallStack &stack)
+  {
+    uint64_t hash = HashStack(stack);
+    Shard &shard = shards[hash % ShardCount];
+    scoped_lock l(shard.lock);
+
+    // keys are odd, as 0 marks an empty slot. on the off chance that two
+    // different stacks have the same hash, the later one gets the next free key
+    uint64_t key = hash | 1;
+    for (;; key += 2)
+    {
+      uint32_t *id = shard.ids.Find(key);
+      if (id == NULL)
+        break;
+
+      const CallStack &existing = Get(*id).stack;
+      if (existing.depth == stack.depth &&
+          memcmp(existing.frames, stack.frames, stack.depth * sizeof(stack.frames[0])) == 0)
+        return *id;
+    }
+
+    uint32_t id = nextId.fetch_add(1, std::memory_order_relaxed);
+    if (id >= MaxStacks)
+      return 0;
+
+    StackEntry &entry = GetOrCreate(id);
+    entry.stack = stack;
+    shard.ids.Insert(key) = id;
+    return id;
+  }
+
+  // id must have come from Intern
+  StackEntry &Get(uint32_t id)
+  {
+    return chunks[id / ChunkSize].load(std::memory_order_acquire)[id % ChunkSize];
+  }
+
+  template<typename Func>
+  void ForEach(Func func)
+  {
+    uint32_t count = std::min(nextId.load(std::memory_order_relaxed), MaxStacks);
+    for (uint32_t id = 1; id < count; id++)
+    {
+      StackEntry *chunk = chunks[id / ChunkSize].load(std::memory_order_acquire);
+      if (chunk && chunk[id % ChunkSize].stack.depth > 0)
+        func(chunk[id % ChunkSize]);
+    }
+  }
+
+private:
+  // ids have to fit AllocationRecord::stackId
+  static const uint32_t MaxStacks = 1 << 23;
+  static const uint32_t ChunkSize = 1024;
+  static const uint32_t ShardCount = 16;
+
+  struct Shard
+  {
+    std::mutex lock;
+    HandleMap<uint32_t> ids;
+  };
+
+  StackEntry &GetOrCreate(uint32_t id)
+  {
+    std::atomic<StackEntry *> &chunk = chunks[id / ChunkSize];
+    StackEntry *entries = chunk.load(std::memory_order_acquire);
+    if (entries == NULL)
+    {
+      // another shard may be creating the same chunk, only one of them wins
+      StackEntry *created = new StackEntry[ChunkSize]();
+      if (chunk.compare_exchange_strong(entries, created, std::memory_order_acq_rel))
+        entries = created;
+      else
+        delete[] created;
+    }
+    return entries[id % ChunkSize];
+  }
+
+  Shard shards[ShardCount];
+  std::atomic<uint32_t> nextId;
+  std::atomic<StackEntry *> chunks[MaxStacks / ChunkSize];
+};
+
+void AddStackUsage(StackTable &stackTable, uint32_t stackId, uint64_t size)
+{
+  StackEntry &entry = stackTable.Get(stackId);
+  StackWeight weight = GetStackWeight(size);
+  UpdateMaximum(entry.peakBytes, entry.liveBytes.fetch_add(weight.bytes, std::memory_order_relaxed) + weight.bytes);
+  entry.allocations.fetch_add(weight.count, std::memory_order_relaxed);
+  entry.samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SubtractStackUsage(StackTable &stackTable, uint32_t stackId, uint64_t size)
+{
+  stackTable.Get(stackId).liveBytes.fetch_sub(GetStackWeight(size).bytes, std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Memory recycling
+//
+// with MEMORY_TRACK_RECYCLE_BYTES set, freed memory isn't given back to the
+// driver right away but parked by memory type and size class, and handed to
+// the next allocation of the same type and class instead of calling the
+// driver. a size class spans a quarter of a power of two, so a recycled block
+// is less than a quarter larger than what was asked for, and counts as used
+// with its full size. once more than the cap is parked, the blocks parked
+// longest ago are freed for real.
+//
+// only plain allocations are recycled: without a pNext chain or allocation
+// callbacks, and not host visible, as those could still be mapped. parked
+// memory no longer counts as used, nor towards MEMORY_TRACK_HEAP_BUDGET
+
+class RecycleCache
+{
+public:
+  explicit RecycleCache(const VkPhysicalDeviceMemoryProperties &memoryProperties)
+    : recyclableTypes(0)
+  {
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+      if (!(memoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
+        recyclableTypes |= 1u << i;
+
+    for (List &list : slots)
+      list.head = list.tail = InvalidNode;
+    age.head = age.tail = freeNodes.head = freeNodes.tail = InvalidNode;
+  }
+
+  // a parked block on its way back to the driver
+  struct Block
+  {
+    VkDeviceMemory memory;
+    uint32_t memoryTypeIndex;
+    uint64_t size;
+  };
+
+  bool Recyclable(uint32_t memoryTypeIndex, uint64_t size) const
+  {
+    return (recyclableTypes >> memoryTypeIndex & 1) && size != 0 && size <= config.recycleBytes;
+  }
+
+  // the most recently parked block of the size class that is large enough.
+  // its real size goes to *pSize, as it can be larger than what was asked for
+  bool Take(uint32_t memoryTypeIndex, uint64_t size, VkDeviceMemory *pMemory, uint64_t *pSize)
+  {
+    static const uint32_t MaxProbes = 16;
+
+    scoped_lock l(lock);
+    List &slot = slots[GetSlot(memoryTypeIndex, size)];
+    uint32_t probes = 0;
+    for (uint32_t index = slot.tail; index != InvalidNode && probes < MaxProbes; index = nodes[index].slot.prev, probes++)
+    {
+      Node &node = nodes[index];
+      if (node.size < size)
+        continue;
+
+      *pMemory = node.memory;
+      *pSize = node.size;
+      Remove(index);
+      hits++;
+      return true;
+    }
+
+    misses++;
+    return false;
+  }
+
+  // returns false if the block has to be freed after all. blocks pushed out
+  // to stay under the cap are added to evicted, for the caller to free
+  bool Park(VkDeviceMemory memory, uint32_t memoryTypeIndex, uint64_t size, std::vector<Block> &evicted)
+  {
+    if (!Recyclable(memoryTypeIndex, size))
+      return false;
+
+    scoped_lock l(lock);
+    while (parkedBytes + size > config.recycleBytes)
+    {
+      evicted.push_back(GetBlock(age.head));
+      Remove(age.head);
+      evictions++;
+    }
+
+    uint32_t index = freeNodes.head;
+    if (index != InvalidNode)
+      Unlink(freeNodes, &Node::slot, index);
+    else
+    {
+      index = (uint32_t)nodes.size();
+      nodes.emplace_back();
+    }
+
+    Node &node = nodes[index];
+    node.memory = memory;
+    node.size = size;
+    node.slotIndex = GetSlot(memoryTypeIndex, size);
+    Append(slots[node.slotIndex], &Node::slot, index);
+    Append(age, &Node::age, index);
+
+    parkedBytes += size;
+    maximumParkedBytes = std::max(maximumParkedBytes, parkedBytes);
+    return true;
+  }
+
+  // hands every parked block to the caller to free, when the device goes away
+  void Drain(std::vector<Block> &blocks)
+  {
+    scoped_lock l(lock);
+    while (age.head != InvalidNode)
+    {
+      blocks.push_back(GetBlock(age.head));
+      Remove(age.head);
+    }
+  }
+
+  void Print()
+  {
+    scoped_lock l(lock);
+    uint64_t attempts = hits + misses;
+    printf("Recycled memory: %" PRIu64 " of %" PRIu64 " allocations reused a freed block (%.1f%%),"
+           " saving as many driver allocations and frees\n", hits, attempts, attempts ? 100.0 * hits / attempts : 0.0);
+    printf("  at most %" PRIu64 " bytes parked, %" PRIu64 " blocks evicted to stay under %" PRIu64 " bytes\n",
+           maximumParkedBytes, evictions, config.recycleBytes);
+  }
+
+private:
+  static const uint32_t InvalidNode = UINT32_MAX;
+  static const uint32_t ClassesPerLog2 = 4;
+  static const uint32_t ClassCount = 64 * ClassesPerLog2;
+
+  // the free nodes are chained through slot
+  struct Link
+  {
+    uint32_t prev, next;
+  };
+
+  struct Node
+  {
+    VkDeviceMemory memory;
+    uint64_t size;
+    uint32_t slotIndex;
+    Link slot;  // in the list of its type and size class
+    Link age;   // in the list of all parked blocks, oldest first
+  };
+
+  struct List
+  {
+    uint32_t head, tail;
+  };
+
+  static uint32_t GetSlot(uint32_t memoryTypeIndex, uint64_t size)
+  {
+    uint32_t log2 = FloorLog2(size);
+    uint32_t subclass = log2 < 2 ? 0 : (uint32_t)(size >> (log2 - 2)) & (ClassesPerLog2 - 1);
+    return memoryTypeIndex * ClassCount + log2 * ClassesPerLog2 + subclass;
+  }
+
+  void Append(List &list, Link Node::*link, uint32_t index)
+  {
+    (nodes[index].*link).prev = list.tail;
+    (nodes[index].*link).next = InvalidNode;
+    if (list.tail != InvalidNode)
+      (nodes[list.tail].*link).next = index;
+    else
+      list.head = index;
+    list.tail = index;
+  }
+
+  void Unlink(List &list, Link Node::*link, uint32_t index)
+  {
+    Link &l = nodes[index].*link;
+    if (l.prev != InvalidNode)
+      (nodes[l.prev].*link).next = l.next;
+    else
+      list.head = l.next;
+    if (l.next != InvalidNode)
+      (nodes[l.next].*link).prev = l.prev;
+    else
+      list.tail = l.prev;
+  }
+
+  Block GetBlock(uint32_t index) const
+  {
+    const Node &node = nodes[index];
+    return { node.memory, node.slotIndex / ClassCount, node.size };
+  }
+
+  // takes a parked block out of both lists and recycles its node
+  void Remove(uint32_t index)
+  {
+    Node &node = nodes[index];
+    Unlink(slots[node.slotIndex], &Node::slot, index);
+    Unlink(age, &Node::age, index);
+    Append(freeNodes, &Node::slot, index);
+    parkedBytes -= node.size;
+  }
+
+  std::mutex lock;
+  uint32_t recyclableTypes;
+  std::vector<Node> nodes;
+  List slots[VK_MAX_MEMORY_TYPES * ClassCount];
+  List age;
+  List freeNodes;
+  uint64_t parkedBytes = 0;
+  uint64_t maximumParkedBytes = 0;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t evictions = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Host memory
+//
+// with MEMORY_TRACK_HOST_MEMORY set, the driver's host allocations are counted
+// too: the layer hands its own allocation callbacks to vkCreateDevice and to
+// the object creation calls it intercepts, and they forward to the
+// application's callbacks, or to the C heap when it gave none. objects created
+// without callbacks are still passed none, as the driver then falls back to
+// the device's, which are already the layer's.
+//
+// every allocation gets a small header in front recording its size, scope and
+// the kind of object the allocating thread was creating, so that freeing it
+// takes away exactly what it added. each thread counts into its own block,
+// which only it writes, and the blocks are summed up for the report.
+
+enum HostObjectType
+{
+  HostObjectOther,  // allocated outside the calls the layer intercepts
+  HostObjectDevice,
+  HostObjectMemory,
+  HostObjectBuffer,
+  HostObjectImage,
+  HostObjectCommandPool,
+  HostObjectDescriptorPool,
+  HostObjectPipeline,
+  HostObjectTypeCount,
+};
+
+const char *const host_object_type_names[HostObjectTypeCount] = {
+  "other", "device", "memory", "buffer", "image", "command pool", "descriptor pool", "pipeline",
+};
+
+static const uint32_t HostScopeCount = VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1;
+
+const char *const host_scope_names[HostScopeCount] = { "command", "object", "cache", "device", "instance" };
+
+// the kind of object the calling thread is creating or destroying
+thread_local HostObjectType host_object_type = HostObjectOther;
+
+// sets the calling thread's object type until the end of the scope
+struct HostObjectScope
+{
+  HostObjectScope(HostObjectType type) : previous(host_object_type)
+  {
+    host_object_type = type;
+  }
+
+  ~HostObjectScope()
+  {
+    host_object_type = previous;
+  }
+
+  HostObjectType previous;
+};
+
+struct HostCounters
+{
+  std::atomic<uint64_t> allocations;
+  std::atomic<uint64_t> frees;
+  std::atomic<uint64_t> allocatedBytes;
+  std::atomic<uint64_t> freedBytes;
+};
+
+// one thread's counters. only that thread writes them, so they are bumped
+// with a plain load and store rather than a locked add
+struct HostThreadCounters : CacheAligned
+{
+  std::thread::id thread;
+  HostCounters counters[HostScopeCount][HostObjectTypeCount];
+  // what pfnInternalAllocation and pfnInternalFree report, by scope
+  HostCounters internal[HostScopeCount];
+};
+
+void AddHostAllocation(HostCounters &counters, uint64_t size)
+{
+  counters.allocations.store(counters.allocations.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  counters.allocatedBytes.store(counters.allocatedBytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+}
+
+void AddHostFree(HostCounters &counters, uint64_t size)
+{
+  counters.frees.store(counters.frees.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  counters.freedBytes.store(counters.freedBytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+}
+
+// sits right in front of every allocation handed to the driver
+struct HostAllocationHeader
+{
+  uint64_t size;
+  uint32_t offset;      // from the start of the underlying allocation
+  uint8_t scope;
+  uint8_t objectType;
+};
+
+static_assert(sizeof(HostAllocationHeader) == 16, "host allocation headers should keep allocations 16 byte aligned");
+
+class HostAllocator;
+
+// the thread's counters for the last allocator it used, allocators are told
+// apart by an id as their addresses can be reused
+struct HostThreadCache
+{
+  uint64_t allocatorId;
+  HostThreadCounters *counters;
+};
+
+thread_local HostThreadCache host_thread_cache;
+
+std::atomic<uint64_t> next_host_allocator_id(1);
+
+// the callbacks the layer passes down for one device, and its counters
+class HostAllocator
+{
+public:
+  HostAllocator() : id(next_host_allocator_id.fetch_add(1, std::memory_order_relaxed)) {}
+
+  ~HostAllocator()
+  {
+    for (Callbacks *c : callbacks)
+      delete c;
+    for (HostThreadCounters *t : threads)
+      delete t;
+  }
+
+  // callbacks to pass down in place of the application's, which may be NULL.
+  // the same application callbacks always get the same ones, since objects
+  // must be destroyed with callbacks compatible with those they were created
+  // with. they stay valid until the allocator is destroyed
+  const VkAllocationCallbacks *Wrap(const VkAllocationCallbacks *pAllocator)
+  {
+    VkAllocationCallbacks application = {};
+    if (pAllocator)
+      application = *pAllocator;
+
+    scoped_lock l(lock);
+    for (Callbacks *c : callbacks)
+    {
+      // every callback counts, two sets may differ in their reallocation or
+      // internal notifications alone
+      if (c->application.pUserData == application.pUserData &&
+          c->application.pfnAllocation == application.pfnAllocation &&
+          c->application.pfnReallocation == application.pfnReallocation &&
+          c->application.pfnFree == application.pfnFree &&
+          c->application.pfnInternalAllocation == application.pfnInternalAllocation &&
+          c->application.pfnInternalFree == application.pfnInternalFree)
+        return &c->wrapped;
+    }
+
+    Callbacks *c = new Callbacks;
+    c->application = application;
+    c->allocator = this;
+    c->wrapped.pUserData = c;
+    c->wrapped.pfnAllocation = &Allocation;
+    c->wrapped.pfnReallocation = &Reallocation;
+    c->wrapped.pfnFree = &Free;
+    c->wrapped.pfnInternalAllocation = &InternalAllocation;
+    c->wrapped.pfnInternalFree = &InternalFree;
+    callbacks.push_back(c);
+    return &c->wrapped;
+  }
+
+  void Print()
+  {
+    HostCounters total[HostScopeCount][HostObjectTypeCount] = {};
+    HostCounters internal[HostScopeCount] = {};
+    {
+      scoped_lock l(lock);
+      for (HostThreadCounters *t : threads)
+      {
+        for (uint32_t scope = 0; scope < HostScopeCount; scope++)
+        {
+          for (uint32_t type = 0; type < HostObjectTypeCount; type++)
+            Sum(total[scope][type], t->counters[scope][type]);
+          Sum(internal[scope], t->internal[scope]);
+        }
+      }
+    }
+
+    uint64_t liveBytes = 0, internalBytes = 0;
+    printf("Driver host memory by allocation scope and object type:\n");
+    for (uint32_t scope = 0; scope < HostScopeCount; scope++)
+    {
+      for (uint32_t type = 0; type < HostObjectTypeCount; type++)
+      {
+        const HostCounters &counters = total[scope][type];
+        uint64_t allocations = counters.allocations.load(std::memory_order_relaxed);
+        if (allocations == 0)
+          continue;
+
+        uint64_t allocatedBytes = counters.allocatedBytes.load(std::memory_order_relaxed);
+        uint64_t live = allocatedBytes - counters.freedBytes.load(std::memory_order_relaxed);
+        printf(" %8s, %-15s %" PRIu64 " bytes live in %" PRIu64 " allocations,"
+               " %" PRIu64 " bytes in %" PRIu64 " allocations in total\n",
+               host_scope_names[scope], host_object_type_names[type], live,
+               allocations - counters.frees.load(std::memory_order_relaxed), allocatedBytes, allocations);
+        liveBytes += live;
+      }
+
+      internalBytes += internal[scope].allocatedBytes.load(std::memory_order_relaxed) -
+                       internal[scope].freedBytes.load(std::memory_order_relaxed);
+    }
+
+    printf("Driver host memory live: %" PRIu64 " bytes, and %" PRIu64 " bytes the driver allocated itself\n",
+           liveBytes, internalBytes);
+  }
+
+private:
+  struct Callbacks
+  {
+    // what the driver is given, pointing back at this
+    VkAllocationCallbacks wrapped;
+    // all NULL when the application gave none
+    VkAllocationCallbacks application;
+    HostAllocator *allocator;
+  };
+
+  static void Sum(HostCounters &total, const HostCounters &counters)
+  {
+    total.allocations.store(total.allocations.load(std::memory_order_relaxed) +
+                            counters.allocations.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    total.frees.store(total.frees.load(std::memory_order_relaxed) +
+                      counters.frees.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    total.allocatedBytes.store(total.allocatedBytes.load(std::memory_order_relaxed) +
+                               counters.allocatedBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    total.freedBytes.store(total.freedBytes.load(std::memory_order_relaxed) +
+                           counters.freedBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+
+  HostThreadCounters &GetThreadCounters()
+  {
+    HostThreadCache &cache = host_thread_cache;
+    if (cache.allocatorId == id)
+      return *cache.counters;
+
+    std::thread::id self = std::this_thread::get_id();
+    scoped_lock l(lock);
+    HostThreadCounters *counters = NULL;
+    for (HostThreadCounters *t : threads)
+    {
+      if (t->thread == self)
+        counters = t;
+    }
+    if (counters == NULL)
+    {
+      counters = new HostThreadCounters();
+      counters->thread = self;
+      threads.push_back(counters);
+    }
+
+    cache.allocatorId = id;
+    cache.counters = counters;
+    return *counters;
+  }
+
+  static void *Allocate(Callbacks *c, size_t size, size_t alignment, VkSystemAllocationScope scope,
+                        HostObjectType objectType)
+  {
+    // the header goes right in front, with the allocation moved up by as
+    // little as keeps it aligned
+    size_t offset = std::max(alignment, sizeof(HostAllocationHeader));
+    alignment = std::max(alignment, alignof(HostAllocationHeader));
+
+    void *base;
+    if (c->application.pfnAllocation)
+      base = c->application.pfnAllocation(c->application.pUserData, size + offset, alignment, scope);
+    else
+      base = AlignedAlloc(size + offset, alignment);
+    if (base == NULL)
+      return NULL;
+
+    char *ptr = (char *)base + offset;
+    HostAllocationHeader *header = (HostAllocationHeader *)ptr - 1;
+    header->size = size;
+    header->offset = (uint32_t)offset;
+    header->scope = (uint8_t)scope;
+    header->objectType = (uint8_t)objectType;
+
+    AddHostAllocation(c->allocator->GetThreadCounters().counters[scope][objectType], size);
+    return ptr;
+  }
+
+  static void *VKAPI_PTR Allocation(void *pUserData, size_t size, size_t alignment, VkSystemAllocationScope scope)
+  {
+    return Allocate((Callbacks *)pUserData, size, alignment, scope, host_object_type);
+  }
+
+  static void VKAPI_PTR Free(void *pUserData, void *pMemory)
+  {
+    if (pMemory == NULL)
+      return;
+
+    Callbacks *c = (Callbacks *)pUserData;
+    HostAllocationHeader *header = (HostAllocationHeader *)pMemory - 1;
+    AddHostFree(c->allocator->GetThreadCounters().counters[header->scope][header->objectType], header->size);
+
+    void *base = (char *)pMemory - header->offset;
+    if (c->application.pfnFree)
+      c->application.pfnFree(c->application.pUserData, base);
+    else
+      AlignedFree(base);
+  }
+
+  // done as allocate, copy and free, the application's reallocation can't
+  // be used as it wouldn't keep the header in front aligned
+  static void *VKAPI_PTR Reallocation(void *pUserData, void *pOriginal, size_t size, size_t alignment,
+                                      VkSystemAllocationScope scope)
+  {
+    if (pOriginal == NULL)
+      return Allocation(pUserData, size, alignment, scope);
+    if (size == 0)
+    {
+      Free(pUserData, pOriginal);
+      return NULL;
+    }
+
+    // a reallocation stays with the object it was first made for
+    HostAllocationHeader *header = (HostAllocationHeader *)pOriginal - 1;
+    void *ptr = Allocate((Callbacks *)pUserData, size, alignment, scope, (HostObjectType)header->objectType);
+    if (ptr == NULL)
+      return NULL;
+
+    memcpy(ptr, pOriginal, std::min<uint64_t>(size, header->size));
+    Free(pUserData, pOriginal);
+    return ptr;
+  }
+
+  static void VKAPI_PTR InternalAllocation(void *pUserData, size_t size, VkInternalAllocationType allocationType,
+                                           VkSystemAllocationScope scope)
+  {
+    Callbacks *c = (Callbacks *)pUserData;
+    AddHostAllocation(c->allocator->GetThreadCounters().internal[scope], size);
+    if (c->application.pfnInternalAllocation)
+      c->application.pfnInternalAllocation(c->application.pUserData, size, allocationType, scope);
+  }
+
+  static void VKAPI_PTR InternalFree(void *pUserData, size_t size, VkInternalAllocationType allocationType,
+                                     VkSystemAllocationScope scope)
+  {
+    Callbacks *c = (Callbacks *)pUserData;
+    AddHostFree(c->allocator->GetThreadCounters().internal[scope], size);
+    if (c->application.pfnInternalFree)
+      c->application.pfnInternalFree(c->application.pUserData, size, allocationType, scope);
+  }
+
+  const uint64_t id;
+
+  // guards both lists, the lookups are cheap next to creating an object
+  std::mutex lock;
+  std::vector<Callbacks *> callbacks;
+  std::vector<HostThreadCounters *> threads;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Deferred frees
+//
+// with MEMORY_TRACK_DEFERRED_FREE set, vkFreeMemory only updates the
+// statistics and queues the memory, and a thread per device hands it to the
+// driver in batches, so that drivers which take long to free don't stall the
+// application's threads. the queue is a linked stack: any thread pushes onto
+// it with a CAS, and the worker takes all of it at once with an exchange, so
+// neither side ever waits for the other. destroying the device frees
+// whatever is still queued.
+//
+// the requests themselves are never freed, so that queueing a free doesn't
+// call malloc on the application's thread. the worker hands the requests of a
+// drained batch back to a shared list of spares, and a thread that runs out
+// of spares of its own takes that whole list with an exchange, the only way
+// the list is ever taken from, so it has no ABA problem. the first queue
+// fills the spares up front.
+//
+// memory freed with allocation callbacks is always freed right away, as the
+// callbacks may not outlive the call
+
+class DeferredFreeQueue
+{
+public:
+  DeferredFreeQueue(VkDevice device, PFN_vkFreeMemory freeMemory, DriverCallStats &freeStats)
+    : device(device), freeMemory(freeMemory), freeStats(freeStats), head(NULL), stop(false),
+      frees(0), batches(0), largestBatch(0), freeTime(0)
+  {
+    static std::atomic<bool> filled(false);
+    if (!filled.exchange(true))
+    {
+      for (uint32_t i = 0; i < PreallocatedRequests; i++)
+      {
+        Request *request = new Request;
+        GiveSpareRequests(request, request);
+      }
+    }
+
+    thread = std::thread(&DeferredFreeQueue::Run, this);
+  }
+
+  ~DeferredFreeQueue()
+  {
+    Stop();
+  }
+
+  // frees everything queued so far and stops the worker, nothing may be
+  // pushed afterwards
+  void Stop()
+  {
+    if (!thread.joinable())
+      return;
+
+    {
+      scoped_lock l(stopLock);
+      stop = true;
+    }
+    stopCondition.notify_one();
+    thread.join();
+    Drain();
+  }
+
+  void Push(VkDeviceMemory memory, uint32_t memoryTypeIndex, uint64_t size)
+  {
+    Request *request = TakeSpareRequest();
+    request->memory = memory;
+    request->memoryTypeIndex = memoryTypeIndex;
+    request->size = size;
+    request->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(request->next, request, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  void Print()
+  {
+    printf("Deferred frees: %" PRIu64 " in %" PRIu64 " batches, at most %" PRIu64 " at once,"
+           " %" PRIu64 " us spent in the driver\n", frees, batches, largestBatch, freeTime);
+  }
+
+private:
+  struct Request
+  {
+    VkDeviceMemory memory;
+    uint32_t memoryTypeIndex;
+    uint64_t size;
+    Request *next;
+  };
+
+  // the spares a thread took, only it uses them. those left when the thread
+  // exits go back to the shared list
+  struct ThreadSpares
+  {
+    ~ThreadSpares()
+    {
+      if (head == NULL)
+        return;
+
+      Request *last = head;
+      while (last->next)
+        last = last->next;
+      GiveSpareRequests(head, last);
+    }
+
+    Request *head = NULL;
+  };
+
+  static const uint32_t PreallocatedRequests = 4096;
+
+  static Request *TakeSpareRequest()
+  {
+    Request *&spare = threadSpares.head;
+    if (spare == NULL)
+      spare = spareRequests.exchange(NULL, std::memory_order_acquire);
+    if (spare == NULL)
+      return new Request;
+
+    Request *request = spare;
+    spare = request->next;
+    return request;
+  }
+
+  // puts the chain from first to last on the shared list
+  static void GiveSpareRequests(Request *first, Request *last)
+  {
+    last->next = spareRequests.load(std::memory_order_relaxed);
+    while (!spareRequests.compare_exchange_weak(last->next, first, std::memory_order_release,
+                                                std::memory_order_relaxed))
+    {
+    }
+  }
+
+  void Run()
+  {
+    std::unique_lock<std::mutex> l(stopLock);
+    while (!stop)
+    {
+      stopCondition.wait_for(l, std::chrono::milliseconds(config.deferredFree));
+      l.unlock();
+      Drain();
+      l.lock();
+    }
+  }
+
+  void Drain()
+  {
+    Request *request = head.exchange(NULL, std::memory_order_acquire);
+    if (request == NULL)
+      return;
+
+    // the stack has the newest request on top, free in the order they came
+    Request *oldest = NULL;
+    while (request)
+    {
+      Request *next = request->next;
+      request->next = oldest;
+      oldest = request;
+      request = next;
+    }
+
+    uint64_t start = NowMicroseconds(), count = 0;
+    Request *last = NULL;
+    for (request = oldest; request; request = request->next, count++)
+    {
+      HostObjectScope scope(HostObjectMemory);
+      uint64_t callStart = NowNanoseconds();
+      freeMemory(device, request->memory, NULL);
+      RecordDriverCall(freeStats, request->memoryTypeIndex, request->size, NowNanoseconds() - callStart);
+      last = request;
+    }
+    GiveSpareRequests(oldest, last);
+
+    frees += count;
+    batches++;
+    largestBatch = std::max(largestBatch, count);
+    freeTime += NowMicroseconds() - start;
+  }
+
+  VkDevice device;
+  PFN_vkFreeMemory freeMemory;
+  DriverCallStats &freeStats;
+  std::atomic<Request *> head;
+  std::thread thread;
+
+  std::mutex stopLock;
+  std::condition_variable stopCondition;
+  bool stop;
+
+  // only touched by whoever drains, read once the worker is gone
+  uint64_t frees;
+  uint64_t batches;
+  uint64_t largestBatch;
+  uint64_t freeTime;
+
+  static std::atomic<Request *> spareRequests;
+  static thread_local ThreadSpares threadSpares;
+};
+
+std::atomic<DeferredFreeQueue::Request *> DeferredFreeQueue::spareRequests(NULL);
+thread_local DeferredFreeQueue::ThreadSpares DeferredFreeQueue::threadSpares;
+
+// everything we know about a single device, owned by the devices table
+struct DeviceData : CacheAligned
+{
+  uint32_t index;
+  VkLayerDispatchTable dispatch;
+  DeviceStats stats;
+  FrameStats frames;
+  LifetimeStats lifetimes;
+  MapStats maps;
+  FlushStats flushes;
+  DriverLatencyStats latencies;
+  // only when call stacks are captured
+  StackTable *stacks;
+  // only when memory is recycled
+  RecycleCache *recycler;
+  // only when frees are deferred
+  DeferredFreeQueue *deferredFrees;
+  // only when host memory is counted
+  HostAllocator *hostAllocator;
+  // whether VK_NXT_memory_track_stats was enabled
+  bool statsExtension;
+  // for MEMORY_TRACK_FAIL_EVERY and MEMORY_TRACK_FAIL_PROBABILITY
+  std::atomic<uint64_t> allocateCalls;
+  std::atomic<uint64_t> injectedFailures;
+
+  ~DeviceData()
+  {
+    delete stacks;
+    delete recycler;
+    delete deferredFrees;
+    delete hostAllocator;
+  }
+  AllocationShard allocationShards[ShardCount];
+  ResourceShard bufferShards[ShardCount];
+  ResourceShard imageShards[ShardCount];
+};
+
+DispatchKeyTable<DeviceData> devices;
+
+// whether the fault injection settings want this allocation to fail
+bool InjectFailure(DeviceData *deviceData)
+{
+  bool fail = false;
+  if (config.failEvery != 0)
+    fail = (deviceData->allocateCalls.fetch_add(1, std::memory_order_relaxed) + 1) % config.failEvery == 0;
+
+  if (!fail && config.failProbability > 0.0)
+  {
+    static thread_local Random random;
+    fail = random.Uniform() <= config.failProbability;
+  }
+
+  if (fail)
+    deviceData->injectedFailures.fetch_add(1, std::memory_order_relaxed);
+  return fail;
+}
+
+// works for queues and command buffers too, as they share their device's dispatch table
+template<typename DispatchableType>
+DeviceData *GetDeviceData(DispatchableType object)
+{
+  return devices.Find(GetKey(object));
+}
+
+// the callbacks to pass down when creating or destroying an object of the device
+const VkAllocationCallbacks *GetHostCallbacks(DeviceData *deviceData, const VkAllocationCallbacks *pAllocator)
+{
+  if (deviceData->hostAllocator == NULL || pAllocator == NULL)
+    return pAllocator;
+
+  return deviceData->hostAllocator->Wrap(pAllocator);
+}
+
+void TraceMemoryEvent(DeviceData *deviceData, TraceEventType type, uint64_t memory, uint32_t memoryTypeIndex,
+                      uint64_t object, uint64_t offset, uint64_t size)
+{
+  uint32_t heapIndex = deviceData->stats.memoryTypes[memoryTypeIndex].memoryType.heapIndex;
+
+  TraceEvent event;
+  event.timestamp = NowNanoseconds();
+  event.memory = memory;
+  event.object = object;
+  event.offset = offset;
+  event.size = size;
+  event.heapUsage = deviceData->stats.memoryHeaps[heapIndex].currentUsage.load(std::memory_order_relaxed);
+  event.threadId = 0;
+  event.type = type;
+  event.deviceIndex = deviceData->index;
+  event.memoryTypeIndex = memoryTypeIndex;
+  event.heapIndex = heapIndex;
+  trace_writer.Record(event);
+}
+
+template<typename Shard>
+Shard &GetShard(Shard (&shards)[ShardCount], uint64_t handle)
+{
+  // driver handles are usually aligned pointers, so mix the bits before picking a shard
+  uint64_t h = handle;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return shards[h % ShardCount];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Shared memory statistics
+//
+// a background thread copies every device's counters into a shared memory
+// segment at a fixed interval, so the application's threads do no extra work
+// at all. publishing happens with global_lock held, which keeps the devices
+// alive while they're read and makes the publisher the only writer of each
+// block's seqlock, as the protocol requires.
+
+class ShmPublisher
+{
+public:
+  ShmPublisher() : segment(NULL), warnedDevices(false), stop(false) {}
+
+  ~ShmPublisher()
+  {
+    Stop();
+  }
+
+  // creates the segment and starts the publishing thread, if it isn't already
+  // running. must be called with global_lock held
+  void Start(const char *shmName, uint64_t intervalMs)
+  {
+#if defined(WIN32)
+    if (name.empty())
+      fprintf(stderr, "memory_track: shared memory statistics are only supported on POSIX systems\n");
+    name = shmName;
+#else
+    if (segment || !name.empty())
+      return;
+
+    name = shmName;
+
+    // a segment left over under the same name by a process that's gone, say
+    // one that crashed, is replaced rather than written into, so whoever still
+    // has it mapped keeps seeing the old contents instead of two writers. one
+    // whose owner is still running, or that isn't ours at all, is left alone
+    int fd = shm_open(shmName, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST)
+    {
+      if (!IsStaleSegment(shmName))
+      {
+        fprintf(stderr, "memory_track: shared memory segment %s is in use, not replacing it\n", shmName);
+        return;
+      }
+      if (shm_unlink(shmName) == 0)
+        fd = shm_open(shmName, O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0 || ftruncate(fd, sizeof(MemoryTrackShmSegment)) != 0)
+    {
+      fprintf(stderr, "memory_track: can't create shared memory segment %s\n", shmName);
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+
+    void *ptr = mmap(NULL, sizeof(MemoryTrackShmSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+    {
+      fprintf(stderr, "memory_track: can't map shared memory segment %s\n", shmName);
+      return;
+    }
+
+    segment = (MemoryTrackShmSegment *)ptr;
+    memset(segment, 0, sizeof(*segment));
+    segment->version = MEMORY_TRACK_SHM_VERSION;
+    segment->pid = getpid();
+    segment->deviceCount = MEMORY_TRACK_SHM_MAX_DEVICES;
+    __atomic_store_n(&segment->magic, MEMORY_TRACK_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    interval = std::chrono::milliseconds(intervalMs ? intervalMs : 1);
+    thread = std::thread(&ShmPublisher::Run, this);
+#endif
+  }
+
+  // must be called with global_lock held
+  void Publish(DeviceData *deviceData, bool active)
+  {
+#if !defined(WIN32)
+    if (segment == NULL)
+      return;
+    if (deviceData->index >= MEMORY_TRACK_SHM_MAX_DEVICES)
+    {
+      if (!warnedDevices)
+        fprintf(stderr, "memory_track: only the first %d devices are published in shared memory\n",
+                MEMORY_TRACK_SHM_MAX_DEVICES);
+      warnedDevices = true;
+      return;
+    }
+
+    MemoryTrackShmDevice &block = segment->devices[deviceData->index];
+    const DeviceStats &deviceStats = deviceData->stats;
+
+    uint32_t sequence = block.sequence;
+    __atomic_store_n(&block.sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    block.active = active;
+    block.timestamp = NowNanoseconds();
+    block.memoryTypeCount = deviceStats.memoryTypeCount;
+    block.memoryHeapCount = deviceStats.memoryHeapCount;
+    for (uint32_t i = 0; i < deviceStats.memoryTypeCount; i++)
+    {
+      const auto &typeInfo = deviceStats.memoryTypes[i];
+      MemoryTrackShmType &type = block.types[i];
+      type.heapIndex = typeInfo.memoryType.heapIndex;
+      type.propertyFlags = typeInfo.memoryType.propertyFlags;
+      type.currentUsage = typeInfo.currentUsage.load(std::memory_order_relaxed);
+      type.maximumUsage = typeInfo.maximumUsage.load(std::memory_order_relaxed);
+      type.allocationCount = typeInfo.allocationCount.load(std::memory_order_relaxed);
+      type.totalAllocations = typeInfo.totalAllocations.load(std::memory_order_relaxed);
+    }
+    for (uint32_t i = 0; i < deviceStats.memoryHeapCount; i++)
+    {
+      const auto &heapInfo = deviceStats.memoryHeaps[i];
+      HeapCounters counters = ReadHeapCounters(heapInfo);
+      MemoryTrackShmHeap &heap = block.heaps[i];
+      heap.size = heapInfo.memoryHeap.size;
+      heap.flags = heapInfo.memoryHeap.flags;
+      heap.currentUsage = counters.currentUsage;
+      heap.maximumUsage = counters.maximumUsage;
+      heap.currentBound = counters.currentBound;
+      heap.maximumBound = counters.maximumBound;
+      heap.allocationCount = counters.allocationCount;
+      heap.totalAllocations = counters.totalAllocations;
+    }
+
+    __atomic_store_n(&block.sequence, sequence + 2, __ATOMIC_RELEASE);
+#endif
+  }
+
+private:
+#if !defined(WIN32)
+  // whether the segment under the name was published by the layer in a
+  // process that has exited since. the magic is stored last, so a segment
+  // that has it also has its owner's pid
+  static bool IsStaleSegment(const char *shmName)
+  {
+    int fd = shm_open(shmName, O_RDONLY, 0);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    void *ptr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(MemoryTrackShmSegment))
+      ptr = mmap(NULL, sizeof(MemoryTrackShmSegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+      return false;
+
+    const MemoryTrackShmSegment *existing = (const MemoryTrackShmSegment *)ptr;
+    bool stale = false;
+    if (__atomic_load_n(&existing->magic, __ATOMIC_ACQUIRE) == MEMORY_TRACK_SHM_MAGIC)
+    {
+      // our own pid can only be left over from an earlier process that had it
+      pid_t pid = (pid_t)existing->pid;
+      stale = pid == getpid() || (kill(pid, 0) != 0 && errno == ESRCH);
+    }
+    munmap(ptr, sizeof(MemoryTrackShmSegment));
+    return stale;
+  }
+#endif
+
+  void Run()
+  {
+    std::unique_lock<std::mutex> l(stopLock);
+    while (!stop)
+    {
+      stopCondition.wait_for(l, interval);
+      l.unlock();
+      {
+        scoped_lock gl(global_lock);
+        devices.ForEach([this](DeviceData *deviceData) { Publish(deviceData, true); });
+      }
+      l.lock();
+    }
+  }
+
+  void Stop()
+  {
+#if !defined(WIN32)
+    if (!thread.joinable())
+      return;
+
+    {
+      scoped_lock l(stopLock);
+      stop = true;
+    }
+    stopCondition.notify_one();
+    thread.join();
+
+    munmap(segment, sizeof(MemoryTrackShmSegment));
+    shm_unlink(name.c_str());
+    segment = NULL;
+#endif
+  }
+
+  std::string name;
+  MemoryTrackShmSegment *segment;
+  bool warnedDevices;
+  std::chrono::milliseconds interval;
+  std::thread thread;
+
+  std::mutex stopLock;
+  std::condition_variable stopCondition;
+  bool stop;
+};
+
+ShmPublisher shm_publisher;
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Reporting
+
+// unbound space inside the live allocations of a heap. an allocation with
+// nothing bound counts as one big hole
+struct HeapFragmentation
+{
+  uint64_t allocationCount;
+  uint64_t freeBytes;
+  uint64_t holeCount;
+  uint64_t largestHole;
+};
+
+// can be called at any time, the shards are locked one after the other
+void GetFragmentation(DeviceData *deviceData, HeapFragmentation (&fragmentation)[VK_MAX_MEMORY_HEAPS])
+{
+  memset(fragmentation, 0, sizeof(fragmentation));
+
+  for (auto &shard : deviceData->allocationShards)
+  {
+    scoped_lock l(shard.lock);
+    shard.allocations.ForEach([&](uint64_t memory, const AllocationRecord &record) {
+      auto &heapFragmentation =
+          fragmentation[deviceData->stats.memoryTypes[record.memoryTypeIndex].memoryType.heapIndex];
+      auto addHole = [&](uint64_t size) {
+        heapFragmentation.freeBytes += size;
+        heapFragmentation.holeCount++;
+        heapFragmentation.largestHole = std::max(heapFragmentation.largestHole, size);
+      };
+
+      // ranges may overlap, so track how far the bound space reaches so far
+      uint64_t covered = 0;
+      const AllocationUsage *usage = shard.usage.Find(memory);
+      if (usage)
+      {
+        usage->ranges.ForEach([&](const BoundRange &range) {
+          if (range.offset > covered)
+            addHole(range.offset - covered);
+          covered = std::max(covered, range.offset + range.size);
+        });
+      }
+
+      if (record.size > covered)
+        addHole(record.size - covered);
+      heapFragmentation.allocationCount++;
+    });
+  }
+}
+
+void PrintFrameReport(DeviceData *deviceData)
+{
+  const uint32_t heapCount = deviceData->stats.memoryHeapCount;
+  FrameStats &frameStats = deviceData->frames;
+  scoped_lock l(frameStats.lock);
+
+  if (frameStats.frameCount == 0)
+    return;
+
+  FrameList &history = frameStats.history;
+  uint64_t recentCount = std::min<uint64_t>(frameStats.frameCount, history.frames.size());
+  uint64_t recentAllocated = 0, recentFreed = 0;
+  for (uint64_t i = 0; i < recentCount; i++)
+  {
+    const FrameHeapStats *heaps = history.Heaps(i, heapCount);
+    for (uint32_t j = 0; j < heapCount; j++)
+    {
+      recentAllocated += heaps[j].allocatedBytes;
+      recentFreed += heaps[j].freedBytes;
+    }
+  }
+
+  printf("Frames presented: %" PRIu64 "\n", frameStats.frameCount);
+  if (recentCount > 0)
+    printf("Average over the last %" PRIu64 " frames: %" PRIu64 " bytes allocated and %" PRIu64 " bytes freed per frame\n",
+           recentCount, recentAllocated / recentCount, recentFreed / recentCount);
+
+  FrameList &worst = frameStats.worst;
+  std::vector<size_t> order(worst.frames.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&worst](size_t a, size_t b)
+  {
+    return worst.frames[a].churn > worst.frames[b].churn;
+  });
+
+  if (!order.empty())
+    printf("Frames with the most memory allocated and freed:\n");
+  for (size_t index : order)
+  {
+    const FrameInfo &info = worst.frames[index];
+    if (info.churn == 0)
+      continue;
+
+    printf(" frame %" PRIu64 " (%.2f ms):\n", info.frame, info.duration / 1000.0);
+
+    const FrameHeapStats *heaps = worst.Heaps(index, heapCount);
+    for (uint32_t i = 0; i < heapCount; i++)
+    {
+      const FrameHeapStats &heap = heaps[i];
+      if (heap.allocations == 0 && heap.frees == 0)
+        continue;
+
+      printf("   heap %u: %" PRIu64 " bytes allocated in %u allocations, %" PRIu64 " bytes freed in %u frees,"
+             " %" PRIu64 " bytes in use at the end\n", i,
+             heap.allocatedBytes, heap.allocations, heap.freedBytes, heap.frees, heap.currentUsage);
+    }
+  }
+}
+
+void PrintChurnReport(DeviceData *deviceData)
+{
+  // a handful of short-lived allocations are no pattern worth reporting
+  static const uint64_t MinChurnCount = 10;
+
+  struct Churn
+  {
+    uint32_t memoryTypeIndex;
+    uint32_t sizeClass;
+    uint32_t medianBucket;
+    uint64_t count;
+  };
+
+  std::vector<Churn> churn;
+  const LifetimeStats &lifetimeStats = deviceData->lifetimes;
+  for (uint32_t i = 0; i < deviceData->stats.memoryTypeCount; i++)
+  {
+    for (uint32_t j = 0; j < SizeClassCount; j++)
+    {
+      uint64_t counts[LifetimeBucketCount];
+      uint64_t total = 0;
+      for (uint32_t k = 0; k < LifetimeBucketCount; k++)
+      {
+        counts[k] = lifetimeStats.counts[i][j][k].load(std::memory_order_relaxed);
+        total += counts[k];
+      }
+
+      if (total < MinChurnCount)
+        continue;
+
+      uint32_t median = GetMedianBucket(counts, total);
+
+      // the whole median bucket has to lie below the threshold
+      if (median + 1 < LifetimeBucketCount && GetLifetimeBucketStart(median + 1) <= config.churnLifetime)
+        churn.push_back({ i, j, median, total });
+    }
+  }
+
+  if (churn.empty())
+    return;
+
+  std::sort(churn.begin(), churn.end(), [](const Churn &a, const Churn &b) { return a.count > b.count; });
+
+  printf("Allocations with a median lifetime under %" PRIu64 " ms, by memory type and size:\n",
+         config.churnLifetime / 1000);
+  for (const Churn &entry : churn)
+  {
+    printf(" %3u: %" PRIu64 " to %" PRIu64 " bytes, %" PRIu64 " freed, median lifetime %" PRIu64 " to %" PRIu64 " us\n",
+           entry.memoryTypeIndex, GetSizeClassStart(entry.sizeClass),
+           entry.sizeClass + 1 < SizeClassCount ? GetSizeClassStart(entry.sizeClass + 1) - 1 : UINT64_MAX,
+           entry.count, GetLifetimeBucketStart(entry.medianBucket), GetLifetimeBucketStart(entry.medianBucket + 1));
+  }
+}
+
+uint64_t GetLatencyCount(const LatencyHistogram &histogram)
+{
+  uint64_t total = 0;
+  for (const auto &count : histogram.counts)
+    total += count.load(std::memory_order_relaxed);
+  return total;
+}
+
+// one line of percentiles in microseconds, nothing if there were no calls
+void PrintLatencyHistogram(const char *label, const LatencyHistogram &histogram)
+{
+  uint64_t counts[LatencyBucketCount];
+  uint64_t total = 0;
+  for (uint32_t i = 0; i < LatencyBucketCount; i++)
+  {
+    counts[i] = histogram.counts[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0)
+    return;
+
+  uint64_t maximum = histogram.maximumTime.load(std::memory_order_relaxed);
+  printf(" %s: %" PRIu64 " calls, mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f us\n", label, total,
+         histogram.totalTime.load(std::memory_order_relaxed) / 1000.0 / total,
+         GetLatencyPercentile(counts, total, maximum, 0.5) / 1000.0,
+         GetLatencyPercentile(counts, total, maximum, 0.9) / 1000.0,
+         GetLatencyPercentile(counts, total, maximum, 0.99) / 1000.0,
+         GetLatencyPercentile(counts, total, maximum, 0.999) / 1000.0, maximum / 1000.0);
+}
+
+void PrintLatencyReport(DeviceData *deviceData)
+{
+  const struct
+  {
+    const char *name;
+    const DriverCallStats &callStats;
+  } calls[] = {
+    { "vkAllocateMemory", deviceData->latencies.allocations },
+    { "vkFreeMemory", deviceData->latencies.frees },
+  };
+
+  for (const auto &call : calls)
+  {
+    // every call counts into exactly one size class
+    uint64_t total = 0;
+    for (const LatencyHistogram &histogram : call.callStats.sizeClasses)
+      total += GetLatencyCount(histogram);
+    if (total == 0)
+      continue;
+
+    printf("Time spent in the driver's %s by memory type:\n", call.name);
+    for (uint32_t i = 0; i < deviceData->stats.memoryTypeCount; i++)
+    {
+      char label[16];
+      snprintf(label, sizeof(label), "%3u", i);
+      PrintLatencyHistogram(label, call.callStats.memoryTypes[i]);
+    }
+
+    printf("Time spent in the driver's %s by size:\n", call.name);
+    for (uint32_t i = 0; i < SizeClassCount; i++)
+    {
+      char label[64];
+      snprintf(label, sizeof(label), "%" PRIu64 " to %" PRIu64 " bytes", GetSizeClassStart(i),
+               i + 1 < SizeClassCount ? GetSizeClassStart(i + 1) - 1 : UINT64_MAX);
+      PrintLatencyHistogram(label, call.callStats.sizeClasses[i]);
+    }
+  }
+}
+
+void PrintStackFrame(void *address)
+{
+#if defined(WIN32)
+  printf("     %p\n", address);
+#else
+  Dl_info info;
+  if (dladdr(address, &info) == 0)
+  {
+    printf("     %p\n", address);
+    return;
+  }
+
+  if (info.dli_sname == NULL)
+  {
+    printf("     %p %s+0x%tx\n", address, info.dli_fname, (char *)address - (char *)info.dli_fbase);
+    return;
+  }
+
+  int status;
+  char *demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+  printf("     %p %s+0x%tx (%s)\n", address, demangled ? demangled : info.dli_sname,
+         (char *)address - (char *)info.dli_saddr, info.dli_fname);
+  free(demangled);
+#endif
+}
+
+// the live allocations whose count reaches minimum together with the freed
+// ones kept in freed, highest count first
+template<typename Count>
+std::vector<MappedAllocation> GetMappedAllocations(DeviceData *deviceData, const std::vector<MappedAllocation> &freed,
+                                                   Count count, uint64_t minimum)
+{
+  std::vector<MappedAllocation> allocations;
+  for (auto &shard : deviceData->allocationShards)
+  {
+    scoped_lock l(shard.lock);
+    shard.mappings.ForEach([&](uint64_t memory, const MappingRecord &mapping)
+    {
+      const AllocationRecord *record = shard.allocations.Find(memory);
+      MappedAllocation allocation = { memory, 0, 0, 0, mapping, false };
+      if (record && count(allocation) >= minimum)
+      {
+        allocation.size = record->size;
+        allocation.memoryTypeIndex = record->memoryTypeIndex;
+        allocation.stackId = record->stackId;
+        allocations.push_back(allocation);
+      }
+    });
+  }
+  {
+    scoped_lock l(deviceData->maps.lock);
+    allocations.insert(allocations.end(), freed.begin(), freed.end());
+  }
+
+  std::sort(allocations.begin(), allocations.end(), [&count](const MappedAllocation &a, const MappedAllocation &b)
+  {
+    return count(a) > count(b);
+  });
+  return allocations;
+}
+
+void PrintAllocationStack(DeviceData *deviceData, uint32_t stackId)
+{
+  if (stackId == 0)
+    return;
+
+  const CallStack &stack = deviceData->stacks->Get(stackId).stack;
+  for (uint32_t j = 0; j < stack.depth; j++)
+    PrintStackFrame(stack.frames[j]);
+}
+
+void PrintMapReport(DeviceData *deviceData)
+{
+  static const size_t ReportedCandidateCount = 20;
+
+  const MapStats &mapStats = deviceData->maps;
+  bool printed = false;
+  for (uint32_t i = 0; i < deviceData->stats.memoryHeapCount; i++)
+  {
+    const HeapMapStats &heap = mapStats.heaps[i];
+    uint64_t maps = heap.maps.load(std::memory_order_relaxed);
+    if (maps == 0)
+      continue;
+
+    uint64_t counts[LifetimeBucketCount];
+    uint64_t total = 0;
+    for (uint32_t k = 0; k < LifetimeBucketCount; k++)
+    {
+      counts[k] = heap.lifetimes[k].load(std::memory_order_relaxed);
+      total += counts[k];
+    }
+
+    if (!printed)
+      printf("Mapped memory by memory heap:\n");
+    printed = true;
+
+    printf(" %3u: %" PRIu64 " bytes mapped at most, %" PRIu64 " bytes now, %" PRIu64 " maps", i,
+           heap.maximumMapped.load(std::memory_order_relaxed), heap.currentMapped.load(std::memory_order_relaxed), maps);
+    if (total != 0)
+    {
+      uint32_t median = GetMedianBucket(counts, total);
+      printf(", median mapping lifetime %" PRIu64 " to %" PRIu64 " us",
+             GetLifetimeBucketStart(median), GetLifetimeBucketStart(median + 1));
+    }
+    printf("\n");
+  }
+
+  std::vector<MappedAllocation> candidates = GetMappedAllocations(deviceData, deviceData->maps.freedRemapped,
+                                                                  GetMapCount, MinRemapCount);
+  if (candidates.empty())
+    return;
+
+  printf("Allocations mapped %" PRIu64 " times or more, which could stay mapped instead:\n", MinRemapCount);
+  for (size_t i = 0; i < candidates.size() && i < ReportedCandidateCount; i++)
+  {
+    const MappedAllocation &candidate = candidates[i];
+    printf(" %3zu: 0x%" PRIx64 ", %" PRIu64 " bytes of type %u, mapped %" PRIu64 " times for %" PRIu64 " us on average%s\n",
+           i, candidate.memory, candidate.size, candidate.memoryTypeIndex, candidate.mapping.mapCount,
+           candidate.mapping.mappedTime / candidate.mapping.mapCount, candidate.freed ? ", freed" : "");
+    PrintAllocationStack(deviceData, candidate.stackId);
+  }
+}
+
+void PrintFlushReport(DeviceData *deviceData)
+{
+  static const size_t ReportedCandidateCount = 20;
+
+  const FlushStats &flushStats = deviceData->flushes;
+  bool printed = false;
+  for (uint32_t i = 0; i < deviceData->stats.memoryTypeCount; i++)
+  {
+    const char *const names[2] = { "flushed", "invalidated" };
+    const RangeStats *const rangeStats[2] = { &flushStats.flushes[i], &flushStats.invalidations[i] };
+    for (int j = 0; j < 2; j++)
+    {
+      uint64_t calls = rangeStats[j]->calls.load(std::memory_order_relaxed);
+      if (calls == 0)
+        continue;
+
+      if (!printed)
+        printf("Flushed and invalidated ranges by memory type:\n");
+      printed = true;
+
+      uint64_t bytes = rangeStats[j]->bytes.load(std::memory_order_relaxed);
+      uint64_t allocationBytes = rangeStats[j]->allocationBytes.load(std::memory_order_relaxed);
+      printf(" %3u: %s %" PRIu64 " bytes in %" PRIu64 " calls, %" PRIu64 " ranges of which %" PRIu64 " whole,"
+             " %.1f%% of the allocations they're in%s\n", i, names[j], bytes, calls,
+             rangeStats[j]->ranges.load(std::memory_order_relaxed), rangeStats[j]->wholeRanges.load(std::memory_order_relaxed),
+             allocationBytes ? 100.0 * bytes / allocationBytes : 0.0,
+             deviceData->stats.memoryTypes[i].memoryType.propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT ?
+               ", not needed as the type is coherent" : "");
+    }
+  }
+
+  std::vector<MappedAllocation> candidates = GetMappedAllocations(deviceData, deviceData->maps.freedOverflushed,
+                                                                  GetWholeFlushStreak, MinWholeFlushStreak);
+  if (candidates.empty())
+    return;
+
+  printf("Allocations flushed or invalidated whole %u frames in a row or more:\n", MinWholeFlushStreak);
+  for (size_t i = 0; i < candidates.size() && i < ReportedCandidateCount; i++)
+  {
+    const MappedAllocation &candidate = candidates[i];
+    printf(" %3zu: 0x%" PRIx64 ", %" PRIu64 " bytes of type %u, whole for up to %u frames in a row%s\n",
+           i, candidate.memory, candidate.size, candidate.memoryTypeIndex,
+           candidate.mapping.maximumWholeFlushStreak, candidate.freed ? ", freed" : "");
+    PrintAllocationStack(deviceData, candidate.stackId);
+  }
+}
+
+void PrintStackReport(StackTable &stackTable)
+{
+  static const size_t ReportedStackCount = 20;
+
+  std::vector<StackEntry *> entries;
+  stackTable.ForEach([&entries](StackEntry &entry) { entries.push_back(&entry); });
+  if (entries.empty())
+    return;
+
+  std::sort(entries.begin(), entries.end(), [](const StackEntry *a, const StackEntry *b)
+  {
+    return a->peakBytes.load(std::memory_order_relaxed) > b->peakBytes.load(std::memory_order_relaxed);
+  });
+
+  printf("Allocation call stacks by maximum usage, %zu of %zu", std::min(entries.size(), ReportedStackCount), entries.size());
+  if (config.sampleBytes)
+    printf(", estimated from one sample per %" PRIu64 " bytes", config.sampleBytes);
+  printf(":\n");
+
+  for (size_t i = 0; i < entries.size() && i < ReportedStackCount; i++)
+  {
+    const StackEntry &entry = *entries[i];
+    uint64_t allocations = entry.allocations.load(std::memory_order_relaxed);
+    printf(" %3zu: %" PRIu64 " bytes maximum, %" PRIu64 " bytes live, %" PRIu64 " allocations", i,
+           entry.peakBytes.load(std::memory_order_relaxed), entry.liveBytes.load(std::memory_order_relaxed),
+           (allocations + StackCountScale / 2) / StackCountScale);
+    if (config.sampleBytes)
+      printf(" (%" PRIu64 " sampled)", entry.samples.load(std::memory_order_relaxed));
+    printf("\n");
+    for (uint32_t j = 0; j < entry.stack.depth; j++)
+      PrintStackFrame(entry.stack.frames[j]);
+  }
+}
+
+void PrintDeviceReport(DeviceData *deviceData)
+{
+  auto &deviceStats = deviceData->stats;
+  uint64_t sum_device = 0, sum_host = 0;
+
+  printf("Maximum usage by memory type index:\n");
+  for (uint32_t i = 0; i < deviceStats.memoryTypeCount; i++)
+  {
+    const auto &typeInfo = deviceStats.memoryTypes[i];
+    uint64_t maximumUsage = typeInfo.maximumUsage.load(std::memory_order_relaxed);
+    if (maximumUsage == 0)
+      continue;
+
+    printf(" %3u: %" PRIu64 " bytes (heap %u)\n", i,
+           maximumUsage, typeInfo.memoryType.heapIndex);
+  }
+
+  printf("Maximum usage by memory heap:\n");
+  for (uint32_t i = 0; i < deviceStats.memoryHeapCount; i++)
+  {
+    const auto &heapInfo = deviceStats.memoryHeaps[i];
+    uint64_t maximumUsage = heapInfo.maximumUsage.load(std::memory_order_relaxed);
+    if (maximumUsage == 0)
+      continue;
+
+    printf(" %3u: %" PRIu64 " bytes\n", i, maximumUsage);
+    if (heapInfo.memoryHeap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+      sum_device += maximumUsage;
+    else
+      sum_host += maximumUsage;
+  }
+
+  printf("Maximum device memory: %" PRIu64 " bytes\n", sum_device);
+  printf("Maximum host memory: %" PRIu64 " bytes\n", sum_host);
+
+  printf("Maximum bound to resources by memory heap:\n");
+  for (uint32_t i = 0; i < deviceStats.memoryHeapCount; i++)
+  {
+    const auto &heapInfo = deviceStats.memoryHeaps[i];
+    uint64_t maximumUsage = heapInfo.maximumUsage.load(std::memory_order_relaxed);
+    uint64_t maximumBound = heapInfo.maximumBound.load(std::memory_order_relaxed);
+    if (maximumUsage == 0)
+      continue;
+
+    printf(" %3u: %" PRIu64 " of %" PRIu64 " bytes allocated (%.1f%%)\n", i,
+           maximumBound, maximumUsage, 100.0 * maximumBound / maximumUsage);
+  }
+
+  HeapFragmentation fragmentation[VK_MAX_MEMORY_HEAPS];
+  GetFragmentation(deviceData, fragmentation);
+
+  printf("Fragmentation of live allocations by memory heap:\n");
+  for (uint32_t i = 0; i < deviceStats.memoryHeapCount; i++)
+  {
+    const auto &heapFragmentation = fragmentation[i];
+    if (heapFragmentation.allocationCount == 0)
+      continue;
+
+    double external = heapFragmentation.freeBytes == 0 ? 0.0 :
+        1.0 - (double) heapFragmentation.largestHole / heapFragmentation.freeBytes;
+    printf(" %3u: %" PRIu64 " bytes free in %" PRIu64 " holes over %" PRIu64 " allocations,"
+           " largest hole %" PRIu64 " bytes (%.1f%% external fragmentation)\n", i,
+           heapFragmentation.freeBytes, heapFragmentation.holeCount, heapFragmentation.allocationCount,
+           heapFragmentation.largestHole, 100.0 * external);
+  }
+
+  if (!config.heapBudgets.empty())
+  {
+    printf("Budget by memory heap:\n");
+    for (uint32_t i = 0; i < deviceStats.memoryHeapCount; i++)
+    {
+      const auto &heapInfo = deviceStats.memoryHeaps[i];
+      if (heapInfo.budget == 0)
+        continue;
+
+      printf(" %3u: %" PRIu64 " of %" PRIu64 " bytes at most, %" PRIu64 " allocations refused\n", i,
+             heapInfo.maximumUsage.load(std::memory_order_relaxed), heapInfo.budget,
+             heapInfo.budgetFailures.load(std::memory_order_relaxed));
+    }
+  }
+
+  if (config.failEvery != 0 || config.failProbability > 0.0)
+    printf("Injected allocation failures: %" PRIu64 "\n", deviceData->injectedFailures.load(std::memory_order_relaxed));
+
+  if (deviceData->hostAllocator)
+    deviceData->hostAllocator->Print();
+  if (deviceData->recycler)
+    deviceData->recycler->Print();
+  if (deviceData->deferredFrees)
+    deviceData->deferredFrees->Print();
+
+  PrintLatencyReport(deviceData);
+  PrintFrameReport(deviceData);
+  PrintChurnReport(deviceData);
+  PrintMapReport(deviceData);
+  PrintFlushReport(deviceData);
+  if (deviceData->stacks)
+    PrintStackReport(*deviceData->stacks);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Layer init and shutdown
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_CreateInstance(
+    const VkInstanceCreateInfo*                 pCreateInfo,
+    const VkAllocationCallbacks*                pAllocator,
+    VkInstance*                                 pInstance)
+{
+  VkLayerInstanceCreateInfo *layerCreateInfo = (VkLayerInstanceCreateInfo *)pCreateInfo->pNext;
+
+  // step through the chain of pNext until we get to the link info
+  while(layerCreateInfo && (layerCreateInfo->sType != VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO ||
+                            layerCreateInfo->function != VK_LAYER_LINK_INFO))
+  {
+    layerCreateInfo = (VkLayerInstanceCreateInfo *)layerCreateInfo->pNext;
+  }
+
+  if(layerCreateInfo == NULL)
+  {
+    // No loader instance create info
+    return VK_ERROR_INITIALIZATION_FAILED;
+  }
+
+  PFN_vkGetInstanceProcAddr gpa = layerCreateInfo->u.pLayerInfo->pfnNextGetInstanceProcAddr;
+  // move chain on for next layer
+  layerCreateInfo->u.pLayerInfo = layerCreateInfo->u.pLayerInfo->pNext;
+
+  PFN_vkCreateInstance createFunc = (PFN_vkCreateInstance)gpa(VK_NULL_HANDLE, "vkCreateInstance");
+
+  VkResult ret = createFunc(pCreateInfo, pAllocator, pInstance);
+  if (ret == VK_SUCCESS)
+  {
+
+    InstanceData *instanceData = new InstanceData();
+
+    // fetch our own dispatch table for the functions we need, into the next layer
+    VkLayerInstanceDispatchTable &dispatchTable = instanceData->dispatch;
+    dispatchTable.GetInstanceProcAddr = (PFN_vkGetInstanceProcAddr)gpa(*pInstance, "vkGetInstanceProcAddr");
+    dispatchTable.DestroyInstance = (PFN_vkDestroyInstance)gpa(*pInstance, "vkDestroyInstance");
+    dispatchTable.EnumerateDeviceExtensionProperties = (PFN_vkEnumerateDeviceExtensionProperties)gpa(*pInstance, "vkEnumerateDeviceExtensionProperties");
+    dispatchTable.GetPhysicalDeviceMemoryProperties = (PFN_vkGetPhysicalDeviceMemoryProperties)gpa(*pInstance, "vkGetPhysicalDeviceMemoryProperties");
+
+    // store the instance data by key
+    {
+        scoped_lock l(global_lock);
+        instances.Insert(GetKey(*pInstance), instanceData);
+    }
+
+  }
+
+  return ret;
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_DestroyInstance(VkInstance instance, const VkAllocationCallbacks* pAllocator)
+{
+  InstanceData *instanceData;
+  {
+    scoped_lock l(global_lock);
+    instanceData = instances.Erase(GetKey(instance));
+  }
+
+  if (instanceData == NULL)
+    return;
+
+  instanceData->dispatch.DestroyInstance(instance, pAllocator);
+  delete instanceData;
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_CreateDevice(
+    VkPhysicalDevice                            physicalDevice,
+    const VkDeviceCreateInfo*                   pCreateInfo,
+    const VkAllocationCallbacks*                pAllocator,
+    VkDevice*                                   pDevice)
+{
+  VkLayerDeviceCreateInfo *layerCreateInfo = (VkLayerDeviceCreateInfo *)pCreateInfo->pNext;
+
+  // step through the chain of pNext until we get to the link info
+  while(layerCreateInfo && (layerCreateInfo->sType != VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO ||
+                            layerCreateInfo->function != VK_LAYER_LINK_INFO))
+  {
+    layerCreateInfo = (VkLayerDeviceCreateInfo *)layerCreateInfo->pNext;
+  }
+
+  if(layerCreateInfo == NULL)
+  {
+    // No loader instance create info
+    return VK_ERROR_INITIALIZATION_FAILED;
+  }
+
+  PFN_vkGetInstanceProcAddr gipa = layerCreateInfo->u.pLayerInfo->pfnNextGetInstanceProcAddr;
+  PFN_vkGetDeviceProcAddr gdpa = layerCreateInfo->u.pLayerInfo->pfnNextGetDeviceProcAddr;
+  // move chain on for next layer
+  layerCreateInfo->u.pLayerInfo = layerCreateInfo->u.pLayerInfo->pNext;
+
+  PFN_vkCreateDevice createFunc = (PFN_vkCreateDevice)gipa(VK_NULL_HANDLE, "vkCreateDevice");
+
+  // reserve an index for the device up front, so we never have to fail after
+  // the device was created
+  uint32_t deviceIndex = 0;
+  {
+    scoped_lock l(global_lock);
+    while (deviceIndex < MaxDevices && device_index_used[deviceIndex])
+      deviceIndex++;
+
+    if (deviceIndex == MaxDevices)
+      return VK_ERROR_TOO_MANY_OBJECTS;
+
+    device_index_used[deviceIndex] = true;
+  }
+
+  // our own extension is implemented here, the next layer mustn't see it
+  bool statsExtension = false;
+  std::vector<const char *> extensions;
+  for (uint32_t i = 0; i < pCreateInfo->enabledExtensionCount; i++)
+  {
+    if (!strcmp(pCreateInfo->ppEnabledExtensionNames[i], VK_NXT_MEMORY_TRACK_STATS_EXTENSION_NAME))
+      statsExtension = true;
+    else
+      extensions.push_back(pCreateInfo->ppEnabledExtensionNames[i]);
+  }
+
+  VkDeviceCreateInfo createInfo = *pCreateInfo;
+  createInfo.enabledExtensionCount = (uint32_t)extensions.size();
+  createInfo.ppEnabledExtensionNames = extensions.data();
+
+  // the device's callbacks are the driver's fallback for all its objects, so
+  // they are always replaced, even when the application gave none
+  HostAllocator *hostAllocator = config.hostMemory ? new HostAllocator() : NULL;
+
+  VkResult ret;
+  {
+    HostObjectScope scope(HostObjectDevice);
+    ret = createFunc(physicalDevice, &createInfo, hostAllocator ? hostAllocator->Wrap(pAllocator) : pAllocator, pDevice);
+  }
+  if (ret != VK_SUCCESS)
+  {
+    delete hostAllocator;
+    scoped_lock l(global_lock);
+    device_index_used[deviceIndex] = false;
+  }
+  else
+  {
+
+    DeviceData *deviceData = new DeviceData();
+    deviceData->index = deviceIndex;
+    deviceData->statsExtension = statsExtension;
+    deviceData->hostAllocator = hostAllocator;
+
+    // fetch our own dispatch table for the functions we need, into the next layer
+    VkLayerDispatchTable &dispatchTable = deviceData->dispatch;
+    dispatchTable.GetDeviceProcAddr = (PFN_vkGetDeviceProcAddr)gdpa(*pDevice, "vkGetDeviceProcAddr");
+    dispatchTable.DestroyDevice = (PFN_vkDestroyDevice)gdpa(*pDevice, "vkDestroyDevice");
+    dispatchTable.AllocateMemory = (PFN_vkAllocateMemory)gdpa(*pDevice, "vkAllocateMemory");
+    dispatchTable.FreeMemory = (PFN_vkFreeMemory)gdpa(*pDevice, "vkFreeMemory");
+    dispatchTable.MapMemory = (PFN_vkMapMemory)gdpa(*pDevice, "vkMapMemory");
+    dispatchTable.UnmapMemory = (PFN_vkUnmapMemory)gdpa(*pDevice, "vkUnmapMemory");
+    dispatchTable.FlushMappedMemoryRanges = (PFN_vkFlushMappedMemoryRanges)gdpa(*pDevice, "vkFlushMappedMemoryRanges");
+    dispatchTable.InvalidateMappedMemoryRanges = (PFN_vkInvalidateMappedMemoryRanges)gdpa(*pDevice, "vkInvalidateMappedMemoryRanges");
+    dispatchTable.CreateBuffer = (PFN_vkCreateBuffer)gdpa(*pDevice, "vkCreateBuffer");
+    dispatchTable.DestroyBuffer = (PFN_vkDestroyBuffer)gdpa(*pDevice, "vkDestroyBuffer");
+    dispatchTable.CreateImage = (PFN_vkCreateImage)gdpa(*pDevice, "vkCreateImage");
+    dispatchTable.DestroyImage = (PFN_vkDestroyImage)gdpa(*pDevice, "vkDestroyImage");
+    dispatchTable.CreateCommandPool = (PFN_vkCreateCommandPool)gdpa(*pDevice, "vkCreateCommandPool");
+    dispatchTable.DestroyCommandPool = (PFN_vkDestroyCommandPool)gdpa(*pDevice, "vkDestroyCommandPool");
+    dispatchTable.CreateDescriptorPool = (PFN_vkCreateDescriptorPool)gdpa(*pDevice, "vkCreateDescriptorPool");
+    dispatchTable.DestroyDescriptorPool = (PFN_vkDestroyDescriptorPool)gdpa(*pDevice, "vkDestroyDescriptorPool");
+    dispatchTable.CreateGraphicsPipelines = (PFN_vkCreateGraphicsPipelines)gdpa(*pDevice, "vkCreateGraphicsPipelines");
+    dispatchTable.CreateComputePipelines = (PFN_vkCreateComputePipelines)gdpa(*pDevice, "vkCreateComputePipelines");
+    dispatchTable.DestroyPipeline = (PFN_vkDestroyPipeline)gdpa(*pDevice, "vkDestroyPipeline");
+    dispatchTable.GetBufferMemoryRequirements = (PFN_vkGetBufferMemoryRequirements)gdpa(*pDevice, "vkGetBufferMemoryRequirements");
+    dispatchTable.GetImageMemoryRequirements = (PFN_vkGetImageMemoryRequirements)gdpa(*pDevice, "vkGetImageMemoryRequirements");
+    dispatchTable.BindBufferMemory = (PFN_vkBindBufferMemory)gdpa(*pDevice, "vkBindBufferMemory");
+    dispatchTable.BindImageMemory = (PFN_vkBindImageMemory)gdpa(*pDevice, "vkBindImageMemory");
+    dispatchTable.QueuePresentKHR = (PFN_vkQueuePresentKHR)gdpa(*pDevice, "vkQueuePresentKHR");
+
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    GetInstanceData(physicalDevice)->dispatch.GetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+    auto &deviceStats = deviceData->stats;
+    deviceStats.memoryTypeCount = memoryProperties.memoryTypeCount;
+    deviceStats.memoryHeapCount = memoryProperties.memoryHeapCount;
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+      deviceStats.memoryTypes[i].memoryType = memoryProperties.memoryTypes[i];
+    for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++)
+    {
+      deviceStats.memoryHeaps[i].memoryHeap = memoryProperties.memoryHeaps[i];
+      deviceStats.memoryHeaps[i].budget = i < config.heapBudgets.size() ? config.heapBudgets[i] : 0;
+    }
+
+    InitFrameStats(deviceData->frames, memoryProperties.memoryHeapCount);
+    if (config.stackDepth > 0)
+      deviceData->stacks = new StackTable();
+    if (config.recycleBytes > 0)
+      deviceData->recycler = new RecycleCache(memoryProperties);
+    if (config.deferredFree > 0)
+      deviceData->deferredFrees = new DeferredFreeQueue(*pDevice, deviceData->dispatch.FreeMemory,
+                                                        deviceData->latencies.frees);
+
+    // store the device data by key, once it is fully set up
+    {
+        scoped_lock l(global_lock);
+        devices.Insert(GetKey(*pDevice), deviceData);
+
+        if (!config.traceFile.empty() || !config.chromeTrace.empty())
+          trace_writer.Start(config.traceFile, config.chromeTrace);
+        if (!config.shmName.empty())
+          shm_publisher.Start(config.shmName.c_str(), config.shmInterval);
+    }
+  }
+  return ret;
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_DestroyDevice(VkDevice device, const VkAllocationCallbacks* pAllocator)
+{
+  DeviceData *deviceData;
+  {
+    scoped_lock l(global_lock);
+    deviceData = devices.Erase(GetKey(device));
+    if (deviceData == NULL)
+      return;
+
+    shm_publisher.Publish(deviceData, false);
+    device_index_used[deviceData->index] = false;
+  }
+
+  // everything the layer still holds on to goes back before the device does
+  if (deviceData->recycler)
+  {
+    std::vector<RecycleCache::Block> parked;
+    deviceData->recycler->Drain(parked);
+    for (const RecycleCache::Block &block : parked)
+    {
+      uint64_t start = NowNanoseconds();
+      deviceData->dispatch.FreeMemory(device, block.memory, NULL);
+      RecordDriverCall(deviceData->latencies.frees, block.memoryTypeIndex, block.size, NowNanoseconds() - start);
+    }
+  }
+  if (deviceData->deferredFrees)
+    deviceData->deferredFrees->Stop();
+
+  PrintDeviceReport(deviceData);
+  trace_writer.Flush();
+
+  {
+    HostObjectScope scope(HostObjectDevice);
+    deviceData->dispatch.DestroyDevice(device, deviceData->hostAllocator ?
+                                       deviceData->hostAllocator->Wrap(pAllocator) : pAllocator);
+  }
+  delete deviceData;
+}
+
+// hands memory to the driver now, or to the deferred free worker. the type
+// and size are only for timing the driver
+void FreeDeviceMemory(DeviceData *deviceData, VkDevice device, VkDeviceMemory memory, uint32_t memoryTypeIndex,
+                      uint64_t size, const VkAllocationCallbacks* pAllocator)
+{
+  if (deviceData->deferredFrees && memory != VK_NULL_HANDLE && pAllocator == NULL)
+    deviceData->deferredFrees->Push(memory, memoryTypeIndex, size);
+  else
+  {
+    HostObjectScope scope(HostObjectMemory);
+    uint64_t start = NowNanoseconds();
+    deviceData->dispatch.FreeMemory(device, memory, GetHostCallbacks(deviceData, pAllocator));
+    RecordDriverCall(deviceData->latencies.frees, memoryTypeIndex, size, NowNanoseconds() - start);
+  }
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_AllocateMemory(VkDevice device, const VkMemoryAllocateInfo* pAllocateInfo,
+                                                               const VkAllocationCallbacks* pAllocator, VkDeviceMemory* pMemory)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  auto &memoryHeapInfo = GetMemoryHeapInfo(deviceData->stats, pAllocateInfo->memoryTypeIndex);
+
+  // refused allocations never reach the driver
+  if (InjectFailure(deviceData) || !ReserveBudget(memoryHeapInfo, pAllocateInfo->allocationSize))
+    return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+
+  bool recyclable = deviceData->recycler && pAllocateInfo->pNext == NULL && pAllocator == NULL &&
+                    deviceData->recycler->Recyclable(pAllocateInfo->memoryTypeIndex, pAllocateInfo->allocationSize);
+
+  // a recycled block counts with its real size from here on. if the rest of
+  // it doesn't fit the budget, it is freed for real and the driver asked instead
+  uint64_t size = pAllocateInfo->allocationSize;
+  bool recycled = recyclable && deviceData->recycler->Take(pAllocateInfo->memoryTypeIndex, size, pMemory, &size);
+  if (recycled && !ReserveBudget(memoryHeapInfo, size - pAllocateInfo->allocationSize))
+  {
+    FreeDeviceMemory(deviceData, device, *pMemory, pAllocateInfo->memoryTypeIndex, size, NULL);
+    size = pAllocateInfo->allocationSize;
+    recycled = false;
+  }
+
+  // no layer lock is held across the call into the next layer
+  VkResult res = VK_SUCCESS;
+  if (!recycled)
+  {
+    HostObjectScope scope(HostObjectMemory);
+    uint64_t start = NowNanoseconds();
+    res = deviceData->dispatch.AllocateMemory(device, pAllocateInfo, GetHostCallbacks(deviceData, pAllocator), pMemory);
+    RecordDriverCall(deviceData->latencies.allocations, pAllocateInfo->memoryTypeIndex, pAllocateInfo->allocationSize,
+                     NowNanoseconds() - start);
+  }
+  if (res != VK_SUCCESS)
+    ReleaseBudget(memoryHeapInfo, pAllocateInfo->allocationSize);
+  else
+  {
+    AllocationRecord record;
+    record.size = size;
+    record.memoryTypeIndex = pAllocateInfo->memoryTypeIndex;
+    record.flags = GetAllocationFlags(pAllocateInfo);
+    record.deviceIndex = deviceData->index;
+    record.timestamp = NowMicroseconds();
+    record.extended = pAllocateInfo->pNext != NULL;
+    record.stackId = 0;
+
+    if (deviceData->stacks && SampleStack(record.size))
+    {
+      CallStack stack;
+      CaptureStack(stack, config.stackDepth);
+      // a stack that couldn't be walked would never show up in the report,
+      // so the allocation is left without one rather than charged to it
+      if (stack.depth > 0)
+        record.stackId = deviceData->stacks->Intern(stack);
+      if (record.stackId != 0)
+        AddStackUsage(*deviceData->stacks, record.stackId, record.size);
+    }
+
+    {
+      auto &shard = GetShard(deviceData->allocationShards, (uint64_t) *pMemory);
+      scoped_lock l(shard.lock);
+      shard.allocations.Insert((uint64_t) *pMemory) = record;
+    }
 
-// use the loader's dispatch table pointer as a key for dispatch map lookups
-template<typename DispatchableType>
-void *GetKey(DispatchableType inst)
-{
-  return *(void **)inst;
-}
+    AddUsage(deviceData->stats, pAllocateInfo->memoryTypeIndex, size);
 
-// layer book-keeping information, to store dispatch tables by key
-std::map<void *, VkLayerInstanceDispatchTable> instance_dispatch;
-std::map<void *, VkLayerDispatchTable> device_dispatch;
+    if (trace_writer.Enabled())
+      TraceMemoryEvent(deviceData, TraceEventAllocate, (uint64_t) *pMemory, pAllocateInfo->memoryTypeIndex, 0, 0, size);
+  }
 
-// actual data we're recording in this layer
-struct MemoryTypeInfo
-{
-  VkMemoryType memoryType;
-  uint64_t currentUsage;
-  uint64_t maximumUsage;
-};
+  return res;
+}
 
-struct MemoryHeapInfo
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_FreeMemory(VkDevice device, VkDeviceMemory memory,
+                                                       const VkAllocationCallbacks* pAllocator)
 {
-  VkMemoryHeap memoryHeap;
-  uint64_t currentUsage;
-  uint64_t maximumUsage;
-};
+  DeviceData *deviceData = GetDeviceData(device);
 
-struct DeviceStats
-{
-    std::vector<MemoryTypeInfo> memoryTypes;
-    std::vector<MemoryHeapInfo> memoryHeaps;
-};
+  // forget the allocation before handing it back, since the next layer may
+  // give the same handle to another thread as soon as it is freed
+  // anything still bound stops counting as bound, the resources can't be used anymore
+  // so is a mapping, freeing memory unmaps it
+  AllocationRecord record;
+  AllocationUsage usage = {};
+  MappingRecord mapping = {};
+  bool found;
+  {
+    auto &shard = GetShard(deviceData->allocationShards, (uint64_t) memory);
+    scoped_lock l(shard.lock);
+    found = shard.allocations.Erase((uint64_t) memory, &record);
+    shard.usage.Erase((uint64_t) memory, &usage);
+    shard.mappings.Erase((uint64_t) memory, &mapping);
+  }
+
+  if (found)
+  {
+    uint64_t now = NowMicroseconds();
+    RecordLifetime(deviceData->lifetimes, record, now);
+    if (mapping.mappedBytes != 0)
+    {
+      mapping.mappedTime += now - mapping.mapTimestamp;
+      RemoveMapping(deviceData->maps, deviceData->stats.memoryTypes[record.memoryTypeIndex].memoryType.heapIndex,
+                    mapping.mappedBytes, now - mapping.mapTimestamp);
+    }
+    if (mapping.mapCount >= MinRemapCount || mapping.maximumWholeFlushStreak >= MinWholeFlushStreak)
+    {
+      MappedAllocation allocation = { (uint64_t) memory, record.size, (uint32_t) record.memoryTypeIndex,
+                                      (uint32_t) record.stackId, mapping, true };
+      if (mapping.mapCount >= MinRemapCount)
+        AddFreedCandidate(deviceData->maps, deviceData->maps.freedRemapped, allocation, GetMapCount);
+      if (mapping.maximumWholeFlushStreak >= MinWholeFlushStreak)
+        AddFreedCandidate(deviceData->maps, deviceData->maps.freedOverflushed, allocation, GetWholeFlushStreak);
+    }
+    if (record.stackId != 0)
+      SubtractStackUsage(*deviceData->stacks, record.stackId, record.size);
+    SubtractUsage(deviceData->stats, record.memoryTypeIndex, record.size, usage.boundBytes);
+    ReleaseBudget(GetMemoryHeapInfo(deviceData->stats, record.memoryTypeIndex), record.size);
 
-std::map<VkDevice, struct DeviceStats> devices;
+    if (trace_writer.Enabled())
+      TraceMemoryEvent(deviceData, TraceEventFree, (uint64_t) memory, record.memoryTypeIndex, 0, 0, record.size);
+  }
 
-// keep track of all allocations so we can properly account them on free
-// note that this does not perform a deep copy, so pNext chains are invalid
-std::map<VkDeviceMemory, VkMemoryAllocateInfo> allocations;
+  // the driver is only called for what can't be parked, or had to make room
+  std::vector<RecycleCache::Block> evicted;
+  if (found && deviceData->recycler && !record.extended && pAllocator == NULL &&
+      deviceData->recycler->Park(memory, record.memoryTypeIndex, record.size, evicted))
+  {
+    for (const RecycleCache::Block &block : evicted)
+      FreeDeviceMemory(deviceData, device, block.memory, block.memoryTypeIndex, block.size, NULL);
+    return;
+  }
 
-///////////////////////////////////////////////////////////////////////////////////////////
-// Layer init and shutdown
+  FreeDeviceMemory(deviceData, device, memory, found ? (uint32_t) record.memoryTypeIndex : UnknownMemoryType,
+                   found ? (uint64_t) record.size : 0, pAllocator);
+}
 
-VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_CreateInstance(
-    const VkInstanceCreateInfo*                 pCreateInfo,
-    const VkAllocationCallbacks*                pAllocator,
-    VkInstance*                                 pInstance)
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_MapMemory(VkDevice device, VkDeviceMemory memory, VkDeviceSize offset,
+                                                          VkDeviceSize size, VkMemoryMapFlags flags, void** ppData)
 {
-  VkLayerInstanceCreateInfo *layerCreateInfo = (VkLayerInstanceCreateInfo *)pCreateInfo->pNext;
+  DeviceData *deviceData = GetDeviceData(device);
+  VkResult res = deviceData->dispatch.MapMemory(device, memory, offset, size, flags, ppData);
+  if (res != VK_SUCCESS)
+    return res;
 
-  // step through the chain of pNext until we get to the link info
-  while(layerCreateInfo && (layerCreateInfo->sType != VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO ||
-                            layerCreateInfo->function != VK_LAYER_LINK_INFO))
+  uint64_t now = NowMicroseconds();
+  uint32_t memoryTypeIndex;
   {
-    layerCreateInfo = (VkLayerInstanceCreateInfo *)layerCreateInfo->pNext;
-  }
+    auto &shard = GetShard(deviceData->allocationShards, (uint64_t) memory);
+    scoped_lock l(shard.lock);
+    const AllocationRecord *record = shard.allocations.Find((uint64_t) memory);
+    if (record == NULL)
+      return res;
 
-  if(layerCreateInfo == NULL)
-  {
-    // No loader instance create info
-    return VK_ERROR_INITIALIZATION_FAILED;
+    memoryTypeIndex = record->memoryTypeIndex;
+    if (size == VK_WHOLE_SIZE)
+      size = record->size - offset;
+
+    MappingRecord &mapping = shard.mappings.Insert((uint64_t) memory);
+    mapping.mapOffset = offset;
+    mapping.mappedBytes = size;
+    mapping.mapTimestamp = now;
+    mapping.mapCount++;
   }
 
-  PFN_vkGetInstanceProcAddr gpa = layerCreateInfo->u.pLayerInfo->pfnNextGetInstanceProcAddr;
-  // move chain on for next layer
-  layerCreateInfo->u.pLayerInfo = layerCreateInfo->u.pLayerInfo->pNext;
+  AddMapping(deviceData->maps, deviceData->stats.memoryTypes[memoryTypeIndex].memoryType.heapIndex, size);
 
-  PFN_vkCreateInstance createFunc = (PFN_vkCreateInstance)gpa(VK_NULL_HANDLE, "vkCreateInstance");
+  if (trace_writer.Enabled())
+    TraceMemoryEvent(deviceData, TraceEventMap, (uint64_t) memory, memoryTypeIndex, 0, offset, size);
 
-  VkResult ret = createFunc(pCreateInfo, pAllocator, pInstance);
-  if (ret == VK_SUCCESS)
+  return res;
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_UnmapMemory(VkDevice device, VkDeviceMemory memory)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  deviceData->dispatch.UnmapMemory(device, memory);
+
+  uint64_t now = NowMicroseconds();
+  uint32_t memoryTypeIndex;
+  uint64_t mappedBytes = 0, lifetime = 0;
   {
+    auto &shard = GetShard(deviceData->allocationShards, (uint64_t) memory);
+    scoped_lock l(shard.lock);
+    const AllocationRecord *record = shard.allocations.Find((uint64_t) memory);
+    if (record == NULL)
+      return;
 
-    // fetch our own dispatch table for the functions we need, into the next layer
-    VkLayerInstanceDispatchTable dispatchTable;
-    dispatchTable.GetInstanceProcAddr = (PFN_vkGetInstanceProcAddr)gpa(*pInstance, "vkGetInstanceProcAddr");
-    dispatchTable.DestroyInstance = (PFN_vkDestroyInstance)gpa(*pInstance, "vkDestroyInstance");
-    dispatchTable.EnumerateDeviceExtensionProperties = (PFN_vkEnumerateDeviceExtensionProperties)gpa(*pInstance, "vkEnumerateDeviceExtensionProperties");
-    dispatchTable.GetPhysicalDeviceMemoryProperties = (PFN_vkGetPhysicalDeviceMemoryProperties)gpa(*pInstance, "vkGetPhysicalDeviceMemoryProperties");
+    memoryTypeIndex = record->memoryTypeIndex;
+    MappingRecord *mapping = shard.mappings.Find((uint64_t) memory);
+    if (mapping && mapping->mappedBytes != 0)
+    {
+      mappedBytes = mapping->mappedBytes;
+      lifetime = now - mapping->mapTimestamp;
+      mapping->mappedBytes = 0;
+      mapping->mappedTime += lifetime;
+    }
+  }
+
+  if (mappedBytes != 0)
+    RemoveMapping(deviceData->maps, deviceData->stats.memoryTypes[memoryTypeIndex].memoryType.heapIndex,
+                  mappedBytes, lifetime);
+
+  if (trace_writer.Enabled())
+    TraceMemoryEvent(deviceData, TraceEventUnmap, (uint64_t) memory, memoryTypeIndex, 0, 0, 0);
+}
+
+// counts the ranges into the statistics of their memory types and into the
+// mappings they fall into
+void RecordFlushRanges(DeviceData *deviceData, RangeStats *rangeStats, uint32_t memoryRangeCount,
+                       const VkMappedMemoryRange* pMemoryRanges)
+{
+  uint64_t frame = deviceData->frames.currentFrame.load(std::memory_order_relaxed);
+  uint32_t types = 0;
 
-    // store the table by key
+  for (uint32_t i = 0; i < memoryRangeCount; i++)
+  {
+    const VkMappedMemoryRange &range = pMemoryRanges[i];
+    uint32_t memoryTypeIndex;
+    uint64_t size, bytes;
+    bool whole;
     {
-        scoped_lock l(global_lock);
-        instance_dispatch[GetKey(*pInstance)] = dispatchTable;
+      auto &shard = GetShard(deviceData->allocationShards, (uint64_t) range.memory);
+      scoped_lock l(shard.lock);
+      const AllocationRecord *record = shard.allocations.Find((uint64_t) range.memory);
+      MappingRecord *mapping = shard.mappings.Find((uint64_t) range.memory);
+      if (record == NULL || mapping == NULL || mapping->mappedBytes == 0)
+        continue;
+
+      memoryTypeIndex = record->memoryTypeIndex;
+      size = record->size;
+      bytes = RecordFlushRange(*mapping, range, frame, &whole);
     }
 
+    RangeStats &stats = rangeStats[memoryTypeIndex];
+    stats.ranges.fetch_add(1, std::memory_order_relaxed);
+    stats.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    stats.allocationBytes.fetch_add(size, std::memory_order_relaxed);
+    if (whole)
+      stats.wholeRanges.fetch_add(1, std::memory_order_relaxed);
+    types |= 1u << memoryTypeIndex;
   }
 
-  return ret;
+  for (uint32_t i = 0; i < VK_MAX_MEMORY_TYPES; i++)
+    if (types & (1u << i))
+      rangeStats[i].calls.fetch_add(1, std::memory_order_relaxed);
 }
 
-VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_DestroyInstance(VkInstance instance, const VkAllocationCallbacks* pAllocator)
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_FlushMappedMemoryRanges(VkDevice device, uint32_t memoryRangeCount,
+                                                                        const VkMappedMemoryRange* pMemoryRanges)
 {
-  scoped_lock l(global_lock);
-  instance_dispatch.erase(GetKey(instance));
+  DeviceData *deviceData = GetDeviceData(device);
+  RecordFlushRanges(deviceData, deviceData->flushes.flushes, memoryRangeCount, pMemoryRanges);
+  return deviceData->dispatch.FlushMappedMemoryRanges(device, memoryRangeCount, pMemoryRanges);
 }
 
-VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_CreateDevice(
-    VkPhysicalDevice                            physicalDevice,
-    const VkDeviceCreateInfo*                   pCreateInfo,
-    const VkAllocationCallbacks*                pAllocator,
-    VkDevice*                                   pDevice)
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_InvalidateMappedMemoryRanges(VkDevice device, uint32_t memoryRangeCount,
+                                                                             const VkMappedMemoryRange* pMemoryRanges)
 {
-  VkLayerDeviceCreateInfo *layerCreateInfo = (VkLayerDeviceCreateInfo *)pCreateInfo->pNext;
+  DeviceData *deviceData = GetDeviceData(device);
+  RecordFlushRanges(deviceData, deviceData->flushes.invalidations, memoryRangeCount, pMemoryRanges);
+  return deviceData->dispatch.InvalidateMappedMemoryRanges(device, memoryRangeCount, pMemoryRanges);
+}
 
-  // step through the chain of pNext until we get to the link info
-  while(layerCreateInfo && (layerCreateInfo->sType != VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO ||
-                            layerCreateInfo->function != VK_LAYER_LINK_INFO))
+///////////////////////////////////////////////////////////////////////////////////////////
+// Presentation
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR* pPresentInfo)
+{
+  DeviceData *deviceData = GetDeviceData(queue);
+
+  // the app is done recording the frame by the time it presents it
+  EndFrame(deviceData->stats, deviceData->frames);
+
+  if (trace_writer.Enabled())
   {
-    layerCreateInfo = (VkLayerDeviceCreateInfo *)layerCreateInfo->pNext;
+    TraceEvent event = {};
+    event.timestamp = NowNanoseconds();
+    event.object = deviceData->frames.currentFrame.load(std::memory_order_relaxed);
+    event.type = TraceEventPresent;
+    event.deviceIndex = deviceData->index;
+    trace_writer.Record(event);
   }
 
-  if(layerCreateInfo == NULL)
+  return deviceData->dispatch.QueuePresentKHR(queue, pPresentInfo);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Resource binding
+
+void RecordResourceSize(ResourceShard (&shards)[ShardCount], uint64_t resource, uint64_t size)
+{
+  auto &shard = GetShard(shards, resource);
+  scoped_lock l(shard.lock);
+  shard.resources.Insert(resource).size = size;
+}
+
+uint64_t GetResourceSize(ResourceShard (&shards)[ShardCount], uint64_t resource)
+{
+  auto &shard = GetShard(shards, resource);
+  scoped_lock l(shard.lock);
+  const ResourceRecord *record = shard.resources.Find(resource);
+  return record ? record->size : 0;
+}
+
+void BindResource(DeviceData *deviceData, ResourceShard (&shards)[ShardCount], TraceEventType traceType,
+                  uint64_t resource, VkDeviceMemory memory, uint64_t offset, uint64_t size)
+{
+  uint64_t memoryTimestamp;
+  uint32_t memoryTypeIndex;
   {
-    // No loader instance create info
-    return VK_ERROR_INITIALIZATION_FAILED;
+    auto &shard = GetShard(deviceData->allocationShards, (uint64_t) memory);
+    scoped_lock l(shard.lock);
+    const AllocationRecord *record = shard.allocations.Find((uint64_t) memory);
+    if (record == NULL)
+      return;
+
+    AllocationUsage &usage = shard.usage.Insert((uint64_t) memory);
+    usage.boundBytes += size;
+    usage.ranges.Insert(offset, size);
+    memoryTimestamp = record->timestamp;
+    memoryTypeIndex = record->memoryTypeIndex;
   }
 
-  PFN_vkGetInstanceProcAddr gipa = layerCreateInfo->u.pLayerInfo->pfnNextGetInstanceProcAddr;
-  PFN_vkGetDeviceProcAddr gdpa = layerCreateInfo->u.pLayerInfo->pfnNextGetDeviceProcAddr;
-  // move chain on for next layer
-  layerCreateInfo->u.pLayerInfo = layerCreateInfo->u.pLayerInfo->pNext;
+  AddBoundUsage(deviceData->stats, memoryTypeIndex, size);
 
-  PFN_vkCreateDevice createFunc = (PFN_vkCreateDevice)gipa(VK_NULL_HANDLE, "vkCreateDevice");
+  if (trace_writer.Enabled())
+    TraceMemoryEvent(deviceData, traceType, (uint64_t) memory, memoryTypeIndex, resource, offset, size);
 
-  VkResult ret = createFunc(physicalDevice, pCreateInfo, pAllocator, pDevice);
-  if (ret == VK_SUCCESS)
+  auto &shard = GetShard(shards, resource);
+  scoped_lock l(shard.lock);
+  ResourceRecord &record = shard.resources.Insert(resource);
+  record.size = size;
+  record.memory = (uint64_t) memory;
+  record.memoryTimestamp = memoryTimestamp;
+  record.offset = offset;
+}
+
+void DestroyResource(DeviceData *deviceData, ResourceShard (&shards)[ShardCount], TraceEventType traceType,
+                     uint64_t resource)
+{
+  ResourceRecord resourceRecord;
   {
+    auto &shard = GetShard(shards, resource);
+    scoped_lock l(shard.lock);
+    if (!shard.resources.Erase(resource, &resourceRecord) || resourceRecord.memory == 0)
+      return;
+  }
 
-    // fetch our own dispatch table for the functions we need, into the next layer
-    VkLayerDispatchTable dispatchTable;
-    dispatchTable.GetDeviceProcAddr = (PFN_vkGetDeviceProcAddr)gdpa(*pDevice, "vkGetDeviceProcAddr");
-    dispatchTable.DestroyDevice = (PFN_vkDestroyDevice)gdpa(*pDevice, "vkDestroyDevice");
-    dispatchTable.AllocateMemory = (PFN_vkAllocateMemory)gdpa(*pDevice, "vkAllocateMemory");
-    dispatchTable.FreeMemory = (PFN_vkFreeMemory)gdpa(*pDevice, "vkFreeMemory");
+  uint32_t memoryTypeIndex;
+  {
+    auto &shard = GetShard(deviceData->allocationShards, resourceRecord.memory);
+    scoped_lock l(shard.lock);
 
-    // store the table by key
-    {
-        scoped_lock l(global_lock);
-        device_dispatch[GetKey(*pDevice)] = dispatchTable;
-    }
+    // if the memory was freed first, its bound bytes were already dropped then
+    const AllocationRecord *record = shard.allocations.Find(resourceRecord.memory);
+    AllocationUsage *usage = shard.usage.Find(resourceRecord.memory);
+    if (record == NULL || usage == NULL || record->timestamp != resourceRecord.memoryTimestamp)
+      return;
 
-    VkPhysicalDeviceMemoryProperties memoryProperties;
-    auto &instanceDispatch = instance_dispatch[GetKey(physicalDevice)];
-    instanceDispatch.GetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+    if (!usage->ranges.Erase(resourceRecord.offset, resourceRecord.size))
+      return;
 
-    struct DeviceStats deviceStats = {};
-    deviceStats.memoryTypes.resize(memoryProperties.memoryTypeCount);
-    deviceStats.memoryHeaps.resize(memoryProperties.memoryHeapCount);
-    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
-      deviceStats.memoryTypes[i].memoryType = memoryProperties.memoryTypes[i];
-    for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++)
-      deviceStats.memoryHeaps[i].memoryHeap = memoryProperties.memoryHeaps[i];
+    usage->boundBytes -= resourceRecord.size;
+    if (usage->ranges.Empty())
+      shard.usage.Erase(resourceRecord.memory);
+    memoryTypeIndex = record->memoryTypeIndex;
+  }
+
+  SubtractBoundUsage(deviceData->stats, memoryTypeIndex, resourceRecord.size);
+
+  if (trace_writer.Enabled())
+    TraceMemoryEvent(deviceData, traceType, resourceRecord.memory, memoryTypeIndex, resource,
+                     resourceRecord.offset, resourceRecord.size);
+}
 
-    devices[*pDevice] = deviceStats;
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_CreateBuffer(VkDevice device, const VkBufferCreateInfo* pCreateInfo,
+                                                             const VkAllocationCallbacks* pAllocator, VkBuffer* pBuffer)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  VkResult res;
+  {
+    HostObjectScope scope(HostObjectBuffer);
+    res = deviceData->dispatch.CreateBuffer(device, pCreateInfo, GetHostCallbacks(deviceData, pAllocator), pBuffer);
   }
-  return ret;
+  if (res == VK_SUCCESS)
+    RecordResourceSize(deviceData->bufferShards, (uint64_t) *pBuffer, 0);
+
+  return res;
 }
 
-VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_DestroyDevice(VkDevice device, const VkAllocationCallbacks* pAllocator)
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_DestroyBuffer(VkDevice device, VkBuffer buffer,
+                                                          const VkAllocationCallbacks* pAllocator)
 {
-  scoped_lock l(global_lock);
-  auto &deviceStats = devices[device];
-  uint64_t sum_device = 0, sum_host = 0;
+  DeviceData *deviceData = GetDeviceData(device);
+  DestroyResource(deviceData, deviceData->bufferShards, TraceEventUnbindBuffer, (uint64_t) buffer);
+  HostObjectScope scope(HostObjectBuffer);
+  deviceData->dispatch.DestroyBuffer(device, buffer, GetHostCallbacks(deviceData, pAllocator));
+}
 
-  printf("Maximum usage by memory type index:\n");
-  for (int i = 0; i < deviceStats.memoryTypes.size(); i++)
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_CreateImage(VkDevice device, const VkImageCreateInfo* pCreateInfo,
+                                                            const VkAllocationCallbacks* pAllocator, VkImage* pImage)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  VkResult res;
   {
-    const auto &typeInfo = deviceStats.memoryTypes[i];
-    if (typeInfo.maximumUsage == 0)
-      continue;
-
-    printf(" %3d: %" PRIu64 " bytes (heap %u)\n", i,
-           (uint64_t) typeInfo.maximumUsage, typeInfo.memoryType.heapIndex);
+    HostObjectScope scope(HostObjectImage);
+    res = deviceData->dispatch.CreateImage(device, pCreateInfo, GetHostCallbacks(deviceData, pAllocator), pImage);
   }
+  if (res == VK_SUCCESS)
+    RecordResourceSize(deviceData->imageShards, (uint64_t) *pImage, 0);
 
-  printf("Maximum usage by memory heap:\n");
-  for (int i = 0; i < deviceStats.memoryHeaps.size(); i++)
-  {
-    const auto &heapInfo = deviceStats.memoryHeaps[i];
-    if (heapInfo.maximumUsage == 0)
-      continue;
+  return res;
+}
 
-    printf(" %3d: %" PRIu64 " bytes\n", i, (uint64_t) heapInfo.maximumUsage);
-    if (heapInfo.memoryHeap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
-      sum_device += heapInfo.maximumUsage;
-    else
-      sum_host += heapInfo.maximumUsage;
-  }
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_DestroyImage(VkDevice device, VkImage image,
+                                                         const VkAllocationCallbacks* pAllocator)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  DestroyResource(deviceData, deviceData->imageShards, TraceEventUnbindImage, (uint64_t) image);
+  HostObjectScope scope(HostObjectImage);
+  deviceData->dispatch.DestroyImage(device, image, GetHostCallbacks(deviceData, pAllocator));
+}
 
-  printf("Maximum device memory: %" PRIu64 " bytes\n", sum_device);
-  printf("Maximum host memory: %" PRIu64 " bytes\n", sum_host);
+// the objects below are only intercepted to count their host memory
 
-  devices.erase(device);
-  device_dispatch.erase(GetKey(device));
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_CreateCommandPool(VkDevice device, const VkCommandPoolCreateInfo* pCreateInfo,
+                                                                  const VkAllocationCallbacks* pAllocator,
+                                                                  VkCommandPool* pCommandPool)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  HostObjectScope scope(HostObjectCommandPool);
+  return deviceData->dispatch.CreateCommandPool(device, pCreateInfo, GetHostCallbacks(deviceData, pAllocator), pCommandPool);
 }
 
-VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_AllocateMemory(VkDevice device, const VkMemoryAllocateInfo* pAllocateInfo,
-                                                               const VkAllocationCallbacks* pAllocator, VkDeviceMemory* pMemory)
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_DestroyCommandPool(VkDevice device, VkCommandPool commandPool,
+                                                               const VkAllocationCallbacks* pAllocator)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  HostObjectScope scope(HostObjectCommandPool);
+  deviceData->dispatch.DestroyCommandPool(device, commandPool, GetHostCallbacks(deviceData, pAllocator));
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_CreateDescriptorPool(VkDevice device,
+                                                                     const VkDescriptorPoolCreateInfo* pCreateInfo,
+                                                                     const VkAllocationCallbacks* pAllocator,
+                                                                     VkDescriptorPool* pDescriptorPool)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  HostObjectScope scope(HostObjectDescriptorPool);
+  return deviceData->dispatch.CreateDescriptorPool(device, pCreateInfo, GetHostCallbacks(deviceData, pAllocator),
+                                                   pDescriptorPool);
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_DestroyDescriptorPool(VkDevice device, VkDescriptorPool descriptorPool,
+                                                                  const VkAllocationCallbacks* pAllocator)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  HostObjectScope scope(HostObjectDescriptorPool);
+  deviceData->dispatch.DestroyDescriptorPool(device, descriptorPool, GetHostCallbacks(deviceData, pAllocator));
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_CreateGraphicsPipelines(VkDevice device, VkPipelineCache pipelineCache,
+                                                                        uint32_t createInfoCount,
+                                                                        const VkGraphicsPipelineCreateInfo* pCreateInfos,
+                                                                        const VkAllocationCallbacks* pAllocator,
+                                                                        VkPipeline* pPipelines)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  HostObjectScope scope(HostObjectPipeline);
+  return deviceData->dispatch.CreateGraphicsPipelines(device, pipelineCache, createInfoCount, pCreateInfos,
+                                                      GetHostCallbacks(deviceData, pAllocator), pPipelines);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_CreateComputePipelines(VkDevice device, VkPipelineCache pipelineCache,
+                                                                       uint32_t createInfoCount,
+                                                                       const VkComputePipelineCreateInfo* pCreateInfos,
+                                                                       const VkAllocationCallbacks* pAllocator,
+                                                                       VkPipeline* pPipelines)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  HostObjectScope scope(HostObjectPipeline);
+  return deviceData->dispatch.CreateComputePipelines(device, pipelineCache, createInfoCount, pCreateInfos,
+                                                     GetHostCallbacks(deviceData, pAllocator), pPipelines);
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_DestroyPipeline(VkDevice device, VkPipeline pipeline,
+                                                            const VkAllocationCallbacks* pAllocator)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  HostObjectScope scope(HostObjectPipeline);
+  deviceData->dispatch.DestroyPipeline(device, pipeline, GetHostCallbacks(deviceData, pAllocator));
+}
+
+// the requirements are remembered so that binding doesn't need to query them again
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_GetBufferMemoryRequirements(VkDevice device, VkBuffer buffer,
+                                                                        VkMemoryRequirements* pMemoryRequirements)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  deviceData->dispatch.GetBufferMemoryRequirements(device, buffer, pMemoryRequirements);
+  RecordResourceSize(deviceData->bufferShards, (uint64_t) buffer, pMemoryRequirements->size);
+}
+
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_GetImageMemoryRequirements(VkDevice device, VkImage image,
+                                                                       VkMemoryRequirements* pMemoryRequirements)
 {
-  scoped_lock l(global_lock);
-  VkResult res = device_dispatch[GetKey(device)].AllocateMemory(device, pAllocateInfo, pAllocator, pMemory);
+  DeviceData *deviceData = GetDeviceData(device);
+  deviceData->dispatch.GetImageMemoryRequirements(device, image, pMemoryRequirements);
+  RecordResourceSize(deviceData->imageShards, (uint64_t) image, pMemoryRequirements->size);
+}
+
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_BindBufferMemory(VkDevice device, VkBuffer buffer,
+                                                                 VkDeviceMemory memory, VkDeviceSize memoryOffset)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  VkResult res = deviceData->dispatch.BindBufferMemory(device, buffer, memory, memoryOffset);
   if (res == VK_SUCCESS)
   {
-    allocations[*pMemory] = *pAllocateInfo;
-
-    auto &memoryTypeInfo = devices[device].memoryTypes[pAllocateInfo->memoryTypeIndex];
-    auto &memoryHeapInfo = devices[device].memoryHeaps[memoryTypeInfo.memoryType.heapIndex];
+    uint64_t size = GetResourceSize(deviceData->bufferShards, (uint64_t) buffer);
+    if (size == 0)
+    {
+      VkMemoryRequirements memoryRequirements;
+      deviceData->dispatch.GetBufferMemoryRequirements(device, buffer, &memoryRequirements);
+      size = memoryRequirements.size;
+    }
 
-    memoryTypeInfo.currentUsage += pAllocateInfo->allocationSize;
-    memoryHeapInfo.currentUsage += pAllocateInfo->allocationSize;
-    if (memoryTypeInfo.currentUsage > memoryTypeInfo.maximumUsage)
-      memoryTypeInfo.maximumUsage = memoryTypeInfo.currentUsage;
-    if (memoryHeapInfo.currentUsage > memoryHeapInfo.maximumUsage)
-      memoryHeapInfo.maximumUsage = memoryHeapInfo.currentUsage;
+    BindResource(deviceData, deviceData->bufferShards, TraceEventBindBuffer, (uint64_t) buffer, memory, memoryOffset, size);
   }
 
   return res;
 }
 
-VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_FreeMemory(VkDevice device, VkDeviceMemory memory,
-                                                       const VkAllocationCallbacks* pAllocator)
+VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_BindImageMemory(VkDevice device, VkImage image,
+                                                                VkDeviceMemory memory, VkDeviceSize memoryOffset)
 {
-  scoped_lock l(global_lock);
+  DeviceData *deviceData = GetDeviceData(device);
+  VkResult res = deviceData->dispatch.BindImageMemory(device, image, memory, memoryOffset);
+  if (res == VK_SUCCESS)
+  {
+    uint64_t size = GetResourceSize(deviceData->imageShards, (uint64_t) image);
+    if (size == 0)
+    {
+      VkMemoryRequirements memoryRequirements;
+      deviceData->dispatch.GetImageMemoryRequirements(device, image, &memoryRequirements);
+      size = memoryRequirements.size;
+    }
 
-  const auto &allocInfo = allocations[memory];
-  auto &memoryTypeInfo = devices[device].memoryTypes[allocInfo.memoryTypeIndex];
-  auto &memoryHeapInfo = devices[device].memoryHeaps[memoryTypeInfo.memoryType.heapIndex];
-  memoryTypeInfo.currentUsage -= allocInfo.allocationSize;
-  memoryHeapInfo.currentUsage -= allocInfo.allocationSize;
-  allocations.erase(memory);
+    BindResource(deviceData, deviceData->imageShards, TraceEventBindImage, (uint64_t) image, memory, memoryOffset, size);
+  }
+
+  return res;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Statistics extension, see memory_track_ext.h
+
+const VkExtensionProperties device_extensions[] = {
+  { VK_NXT_MEMORY_TRACK_STATS_EXTENSION_NAME, VK_NXT_MEMORY_TRACK_STATS_SPEC_VERSION },
+};
 
-  device_dispatch[GetKey(device)].FreeMemory(device, memory, pAllocator);
+VK_LAYER_EXPORT void VKAPI_CALL MemoryTrack_GetMemoryTrackStatsNXT(VkDevice device, VkMemoryTrackStatsNXT *pStats)
+{
+  DeviceData *deviceData = GetDeviceData(device);
+  const auto &deviceStats = deviceData->stats;
+
+  pStats->memoryHeapCount = deviceStats.memoryHeapCount;
+  for (uint32_t i = 0; i < deviceStats.memoryHeapCount; i++)
+  {
+    const auto &heapInfo = deviceStats.memoryHeaps[i];
+    HeapCounters counters = ReadHeapCounters(heapInfo);
+    VkMemoryTrackHeapStatsNXT &heap = pStats->memoryHeaps[i];
+    heap.size = heapInfo.memoryHeap.size;
+    heap.flags = heapInfo.memoryHeap.flags;
+    heap.budget = heapInfo.budget;
+    heap.currentUsage = counters.currentUsage;
+    heap.maximumUsage = counters.maximumUsage;
+    heap.currentBound = counters.currentBound;
+    heap.maximumBound = counters.maximumBound;
+    heap.allocationCount = counters.allocationCount;
+    heap.totalAllocations = counters.totalAllocations;
+  }
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////
@@ -300,57 +4207,150 @@ VK_LAYER_EXPORT VkResult VKAPI_CALL MemoryTrack_EnumerateDeviceExtensionProperti
     if(physicalDevice == VK_NULL_HANDLE)
       return VK_SUCCESS;
 
-    scoped_lock l(global_lock);
-    return instance_dispatch[GetKey(physicalDevice)].EnumerateDeviceExtensionProperties(physicalDevice, pLayerName, pPropertyCount, pProperties);
+    return GetInstanceData(physicalDevice)->dispatch.EnumerateDeviceExtensionProperties(physicalDevice, pLayerName, pPropertyCount, pProperties);
   }
 
-  // don't expose any extensions
-  if(pPropertyCount) *pPropertyCount = 0;
-  return VK_SUCCESS;
+  // nowhere to say how many there are, or how many were written
+  uint32_t count = sizeof(device_extensions) / sizeof(device_extensions[0]);
+  if(pPropertyCount == NULL)
+    return pProperties == NULL ? VK_SUCCESS : VK_INCOMPLETE;
+
+  if(pProperties == NULL)
+  {
+    *pPropertyCount = count;
+    return VK_SUCCESS;
+  }
+
+  uint32_t copied = std::min(*pPropertyCount, count);
+  memcpy(pProperties, device_extensions, copied * sizeof(VkExtensionProperties));
+  *pPropertyCount = copied;
+  return copied < count ? VK_INCOMPLETE : VK_SUCCESS;
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////
 // GetProcAddr functions, entry points of the layer
 
-#define GETPROCADDR(func) if(!strcmp(pName, "vk" #func)) return (PFN_vkVoidFunction)&MemoryTrack_##func;
+// every function we intercept, sorted by name so that lookups can binary
+// search. instance functions can only be queried through vkGetInstanceProcAddr,
+// device functions through either. keep the list sorted, this is checked at
+// compile time
+#define INTERCEPTED_FUNCTIONS(INSTANCE, DEVICE) \
+  DEVICE(AllocateMemory) \
+  DEVICE(BindBufferMemory) \
+  DEVICE(BindImageMemory) \
+  DEVICE(CreateBuffer) \
+  DEVICE(CreateCommandPool) \
+  DEVICE(CreateComputePipelines) \
+  DEVICE(CreateDescriptorPool) \
+  DEVICE(CreateDevice) \
+  DEVICE(CreateGraphicsPipelines) \
+  DEVICE(CreateImage) \
+  INSTANCE(CreateInstance) \
+  DEVICE(DestroyBuffer) \
+  DEVICE(DestroyCommandPool) \
+  DEVICE(DestroyDescriptorPool) \
+  DEVICE(DestroyDevice) \
+  DEVICE(DestroyImage) \
+  INSTANCE(DestroyInstance) \
+  DEVICE(DestroyPipeline) \
+  DEVICE(EnumerateDeviceExtensionProperties) \
+  DEVICE(EnumerateDeviceLayerProperties) \
+  INSTANCE(EnumerateInstanceExtensionProperties) \
+  INSTANCE(EnumerateInstanceLayerProperties) \
+  DEVICE(FlushMappedMemoryRanges) \
+  DEVICE(FreeMemory) \
+  DEVICE(GetBufferMemoryRequirements) \
+  DEVICE(GetDeviceProcAddr) \
+  DEVICE(GetImageMemoryRequirements) \
+  INSTANCE(GetInstanceProcAddr) \
+  DEVICE(GetMemoryTrackStatsNXT) \
+  DEVICE(InvalidateMappedMemoryRanges) \
+  DEVICE(MapMemory) \
+  DEVICE(QueuePresentKHR) \
+  DEVICE(UnmapMemory)
 
-VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL MemoryTrack_GetDeviceProcAddr(VkDevice device, const char *pName)
+#define INTERCEPTED_NAME(func) "vk" #func,
+
+constexpr const char *intercepted_names[] = { INTERCEPTED_FUNCTIONS(INTERCEPTED_NAME, INTERCEPTED_NAME) };
+
+// compares like strcmp, but usable in constant expressions
+constexpr int CompareNames(const char *a, const char *b)
 {
-  // device chain functions we intercept
-  GETPROCADDR(GetDeviceProcAddr);
-  GETPROCADDR(EnumerateDeviceLayerProperties);
-  GETPROCADDR(EnumerateDeviceExtensionProperties);
-  GETPROCADDR(CreateDevice);
-  GETPROCADDR(DestroyDevice);
-  GETPROCADDR(AllocateMemory);
-  GETPROCADDR(FreeMemory);
+  return *a != *b ? (unsigned char)*a - (unsigned char)*b
+                  : *a == 0 ? 0 : CompareNames(a + 1, b + 1);
+}
+
+constexpr bool NamesSorted(const char *const *names, size_t count)
+{
+  return count < 2 || (CompareNames(names[0], names[1]) < 0 && NamesSorted(names + 1, count - 1));
+}
+
+static_assert(NamesSorted(intercepted_names, sizeof(intercepted_names) / sizeof(intercepted_names[0])),
+              "INTERCEPTED_FUNCTIONS must be sorted by name");
+
+struct InterceptedFunction
+{
+  const char *name;
+  PFN_vkVoidFunction function;
+  bool device;
+};
 
+VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL MemoryTrack_GetDeviceProcAddr(VkDevice device, const char *pName);
+VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL MemoryTrack_GetInstanceProcAddr(VkInstance instance, const char *pName);
+
+#define INTERCEPTED_INSTANCE(func) { "vk" #func, (PFN_vkVoidFunction)&MemoryTrack_##func, false },
+#define INTERCEPTED_DEVICE(func) { "vk" #func, (PFN_vkVoidFunction)&MemoryTrack_##func, true },
+
+const InterceptedFunction intercepted_functions[] = { INTERCEPTED_FUNCTIONS(INTERCEPTED_INSTANCE, INTERCEPTED_DEVICE) };
+
+const InterceptedFunction *FindInterceptedFunction(const char *pName)
+{
+  size_t lo = 0, hi = sizeof(intercepted_functions) / sizeof(intercepted_functions[0]);
+  while (lo < hi)
   {
-    scoped_lock l(global_lock);
-    return device_dispatch[GetKey(device)].GetDeviceProcAddr(device, pName);
+    size_t mid = (lo + hi) / 2;
+    int cmp = strcmp(pName, intercepted_functions[mid].name);
+    if (cmp == 0)
+      return &intercepted_functions[mid];
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
   }
+  return NULL;
+}
+
+VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL MemoryTrack_GetDeviceProcAddr(VkDevice device, const char *pName)
+{
+  // a device the layer never saw has nothing to forward to
+  DeviceData *deviceData = device != VK_NULL_HANDLE ? GetDeviceData(device) : NULL;
+  if (deviceData == NULL)
+    return NULL;
+
+  // extension functions only exist if the device was created with the extension
+  const InterceptedFunction *intercepted = FindInterceptedFunction(pName);
+  if (intercepted && intercepted->function == (PFN_vkVoidFunction)&MemoryTrack_QueuePresentKHR &&
+      deviceData->dispatch.QueuePresentKHR == NULL)
+    return NULL;
+  if (intercepted && intercepted->function == (PFN_vkVoidFunction)&MemoryTrack_GetMemoryTrackStatsNXT &&
+      !deviceData->statsExtension)
+    return NULL;
+
+  if (intercepted && intercepted->device)
+    return intercepted->function;
+
+  return deviceData->dispatch.GetDeviceProcAddr(device, pName);
 }
 
 VK_LAYER_EXPORT PFN_vkVoidFunction VKAPI_CALL MemoryTrack_GetInstanceProcAddr(VkInstance instance, const char *pName)
 {
-  // instance chain functions we intercept
-  GETPROCADDR(GetInstanceProcAddr);
-  GETPROCADDR(EnumerateInstanceLayerProperties);
-  GETPROCADDR(EnumerateInstanceExtensionProperties);
-  GETPROCADDR(CreateInstance);
-  GETPROCADDR(DestroyInstance);
+  const InterceptedFunction *intercepted = FindInterceptedFunction(pName);
+  if (intercepted)
+    return intercepted->function;
 
-  // device chain functions we intercept
-  GETPROCADDR(GetDeviceProcAddr);
-  GETPROCADDR(EnumerateDeviceLayerProperties);
-  GETPROCADDR(EnumerateDeviceExtensionProperties);
-  GETPROCADDR(CreateDevice);
-  GETPROCADDR(DestroyDevice);
-  GETPROCADDR(AllocateMemory);
-  GETPROCADDR(FreeMemory);
+  InstanceData *instanceData = instance != VK_NULL_HANDLE ? GetInstanceData(instance) : NULL;
+  if (instanceData == NULL)
+    return NULL;
 
-  {
-    scoped_lock l(global_lock);
-    return instance_dispatch[GetKey(instance)].GetInstanceProcAddr(instance, pName);
-  }
+  return instanceData->dispatch.GetInstanceProcAddr(instance, pName);
 }
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "vulkan.h"
+
+// a device extension of the layer itself, for querying its statistics while
+// the application runs. enable it like any device extension, by adding
+// VK_NXT_MEMORY_TRACK_STATS_EXTENSION_NAME to
+// VkDeviceCreateInfo::ppEnabledExtensionNames, after checking that
+// vkEnumerateDeviceExtensionProperties lists it for the layer
+// "VK_LAYER_NXT_MemoryTrack". the layer removes it before passing the create
+// info on, so the driver never sees it. then get the function with
+// vkGetDeviceProcAddr(device, "vkGetMemoryTrackStatsNXT"). the layer's
+// manifest declares the extension and its entry point too, as the loader
+// expects of device extensions a layer implements.
+//
+// the query never takes a lock. each heap's figures are a snapshot: they are
+// read again if another thread was counting an allocation, free or bind on
+// the heap meanwhile, so they always agree with each other. different heaps
+// can be a few allocations apart.
+
+#define VK_NXT_MEMORY_TRACK_STATS_SPEC_VERSION 1
+#define VK_NXT_MEMORY_TRACK_STATS_EXTENSION_NAME "VK_NXT_memory_track_stats"
+
+typedef struct VkMemoryTrackHeapStatsNXT
+{
+  VkDeviceSize size;              // as reported by the driver
+  VkMemoryHeapFlags flags;
+  VkDeviceSize budget;            // from MEMORY_TRACK_HEAP_BUDGET, 0 if none
+  VkDeviceSize currentUsage;      // bytes allocated
+  VkDeviceSize maximumUsage;
+  VkDeviceSize currentBound;      // bytes of currentUsage bound to buffers and images
+  VkDeviceSize maximumBound;
+  uint64_t allocationCount;       // live allocations
+  uint64_t totalAllocations;      // allocations ever made
+} VkMemoryTrackHeapStatsNXT;
+
+typedef struct VkMemoryTrackStatsNXT
+{
+  uint32_t memoryHeapCount;
+  VkMemoryTrackHeapStatsNXT memoryHeaps[VK_MAX_MEMORY_HEAPS];
+} VkMemoryTrackStatsNXT;
+
+typedef void (VKAPI_PTR *PFN_vkGetMemoryTrackStatsNXT)(VkDevice device, VkMemoryTrackStatsNXT *pStats);
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// layout of the shared memory segment the layer publishes its statistics in
+// when MEMORY_TRACK_SHM_NAME is set. open it read-only with shm_open() under
+// that name and map sizeof(MemoryTrackShmSegment) bytes. a segment already
+// there under the name is unlinked and replaced by a new one if the process
+// that published it has exited, readers that still have the old one mapped
+// have to open the name again. if that process is still running, the layer
+// leaves its segment alone and publishes nothing. only the first
+// MEMORY_TRACK_SHM_MAX_DEVICES devices alive at once are published.
+//
+// the layer rewrites each device's block every few milliseconds from a
+// background thread, guarded by a sequence counter (a seqlock): the counter is
+// odd while the block is being written and is bumped to the next even value
+// when done. readers never block the layer, they copy the block and retry if
+// the counter changed or was odd; MemoryTrackShmReadDevice does exactly that.
+
+#define MEMORY_TRACK_SHM_MAGIC 0x4d54534dU
+#define MEMORY_TRACK_SHM_VERSION 1
+#define MEMORY_TRACK_SHM_MAX_DEVICES 8
+#define MEMORY_TRACK_SHM_MAX_TYPES 32
+#define MEMORY_TRACK_SHM_MAX_HEAPS 16
+
+struct MemoryTrackShmType
+{
+  uint32_t heapIndex;
+  uint32_t propertyFlags;     // VkMemoryPropertyFlags
+  uint64_t currentUsage;      // bytes
+  uint64_t maximumUsage;      // bytes
+  uint64_t allocationCount;   // live allocations
+  uint64_t totalAllocations;  // allocations ever made
+};
+
+struct MemoryTrackShmHeap
+{
+  uint64_t size;              // bytes, as reported by the driver
+  uint32_t flags;             // VkMemoryHeapFlags
+  uint32_t padding;
+  uint64_t currentUsage;      // bytes
+  uint64_t maximumUsage;      // bytes
+  uint64_t currentBound;      // bytes bound to buffers and images
+  uint64_t maximumBound;      // bytes
+  uint64_t allocationCount;   // live allocations
+  uint64_t totalAllocations;  // allocations ever made
+};
+
+struct MemoryTrackShmDevice
+{
+  uint32_t sequence;          // seqlock counter, odd while the block is written
+  uint32_t active;            // 0 once the device was destroyed, or if never used
+  uint64_t timestamp;         // steady clock in nanoseconds at the last update
+  uint32_t memoryTypeCount;
+  uint32_t memoryHeapCount;
+  MemoryTrackShmType types[MEMORY_TRACK_SHM_MAX_TYPES];
+  MemoryTrackShmHeap heaps[MEMORY_TRACK_SHM_MAX_HEAPS];
+};
+
+struct MemoryTrackShmSegment
+{
+  uint32_t magic;             // MEMORY_TRACK_SHM_MAGIC
+  uint32_t version;           // MEMORY_TRACK_SHM_VERSION
+  uint32_t pid;               // the process the layer runs in
+  uint32_t deviceCount;       // MEMORY_TRACK_SHM_MAX_DEVICES, indexed by device creation slot
+  MemoryTrackShmDevice devices[MEMORY_TRACK_SHM_MAX_DEVICES];
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+
+// copies a consistent snapshot of a device block into *out, retrying while
+// the layer is updating it. returns false if no consistent copy could be
+// taken within the given number of attempts
+inline bool MemoryTrackShmReadDevice(const MemoryTrackShmDevice *device, MemoryTrackShmDevice *out,
+                                     int attempts = 1000)
+{
+  for (int i = 0; i < attempts; i++)
+  {
+    uint32_t before = __atomic_load_n(&device->sequence, __ATOMIC_ACQUIRE);
+    if (before & 1)
+      continue;
+
+    memcpy(out, (const void *)device, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&device->sequence, __ATOMIC_RELAXED) == before)
+    {
+      out->sequence = before;
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+// on-disk format of the event trace written when MEMORY_TRACK_TRACE_FILE is
+// set. the file is a TraceFileHeader followed by TraceEvent records, in
+// native byte order. events from one thread appear in the order they
+// happened, but events from different threads are only roughly ordered, so
+// sort by timestamp if a single timeline is needed.
+//
+// version 2 added TraceEventPresent.
+//
+// MEMORY_TRACK_CHROME_TRACE writes the same events as Chrome trace event JSON
+// instead, for chrome://tracing and ui.perfetto.dev: allocations and mappings
+// as async spans keyed by their VkDeviceMemory, binds as instant events on the
+// recording thread, presents as global instant events, and each heap's usage
+// as a counter. pid and tid are the operating system's, and ts is the same
+// clock as here in microseconds, so the events line up with CPU traces of the
+// process. the file is in the JSON array format, which both load even if the
+// process died before the closing bracket was written.
+
+#define MEMORY_TRACK_TRACE_MAGIC "MTTRACE"
+#define MEMORY_TRACK_TRACE_VERSION 2
+
+struct TraceFileHeader
+{
+  char magic[8];          // MEMORY_TRACK_TRACE_MAGIC, nul terminated
+  uint32_t version;       // MEMORY_TRACK_TRACE_VERSION
+  uint32_t eventSize;     // sizeof(TraceEvent)
+};
+
+enum TraceEventType
+{
+  TraceEventAllocate = 1,
+  TraceEventFree = 2,
+  TraceEventBindBuffer = 3,
+  TraceEventBindImage = 4,
+  TraceEventUnbindBuffer = 5,
+  TraceEventUnbindImage = 6,
+  TraceEventMap = 7,
+  TraceEventUnmap = 8,
+  TraceEventPresent = 9,
+};
+
+struct TraceEvent
+{
+  uint64_t timestamp;     // steady clock in nanoseconds, CLOCK_MONOTONIC on Linux
+  uint64_t memory;        // the VkDeviceMemory involved
+  uint64_t object;        // the VkBuffer or VkImage for (un)bind events, the frame
+                          // number for present events, 0 otherwise
+  uint64_t offset;        // (un)bind and map offset
+  uint64_t size;          // allocation, (un)bind or map size
+  uint64_t heapUsage;     // currentUsage of the memory's heap right after the event
+  uint32_t threadId;      // small per-thread number, in order of each thread's first event
+  uint8_t type;           // TraceEventType
+  uint8_t deviceIndex;
+  uint8_t memoryTypeIndex;
+  uint8_t heapIndex;
+};
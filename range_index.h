@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+// a [offset, offset + size) range of an allocation that something is bound to
+struct BoundRange
+{
+  uint64_t offset;
+  uint64_t size;
+};
+
+// the ranges bound within one allocation, ordered by offset. ranges may
+// overlap, since resources are allowed to alias.
+//
+// the ranges are kept in a list of sorted chunks of at most MaxChunkSize
+// entries, so this is effectively a two-level B+ tree: finding the chunk is
+// a binary search, and inserting or erasing only moves the entries of one
+// chunk. this keeps binding and unbinding cheap even when a single block is
+// carved into hundreds of thousands of ranges, while the common case of an
+// allocation with a handful of ranges stays a single small vector.
+class RangeIndex
+{
+public:
+  RangeIndex() : count(0) {}
+
+  size_t Size() const { return count; }
+  bool Empty() const { return count == 0; }
+
+  void Insert(uint64_t offset, uint64_t size)
+  {
+    BoundRange range = { offset, size };
+    count++;
+
+    // sub-allocators mostly bind in increasing order, so appending is the fast
+    // path. it starts a new chunk instead of splitting a full one, which keeps
+    // the chunks full
+    if (chunks.empty() || chunks.back().back().offset <= offset)
+    {
+      if (chunks.empty() || chunks.back().size() >= MaxChunkSize)
+        chunks.push_back(Chunk());
+
+      chunks.back().push_back(range);
+      return;
+    }
+
+    size_t c = FindChunk(offset);
+    Chunk &chunk = chunks[c];
+    chunk.insert(std::upper_bound(chunk.begin(), chunk.end(), range, OffsetLess), range);
+
+    if (chunk.size() > MaxChunkSize)
+    {
+      Chunk upper(chunk.begin() + chunk.size() / 2, chunk.end());
+      chunk.resize(chunk.size() / 2);
+      chunks.insert(chunks.begin() + c + 1, Chunk());
+      chunks[c + 1].swap(upper);
+    }
+  }
+
+  // erases one range with exactly this offset and size, returns false if there is none
+  bool Erase(uint64_t offset, uint64_t size)
+  {
+    BoundRange range = { offset, size };
+
+    // equal offsets may continue into the following chunks
+    for (size_t c = FindChunk(offset); c < chunks.size(); c++)
+    {
+      Chunk &chunk = chunks[c];
+      for (auto it = std::lower_bound(chunk.begin(), chunk.end(), range, OffsetLess);
+           it != chunk.end() && it->offset == offset; ++it)
+      {
+        if (it->size != size)
+          continue;
+
+        chunk.erase(it);
+        count--;
+        if (chunk.empty())
+          chunks.erase(chunks.begin() + c);
+        return true;
+      }
+
+      if (!chunk.empty() && chunk.back().offset > offset)
+        break;
+    }
+    return false;
+  }
+
+  // calls func(range) for every range, in order of offset
+  template<typename Func>
+  void ForEach(Func func) const
+  {
+    for (const Chunk &chunk : chunks)
+    {
+      for (const BoundRange &range : chunk)
+        func(range);
+    }
+  }
+
+private:
+  static const size_t MaxChunkSize = 256;
+
+  typedef std::vector<BoundRange> Chunk;
+
+  static bool OffsetLess(const BoundRange &a, const BoundRange &b)
+  {
+    return a.offset < b.offset;
+  }
+
+  // the first chunk that could hold offset, or chunks.size() if it's past all of them
+  size_t FindChunk(uint64_t offset) const
+  {
+    size_t lo = 0, hi = chunks.size();
+    while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (chunks[mid].back().offset < offset)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo;
+  }
+
+  std::vector<Chunk> chunks;
+  size_t count;
+};
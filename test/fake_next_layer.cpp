@@ -0,0 +1,553 @@
+#include "fake_next_layer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Fake state
+
+// dispatchable handles start with a pointer to their dispatch table, which is
+// what the layer keys its instance and device data on. each fake object simply
+// points at itself, which makes the key unique
+struct FakeDispatchable
+{
+  void *dispatch;
+};
+
+struct FakeInstance : FakeDispatchable
+{
+  FakeDispatchable physicalDevice;
+};
+
+struct FakeDevice : FakeDispatchable
+{
+  FakeDispatchable queue;
+  // the callbacks the device was created with, the fallback for its objects
+  VkAllocationCallbacks allocator;
+  bool hasAllocator;
+  // device scope host memory, held for the device's lifetime
+  void *deviceMemory;
+};
+
+VkPhysicalDeviceMemoryProperties fake_memory_properties = FakeDefaultMemoryProperties();
+std::atomic<VkResult> fake_allocate_result(VK_SUCCESS);
+
+// handles are spaced out like the pointers a real driver would return
+std::atomic<uint64_t> fake_next_handle(0x10000);
+std::atomic<uint64_t> fake_live_allocations(0);
+std::atomic<uint64_t> fake_allocate_calls(0);
+std::atomic<uint64_t> fake_free_calls(0);
+std::atomic<uint64_t> fake_present_calls(0);
+std::atomic<uint64_t> fake_flush_calls(0);
+std::atomic<uint64_t> fake_invalidate_calls(0);
+
+// what vkMapMemory points at, nothing is ever written to it
+char fake_mapping[4096];
+
+uint64_t NewHandle()
+{
+  return fake_next_handle.fetch_add(0x40, std::memory_order_relaxed);
+}
+
+// host memory is allocated the way a driver would: with the callbacks given,
+// else with the device's, else from the C heap
+const VkAllocationCallbacks *HostCallbacks(VkDevice device, const VkAllocationCallbacks *pAllocator)
+{
+  FakeDevice *fakeDevice = (FakeDevice *)device;
+  if (pAllocator == NULL && fakeDevice->hasAllocator)
+    pAllocator = &fakeDevice->allocator;
+  return pAllocator;
+}
+
+void *HostAlloc(const VkAllocationCallbacks *pAllocator, size_t size, VkSystemAllocationScope scope)
+{
+  return pAllocator ? pAllocator->pfnAllocation(pAllocator->pUserData, size, 16, scope) : malloc(size);
+}
+
+void *HostRealloc(const VkAllocationCallbacks *pAllocator, void *pOriginal, size_t size, VkSystemAllocationScope scope)
+{
+  return pAllocator ? pAllocator->pfnReallocation(pAllocator->pUserData, pOriginal, size, 16, scope)
+                    : realloc(pOriginal, size);
+}
+
+void HostFree(const VkAllocationCallbacks *pAllocator, void *pMemory)
+{
+  if (pAllocator)
+    pAllocator->pfnFree(pAllocator->pUserData, pMemory);
+  else
+    free(pMemory);
+}
+
+// what a pipeline's executable code takes, reported as an internal allocation
+const size_t FakePipelineCodeSize = 65536;
+
+VkPhysicalDeviceMemoryProperties FakeDefaultMemoryProperties()
+{
+  VkPhysicalDeviceMemoryProperties memoryProperties = {};
+
+  memoryProperties.memoryHeapCount = 3;
+  memoryProperties.memoryHeaps[0].size = 8ULL << 30;
+  memoryProperties.memoryHeaps[0].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+  memoryProperties.memoryHeaps[1].size = 16ULL << 30;
+  memoryProperties.memoryHeaps[2].size = 256ULL << 20;
+  memoryProperties.memoryHeaps[2].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+
+  memoryProperties.memoryTypeCount = 4;
+  memoryProperties.memoryTypes[0].heapIndex = 0;
+  memoryProperties.memoryTypes[0].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+  memoryProperties.memoryTypes[1].heapIndex = 1;
+  memoryProperties.memoryTypes[1].propertyFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  memoryProperties.memoryTypes[2].heapIndex = 1;
+  memoryProperties.memoryTypes[2].propertyFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+                                                  VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+  memoryProperties.memoryTypes[3].heapIndex = 2;
+  memoryProperties.memoryTypes[3].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                                                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+  return memoryProperties;
+}
+
+void FakeSetMemoryProperties(const VkPhysicalDeviceMemoryProperties &memoryProperties)
+{
+  fake_memory_properties = memoryProperties;
+}
+
+void FakeSetAllocateResult(VkResult result)
+{
+  fake_allocate_result.store(result);
+}
+
+uint64_t FakeLiveAllocations()
+{
+  return fake_live_allocations.load();
+}
+
+uint64_t FakeAllocateCalls()
+{
+  return fake_allocate_calls.load();
+}
+
+uint64_t FakeFreeCalls()
+{
+  return fake_free_calls.load();
+}
+
+uint64_t FakePresentCalls()
+{
+  return fake_present_calls.load();
+}
+
+uint64_t FakeFlushCalls()
+{
+  return fake_flush_calls.load();
+}
+
+uint64_t FakeInvalidateCalls()
+{
+  return fake_invalidate_calls.load();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Fake instance functions
+
+VkResult VKAPI_CALL Fake_CreateInstance(const VkInstanceCreateInfo *pCreateInfo,
+                                        const VkAllocationCallbacks *pAllocator, VkInstance *pInstance)
+{
+  FakeInstance *instance = new FakeInstance();
+  instance->dispatch = instance;
+  instance->physicalDevice.dispatch = instance;
+  *pInstance = (VkInstance)instance;
+  return VK_SUCCESS;
+}
+
+void VKAPI_CALL Fake_DestroyInstance(VkInstance instance, const VkAllocationCallbacks *pAllocator)
+{
+  delete (FakeInstance *)instance;
+}
+
+VkResult VKAPI_CALL Fake_EnumerateDeviceExtensionProperties(VkPhysicalDevice physicalDevice, const char *pLayerName,
+                                                            uint32_t *pPropertyCount, VkExtensionProperties *pProperties)
+{
+  *pPropertyCount = 0;
+  return VK_SUCCESS;
+}
+
+void VKAPI_CALL Fake_GetPhysicalDeviceMemoryProperties(VkPhysicalDevice physicalDevice,
+                                                       VkPhysicalDeviceMemoryProperties *pMemoryProperties)
+{
+  *pMemoryProperties = fake_memory_properties;
+}
+
+VkResult VKAPI_CALL Fake_CreateDevice(VkPhysicalDevice physicalDevice, const VkDeviceCreateInfo *pCreateInfo,
+                                      const VkAllocationCallbacks *pAllocator, VkDevice *pDevice)
+{
+  // the fake has no extensions to offer
+  if (pCreateInfo->enabledExtensionCount != 0)
+    return VK_ERROR_EXTENSION_NOT_PRESENT;
+
+  FakeDevice *device = new FakeDevice();
+  device->dispatch = device;
+  device->queue.dispatch = device;
+  device->hasAllocator = pAllocator != NULL;
+  if (pAllocator)
+    device->allocator = *pAllocator;
+  device->deviceMemory = HostAlloc(pAllocator, 4096, VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
+  *pDevice = (VkDevice)device;
+  return VK_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Fake device functions
+
+void VKAPI_CALL Fake_DestroyDevice(VkDevice device, const VkAllocationCallbacks *pAllocator)
+{
+  HostFree(pAllocator, ((FakeDevice *)device)->deviceMemory);
+  delete (FakeDevice *)device;
+}
+
+void VKAPI_CALL Fake_GetDeviceQueue(VkDevice device, uint32_t queueFamilyIndex, uint32_t queueIndex, VkQueue *pQueue)
+{
+  *pQueue = (VkQueue)&((FakeDevice *)device)->queue;
+}
+
+VkResult VKAPI_CALL Fake_QueuePresentKHR(VkQueue queue, const VkPresentInfoKHR *pPresentInfo)
+{
+  fake_present_calls.fetch_add(1, std::memory_order_relaxed);
+  return VK_SUCCESS;
+}
+
+VkResult VKAPI_CALL Fake_AllocateMemory(VkDevice device, const VkMemoryAllocateInfo *pAllocateInfo,
+                                        const VkAllocationCallbacks *pAllocator, VkDeviceMemory *pMemory)
+{
+  fake_allocate_calls.fetch_add(1, std::memory_order_relaxed);
+
+  VkResult result = fake_allocate_result.load(std::memory_order_relaxed);
+  if (result != VK_SUCCESS)
+  {
+    *pMemory = VK_NULL_HANDLE;
+    return result;
+  }
+
+  fake_live_allocations.fetch_add(1, std::memory_order_relaxed);
+  *pMemory = (VkDeviceMemory)NewHandle();
+  return VK_SUCCESS;
+}
+
+void VKAPI_CALL Fake_FreeMemory(VkDevice device, VkDeviceMemory memory, const VkAllocationCallbacks *pAllocator)
+{
+  fake_free_calls.fetch_add(1, std::memory_order_relaxed);
+  if (memory != VK_NULL_HANDLE)
+    fake_live_allocations.fetch_sub(1, std::memory_order_relaxed);
+}
+
+VkResult VKAPI_CALL Fake_MapMemory(VkDevice device, VkDeviceMemory memory, VkDeviceSize offset, VkDeviceSize size,
+                                   VkMemoryMapFlags flags, void **ppData)
+{
+  *ppData = fake_mapping;
+  return VK_SUCCESS;
+}
+
+void VKAPI_CALL Fake_UnmapMemory(VkDevice device, VkDeviceMemory memory)
+{
+}
+
+VkResult VKAPI_CALL Fake_FlushMappedMemoryRanges(VkDevice device, uint32_t memoryRangeCount,
+                                                 const VkMappedMemoryRange *pMemoryRanges)
+{
+  fake_flush_calls.fetch_add(1, std::memory_order_relaxed);
+  return VK_SUCCESS;
+}
+
+VkResult VKAPI_CALL Fake_InvalidateMappedMemoryRanges(VkDevice device, uint32_t memoryRangeCount,
+                                                      const VkMappedMemoryRange *pMemoryRanges)
+{
+  fake_invalidate_calls.fetch_add(1, std::memory_order_relaxed);
+  return VK_SUCCESS;
+}
+
+VkResult VKAPI_CALL Fake_CreateBuffer(VkDevice device, const VkBufferCreateInfo *pCreateInfo,
+                                      const VkAllocationCallbacks *pAllocator, VkBuffer *pBuffer)
+{
+  *pBuffer = (VkBuffer)NewHandle();
+  return VK_SUCCESS;
+}
+
+void VKAPI_CALL Fake_DestroyBuffer(VkDevice device, VkBuffer buffer, const VkAllocationCallbacks *pAllocator)
+{
+}
+
+VkResult VKAPI_CALL Fake_CreateImage(VkDevice device, const VkImageCreateInfo *pCreateInfo,
+                                     const VkAllocationCallbacks *pAllocator, VkImage *pImage)
+{
+  *pImage = (VkImage)NewHandle();
+  return VK_SUCCESS;
+}
+
+void VKAPI_CALL Fake_DestroyImage(VkDevice device, VkImage image, const VkAllocationCallbacks *pAllocator)
+{
+}
+
+// pools and pipelines are handles to their host memory
+VkResult VKAPI_CALL Fake_CreateCommandPool(VkDevice device, const VkCommandPoolCreateInfo *pCreateInfo,
+                                           const VkAllocationCallbacks *pAllocator, VkCommandPool *pCommandPool)
+{
+  void *memory = HostAlloc(HostCallbacks(device, pAllocator), 1024, VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+  if (memory == NULL)
+    return VK_ERROR_OUT_OF_HOST_MEMORY;
+
+  *pCommandPool = (VkCommandPool)(uintptr_t)memory;
+  return VK_SUCCESS;
+}
+
+void VKAPI_CALL Fake_DestroyCommandPool(VkDevice device, VkCommandPool commandPool,
+                                        const VkAllocationCallbacks *pAllocator)
+{
+  if (commandPool != VK_NULL_HANDLE)
+    HostFree(HostCallbacks(device, pAllocator), (void *)(uintptr_t)commandPool);
+}
+
+// a descriptor pool grows its table once, to go through reallocation
+VkResult VKAPI_CALL Fake_CreateDescriptorPool(VkDevice device, const VkDescriptorPoolCreateInfo *pCreateInfo,
+                                              const VkAllocationCallbacks *pAllocator, VkDescriptorPool *pDescriptorPool)
+{
+  const VkAllocationCallbacks *callbacks = HostCallbacks(device, pAllocator);
+  void *memory = HostAlloc(callbacks, 256, VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+  if (memory == NULL)
+    return VK_ERROR_OUT_OF_HOST_MEMORY;
+
+  memset(memory, 0x5a, 256);
+  void *grown = HostRealloc(callbacks, memory, 2048, VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+  if (grown == NULL)
+  {
+    HostFree(callbacks, memory);
+    return VK_ERROR_OUT_OF_HOST_MEMORY;
+  }
+
+  *pDescriptorPool = (VkDescriptorPool)(uintptr_t)grown;
+  return VK_SUCCESS;
+}
+
+void VKAPI_CALL Fake_DestroyDescriptorPool(VkDevice device, VkDescriptorPool descriptorPool,
+                                           const VkAllocationCallbacks *pAllocator)
+{
+  if (descriptorPool != VK_NULL_HANDLE)
+    HostFree(HostCallbacks(device, pAllocator), (void *)(uintptr_t)descriptorPool);
+}
+
+VkResult CreatePipelines(VkDevice device, uint32_t createInfoCount, const VkAllocationCallbacks *pAllocator,
+                         VkPipeline *pPipelines)
+{
+  const VkAllocationCallbacks *callbacks = HostCallbacks(device, pAllocator);
+  for (uint32_t i = 0; i < createInfoCount; i++)
+  {
+    void *memory = HostAlloc(callbacks, 512, VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+    if (callbacks && callbacks->pfnInternalAllocation)
+      callbacks->pfnInternalAllocation(callbacks->pUserData, FakePipelineCodeSize,
+                                       VK_INTERNAL_ALLOCATION_TYPE_EXECUTABLE, VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+    pPipelines[i] = (VkPipeline)(uintptr_t)memory;
+  }
+  return VK_SUCCESS;
+}
+
+VkResult VKAPI_CALL Fake_CreateGraphicsPipelines(VkDevice device, VkPipelineCache pipelineCache, uint32_t createInfoCount,
+                                                 const VkGraphicsPipelineCreateInfo *pCreateInfos,
+                                                 const VkAllocationCallbacks *pAllocator, VkPipeline *pPipelines)
+{
+  return CreatePipelines(device, createInfoCount, pAllocator, pPipelines);
+}
+
+VkResult VKAPI_CALL Fake_CreateComputePipelines(VkDevice device, VkPipelineCache pipelineCache, uint32_t createInfoCount,
+                                                const VkComputePipelineCreateInfo *pCreateInfos,
+                                                const VkAllocationCallbacks *pAllocator, VkPipeline *pPipelines)
+{
+  return CreatePipelines(device, createInfoCount, pAllocator, pPipelines);
+}
+
+void VKAPI_CALL Fake_DestroyPipeline(VkDevice device, VkPipeline pipeline, const VkAllocationCallbacks *pAllocator)
+{
+  if (pipeline == VK_NULL_HANDLE)
+    return;
+
+  const VkAllocationCallbacks *callbacks = HostCallbacks(device, pAllocator);
+  if (callbacks && callbacks->pfnInternalFree)
+    callbacks->pfnInternalFree(callbacks->pUserData, FakePipelineCodeSize,
+                               VK_INTERNAL_ALLOCATION_TYPE_EXECUTABLE, VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+  HostFree(callbacks, (void *)(uintptr_t)pipeline);
+}
+
+void VKAPI_CALL Fake_GetBufferMemoryRequirements(VkDevice device, VkBuffer buffer,
+                                                 VkMemoryRequirements *pMemoryRequirements)
+{
+  pMemoryRequirements->size = 4096;
+  pMemoryRequirements->alignment = 256;
+  pMemoryRequirements->memoryTypeBits = (1U << fake_memory_properties.memoryTypeCount) - 1;
+}
+
+void VKAPI_CALL Fake_GetImageMemoryRequirements(VkDevice device, VkImage image,
+                                                VkMemoryRequirements *pMemoryRequirements)
+{
+  pMemoryRequirements->size = 65536;
+  pMemoryRequirements->alignment = 65536;
+  pMemoryRequirements->memoryTypeBits = (1U << fake_memory_properties.memoryTypeCount) - 1;
+}
+
+VkResult VKAPI_CALL Fake_BindBufferMemory(VkDevice device, VkBuffer buffer, VkDeviceMemory memory,
+                                          VkDeviceSize memoryOffset)
+{
+  return VK_SUCCESS;
+}
+
+VkResult VKAPI_CALL Fake_BindImageMemory(VkDevice device, VkImage image, VkDeviceMemory memory,
+                                         VkDeviceSize memoryOffset)
+{
+  return VK_SUCCESS;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// GetProcAddr functions
+
+#define GETPROCADDR(func) if(!strcmp(pName, "vk" #func)) return (PFN_vkVoidFunction)&Fake_##func;
+
+PFN_vkVoidFunction VKAPI_CALL FakeGetDeviceProcAddr(VkDevice device, const char *pName)
+{
+  if(!strcmp(pName, "vkGetDeviceProcAddr")) return (PFN_vkVoidFunction)&FakeGetDeviceProcAddr;
+
+  GETPROCADDR(DestroyDevice);
+  GETPROCADDR(GetDeviceQueue);
+  GETPROCADDR(QueuePresentKHR);
+  GETPROCADDR(AllocateMemory);
+  GETPROCADDR(FreeMemory);
+  GETPROCADDR(MapMemory);
+  GETPROCADDR(UnmapMemory);
+  GETPROCADDR(FlushMappedMemoryRanges);
+  GETPROCADDR(InvalidateMappedMemoryRanges);
+  GETPROCADDR(CreateBuffer);
+  GETPROCADDR(DestroyBuffer);
+  GETPROCADDR(CreateImage);
+  GETPROCADDR(DestroyImage);
+  GETPROCADDR(CreateCommandPool);
+  GETPROCADDR(DestroyCommandPool);
+  GETPROCADDR(CreateDescriptorPool);
+  GETPROCADDR(DestroyDescriptorPool);
+  GETPROCADDR(CreateGraphicsPipelines);
+  GETPROCADDR(CreateComputePipelines);
+  GETPROCADDR(DestroyPipeline);
+  GETPROCADDR(GetBufferMemoryRequirements);
+  GETPROCADDR(GetImageMemoryRequirements);
+  GETPROCADDR(BindBufferMemory);
+  GETPROCADDR(BindImageMemory);
+
+  return NULL;
+}
+
+PFN_vkVoidFunction VKAPI_CALL FakeGetInstanceProcAddr(VkInstance instance, const char *pName)
+{
+  if(!strcmp(pName, "vkGetInstanceProcAddr")) return (PFN_vkVoidFunction)&FakeGetInstanceProcAddr;
+
+  GETPROCADDR(CreateInstance);
+  GETPROCADDR(DestroyInstance);
+  GETPROCADDR(EnumerateDeviceExtensionProperties);
+  GETPROCADDR(GetPhysicalDeviceMemoryProperties);
+  GETPROCADDR(CreateDevice);
+
+  return FakeGetDeviceProcAddr(VK_NULL_HANDLE, pName);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Creation through the layer
+
+VkResult FakeCreateInstance(VkInstance *pInstance)
+{
+  VkLayerInstanceLink link = {};
+  link.pfnNextGetInstanceProcAddr = &FakeGetInstanceProcAddr;
+
+  VkLayerInstanceCreateInfo layerCreateInfo = {};
+  layerCreateInfo.sType = VK_STRUCTURE_TYPE_LOADER_INSTANCE_CREATE_INFO;
+  layerCreateInfo.function = VK_LAYER_LINK_INFO;
+  layerCreateInfo.u.pLayerInfo = &link;
+
+  VkInstanceCreateInfo createInfo = {};
+  createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+  createInfo.pNext = &layerCreateInfo;
+
+  PFN_vkCreateInstance createFunc =
+    (PFN_vkCreateInstance)MemoryTrack_GetInstanceProcAddr(VK_NULL_HANDLE, "vkCreateInstance");
+  return createFunc(&createInfo, NULL, pInstance);
+}
+
+void FakeDestroyInstance(VkInstance instance)
+{
+  PFN_vkDestroyInstance destroyFunc =
+    (PFN_vkDestroyInstance)MemoryTrack_GetInstanceProcAddr(instance, "vkDestroyInstance");
+  destroyFunc(instance, NULL);
+}
+
+VkPhysicalDevice FakeGetPhysicalDevice(VkInstance instance)
+{
+  return (VkPhysicalDevice)&((FakeInstance *)instance)->physicalDevice;
+}
+
+VkResult FakeCreateDevice(VkInstance instance, VkDevice *pDevice, const char *extension,
+                          const VkAllocationCallbacks *pAllocator)
+{
+  VkLayerDeviceLink link = {};
+  link.pfnNextGetInstanceProcAddr = &FakeGetInstanceProcAddr;
+  link.pfnNextGetDeviceProcAddr = &FakeGetDeviceProcAddr;
+
+  VkLayerDeviceCreateInfo layerCreateInfo = {};
+  layerCreateInfo.sType = VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO;
+  layerCreateInfo.function = VK_LAYER_LINK_INFO;
+  layerCreateInfo.u.pLayerInfo = &link;
+
+  VkDeviceCreateInfo createInfo = {};
+  createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  createInfo.pNext = &layerCreateInfo;
+  createInfo.enabledExtensionCount = extension ? 1 : 0;
+  createInfo.ppEnabledExtensionNames = &extension;
+
+  PFN_vkCreateDevice createFunc =
+    (PFN_vkCreateDevice)MemoryTrack_GetInstanceProcAddr(instance, "vkCreateDevice");
+  return createFunc(FakeGetPhysicalDevice(instance), &createInfo, pAllocator, pDevice);
+}
+
+void FakeDestroyDevice(VkDevice device, const VkAllocationCallbacks *pAllocator)
+{
+  PFN_vkDestroyDevice destroyFunc =
+    (PFN_vkDestroyDevice)MemoryTrack_GetDeviceProcAddr(device, "vkDestroyDevice");
+  destroyFunc(device, pAllocator);
+}
+
+void FakeGetDispatchTable(VkDevice device, PFN_vkGetDeviceProcAddr gdpa, VkLayerDispatchTable *pTable)
+{
+  *pTable = VkLayerDispatchTable();
+  pTable->GetDeviceProcAddr = (PFN_vkGetDeviceProcAddr)gdpa(device, "vkGetDeviceProcAddr");
+  pTable->DestroyDevice = (PFN_vkDestroyDevice)gdpa(device, "vkDestroyDevice");
+  pTable->AllocateMemory = (PFN_vkAllocateMemory)gdpa(device, "vkAllocateMemory");
+  pTable->FreeMemory = (PFN_vkFreeMemory)gdpa(device, "vkFreeMemory");
+  pTable->MapMemory = (PFN_vkMapMemory)gdpa(device, "vkMapMemory");
+  pTable->UnmapMemory = (PFN_vkUnmapMemory)gdpa(device, "vkUnmapMemory");
+  pTable->FlushMappedMemoryRanges = (PFN_vkFlushMappedMemoryRanges)gdpa(device, "vkFlushMappedMemoryRanges");
+  pTable->InvalidateMappedMemoryRanges = (PFN_vkInvalidateMappedMemoryRanges)gdpa(device, "vkInvalidateMappedMemoryRanges");
+  pTable->CreateBuffer = (PFN_vkCreateBuffer)gdpa(device, "vkCreateBuffer");
+  pTable->DestroyBuffer = (PFN_vkDestroyBuffer)gdpa(device, "vkDestroyBuffer");
+  pTable->CreateImage = (PFN_vkCreateImage)gdpa(device, "vkCreateImage");
+  pTable->DestroyImage = (PFN_vkDestroyImage)gdpa(device, "vkDestroyImage");
+  pTable->CreateCommandPool = (PFN_vkCreateCommandPool)gdpa(device, "vkCreateCommandPool");
+  pTable->DestroyCommandPool = (PFN_vkDestroyCommandPool)gdpa(device, "vkDestroyCommandPool");
+  pTable->CreateDescriptorPool = (PFN_vkCreateDescriptorPool)gdpa(device, "vkCreateDescriptorPool");
+  pTable->DestroyDescriptorPool = (PFN_vkDestroyDescriptorPool)gdpa(device, "vkDestroyDescriptorPool");
+  pTable->CreateGraphicsPipelines = (PFN_vkCreateGraphicsPipelines)gdpa(device, "vkCreateGraphicsPipelines");
+  pTable->CreateComputePipelines = (PFN_vkCreateComputePipelines)gdpa(device, "vkCreateComputePipelines");
+  pTable->DestroyPipeline = (PFN_vkDestroyPipeline)gdpa(device, "vkDestroyPipeline");
+  pTable->GetBufferMemoryRequirements = (PFN_vkGetBufferMemoryRequirements)gdpa(device, "vkGetBufferMemoryRequirements");
+  pTable->GetImageMemoryRequirements = (PFN_vkGetImageMemoryRequirements)gdpa(device, "vkGetImageMemoryRequirements");
+  pTable->BindBufferMemory = (PFN_vkBindBufferMemory)gdpa(device, "vkBindBufferMemory");
+  pTable->BindImageMemory = (PFN_vkBindImageMemory)gdpa(device, "vkBindImageMemory");
+  pTable->GetDeviceQueue = (PFN_vkGetDeviceQueue)gdpa(device, "vkGetDeviceQueue");
+  pTable->QueuePresentKHR = (PFN_vkQueuePresentKHR)gdpa(device, "vkQueuePresentKHR");
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "vulkan.h"
+#include "vk_layer.h"
+
+// an in-process stand-in for everything below the layer, so the layer can be
+// driven without a loader or a GPU. the layer is linked in directly and its
+// MemoryTrack_* entry points are called with a link chain that points at the
+// fake, which reports the memory types and heaps it was configured with and
+// hands out made-up handles. the fake doesn't check anything itself, it only
+// counts what reaches it.
+//
+// the fake is configured before creating devices and isn't thread safe to
+// reconfigure, but every device-level call may be made from any thread.
+
+extern "C"
+{
+PFN_vkVoidFunction VKAPI_CALL MemoryTrack_GetInstanceProcAddr(VkInstance instance, const char *pName);
+PFN_vkVoidFunction VKAPI_CALL MemoryTrack_GetDeviceProcAddr(VkDevice device, const char *pName);
+}
+
+// a discrete GPU layout: device local VRAM, host visible system memory and a
+// small host visible window into VRAM
+VkPhysicalDeviceMemoryProperties FakeDefaultMemoryProperties();
+
+// memory properties reported to devices created from now on
+void FakeSetMemoryProperties(const VkPhysicalDeviceMemoryProperties &memoryProperties);
+
+// result returned by vkAllocateMemory, VK_SUCCESS unless changed
+void FakeSetAllocateResult(VkResult result);
+
+// counters of what reached the fake
+uint64_t FakeLiveAllocations();
+uint64_t FakeAllocateCalls();
+uint64_t FakeFreeCalls();
+uint64_t FakePresentCalls();
+uint64_t FakeFlushCalls();
+uint64_t FakeInvalidateCalls();
+
+// the fake's own proc address functions, to call it directly without the layer
+PFN_vkVoidFunction VKAPI_CALL FakeGetInstanceProcAddr(VkInstance instance, const char *pName);
+PFN_vkVoidFunction VKAPI_CALL FakeGetDeviceProcAddr(VkDevice device, const char *pName);
+
+// create and destroy an instance and device through the layer, the way the
+// loader would, with the fake as the next layer. the fake itself fails to
+// create devices with any extension enabled. it allocates host memory for
+// devices, pools and pipelines through the allocation callbacks it is given,
+// falling back to the device's like a driver does
+VkResult FakeCreateInstance(VkInstance *pInstance);
+void FakeDestroyInstance(VkInstance instance);
+VkPhysicalDevice FakeGetPhysicalDevice(VkInstance instance);
+VkResult FakeCreateDevice(VkInstance instance, VkDevice *pDevice, const char *extension = NULL,
+                          const VkAllocationCallbacks *pAllocator = NULL);
+void FakeDestroyDevice(VkDevice device, const VkAllocationCallbacks *pAllocator = NULL);
+
+// fills in the device functions the layer intercepts, and vkGetDeviceQueue, from gdpa. pass
+// MemoryTrack_GetDeviceProcAddr to go through the layer, or
+// FakeGetDeviceProcAddr to call the fake directly
+void FakeGetDispatchTable(VkDevice device, PFN_vkGetDeviceProcAddr gdpa, VkLayerDispatchTable *pTable);
@@ -0,0 +1,504 @@
+#include "fake_next_layer.h"
+#include "handle_map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// measures what the layer adds to vkAllocateMemory and vkFreeMemory, by
+// running the same workload once through the layer and once straight into the
+// fake next layer. the fake does next to nothing, so the difference is the
+// layer's own cost.
+//
+// every combination of thread count, live allocation count and allocation
+// pattern is run, each thread keeping its share of the live allocations and
+// churning through them. every call is timed on its own for the latency
+// percentiles, and the whole run for the throughput. by default the full
+// sweep runs, which takes a while; pick a subset with
+//
+//   memory_track_bench [--threads 1,8] [--live 1000,100000] [--pattern random,burst] [--ops N]
+//
+// where --ops is the number of allocate + free pairs per run, over all threads.
+//
+//   memory_track_bench --map [--live 1000,100000,1000000] [--ops N]
+//
+// instead compares the table the layer keeps its allocations in with a
+// std::map, on their own.
+
+typedef std::chrono::steady_clock Clock;
+
+enum Pattern
+{
+  PatternLifo,    // allocate a batch on top of the live set, free it newest first
+  PatternFifo,    // free the oldest allocation and allocate a new one
+  PatternRandom,  // free a random allocation and allocate a new one
+  PatternBurst,   // allocate a large burst on top of the live set, free it oldest first
+  PatternCount,
+};
+
+const char *const pattern_names[PatternCount] = { "lifo", "fifo", "random", "burst" };
+
+const size_t LifoBatch = 64;
+const size_t BurstSize = 4096;
+
+struct BenchConfig
+{
+  std::vector<uint32_t> threads;
+  std::vector<size_t> live;
+  std::vector<Pattern> patterns;
+  size_t ops;
+  bool map;
+};
+
+struct BenchResult
+{
+  double allocateP50, allocateP99, allocateP999;
+  double freeP50, freeP99, freeP999;
+  double callsPerSecond;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Workload
+
+// one thread's share of a run. latencies are in nanoseconds
+struct Worker
+{
+  const VkLayerDispatchTable *vk;
+  VkDevice device;
+  Pattern pattern;
+  size_t liveCount;
+  size_t ops;
+  uint32_t seed;
+
+  std::vector<VkDeviceMemory> live;
+  std::vector<uint32_t> allocateTimes;
+  std::vector<uint32_t> freeTimes;
+  Clock::time_point end;
+
+  VkDeviceMemory Allocate()
+  {
+    VkMemoryAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, NULL, 65536, 0 };
+    VkDeviceMemory memory;
+
+    Clock::time_point start = Clock::now();
+    vk->AllocateMemory(device, &allocateInfo, NULL, &memory);
+    allocateTimes.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+    return memory;
+  }
+
+  void Free(VkDeviceMemory memory)
+  {
+    Clock::time_point start = Clock::now();
+    vk->FreeMemory(device, memory, NULL);
+    freeTimes.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+  }
+
+  void Setup()
+  {
+    VkMemoryAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, NULL, 65536, 0 };
+
+    live.resize(liveCount);
+    for (VkDeviceMemory &memory : live)
+      vk->AllocateMemory(device, &allocateInfo, NULL, &memory);
+
+    allocateTimes.reserve(ops);
+    freeTimes.reserve(ops);
+  }
+
+  void Run()
+  {
+    std::mt19937 random(seed);
+
+    switch (pattern)
+    {
+    case PatternLifo:
+    case PatternBurst:
+    {
+      size_t batch = pattern == PatternLifo ? LifoBatch : BurstSize;
+      std::vector<VkDeviceMemory> pending;
+      pending.reserve(batch);
+
+      for (size_t done = 0; done < ops;)
+      {
+        size_t count = std::min(batch, ops - done);
+        for (size_t i = 0; i < count; i++)
+          pending.push_back(Allocate());
+
+        if (pattern == PatternLifo)
+          std::reverse(pending.begin(), pending.end());
+        for (VkDeviceMemory memory : pending)
+          Free(memory);
+
+        pending.clear();
+        done += count;
+      }
+      break;
+    }
+    case PatternFifo:
+    case PatternRandom:
+    {
+      // live is used as a ring, so the slot after the last one replaced holds
+      // the oldest allocation
+      size_t oldest = 0;
+      for (size_t i = 0; i < ops; i++)
+      {
+        if (liveCount == 0)
+        {
+          Free(Allocate());
+          continue;
+        }
+
+        size_t index;
+        if (pattern == PatternFifo)
+        {
+          index = oldest;
+          oldest = (oldest + 1) % liveCount;
+        }
+        else
+        {
+          index = random() % liveCount;
+        }
+
+        Free(live[index]);
+        live[index] = Allocate();
+      }
+      break;
+    }
+    default:
+      break;
+    }
+
+    end = Clock::now();
+  }
+
+  void Teardown()
+  {
+    for (VkDeviceMemory memory : live)
+      vk->FreeMemory(device, memory, NULL);
+    live.clear();
+  }
+};
+
+double Percentile(std::vector<uint32_t> &times, double fraction)
+{
+  if (times.empty())
+    return 0.0;
+
+  size_t index = std::min(times.size() - 1, (size_t)(fraction * times.size()));
+  std::nth_element(times.begin(), times.begin() + index, times.end());
+  return times[index];
+}
+
+BenchResult RunBench(VkDevice device, const VkLayerDispatchTable &vk, Pattern pattern,
+                     uint32_t threadCount, size_t liveCount, size_t ops)
+{
+  std::vector<Worker> workers(threadCount);
+  for (uint32_t i = 0; i < threadCount; i++)
+  {
+    Worker &worker = workers[i];
+    worker.vk = &vk;
+    worker.device = device;
+    worker.pattern = pattern;
+    worker.liveCount = liveCount / threadCount + (i < liveCount % threadCount ? 1 : 0);
+    worker.ops = ops / threadCount + (i < ops % threadCount ? 1 : 0);
+    worker.seed = i + 1;
+  }
+
+  // every thread sets up its live allocations, then they all start together
+  std::mutex lock;
+  std::condition_variable ready;
+  uint32_t readyCount = 0;
+  bool go = false;
+
+  std::vector<std::thread> threads;
+  for (Worker &worker : workers)
+  {
+    threads.emplace_back([&]()
+    {
+      worker.Setup();
+      {
+        std::unique_lock<std::mutex> l(lock);
+        readyCount++;
+        ready.notify_all();
+        ready.wait(l, [&]() { return go; });
+      }
+      worker.Run();
+    });
+  }
+
+  Clock::time_point start;
+  {
+    std::unique_lock<std::mutex> l(lock);
+    ready.wait(l, [&]() { return readyCount == threadCount; });
+    go = true;
+    start = Clock::now();
+  }
+  ready.notify_all();
+
+  for (std::thread &thread : threads)
+    thread.join();
+
+  Clock::time_point end = start;
+  std::vector<uint32_t> allocateTimes, freeTimes;
+  for (Worker &worker : workers)
+  {
+    end = std::max(end, worker.end);
+    allocateTimes.insert(allocateTimes.end(), worker.allocateTimes.begin(), worker.allocateTimes.end());
+    freeTimes.insert(freeTimes.end(), worker.freeTimes.begin(), worker.freeTimes.end());
+    worker.Teardown();
+  }
+
+  BenchResult result;
+  result.allocateP50 = Percentile(allocateTimes, 0.5);
+  result.allocateP99 = Percentile(allocateTimes, 0.99);
+  result.allocateP999 = Percentile(allocateTimes, 0.999);
+  result.freeP50 = Percentile(freeTimes, 0.5);
+  result.freeP99 = Percentile(freeTimes, 0.99);
+  result.freeP999 = Percentile(freeTimes, 0.999);
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  result.callsPerSecond = seconds > 0.0 ? (allocateTimes.size() + freeTimes.size()) / seconds : 0.0;
+  return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Handle map
+//
+// a single thread erases a random live handle, inserts a fresh one and looks
+// up another, the way a shard of the layer sees a steady stream of frees,
+// allocations and binds. handles are spaced like the fake next layer's
+
+// as large as the layer's allocation records
+struct MapValue
+{
+  uint64_t size;
+  uint64_t info;
+};
+
+typedef std::map<uint64_t, MapValue> StdMap;
+
+MapValue &Insert(HandleMap<MapValue> &map, uint64_t key) { return map.Insert(key); }
+void Erase(HandleMap<MapValue> &map, uint64_t key) { map.Erase(key); }
+const MapValue *Find(HandleMap<MapValue> &map, uint64_t key) { return map.Find(key); }
+
+MapValue &Insert(StdMap &map, uint64_t key) { return map[key]; }
+void Erase(StdMap &map, uint64_t key) { map.erase(key); }
+const MapValue *Find(StdMap &map, uint64_t key)
+{
+  StdMap::iterator it = map.find(key);
+  return it != map.end() ? &it->second : NULL;
+}
+
+// nanoseconds per erase, insert and lookup
+template<typename Map>
+double RunMapBench(size_t liveCount, size_t ops)
+{
+  Map map;
+  std::vector<uint64_t> live(std::max<size_t>(liveCount, 1));
+  uint64_t nextHandle = 0x10000;
+  for (uint64_t &handle : live)
+  {
+    handle = nextHandle += 0x40;
+    Insert(map, handle).size = handle;
+  }
+
+  std::mt19937 random(1);
+  uint64_t found = 0;
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < ops; i++)
+  {
+    uint64_t &handle = live[random() % live.size()];
+    Erase(map, handle);
+    handle = nextHandle += 0x40;
+    Insert(map, handle).size = handle;
+
+    const MapValue *value = Find(map, live[random() % live.size()]);
+    found += value != NULL ? value->size : 0;
+  }
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  // keeps the lookups from being optimised away
+  if (found == 0)
+    printf("no handle found\n");
+  return seconds * 1e9 / ops;
+}
+
+void RunMapBenches(const BenchConfig &config)
+{
+  printf("nanoseconds per free, allocate and lookup, single thread\n");
+  printf("  %-9s %10s %10s\n", "live", "std::map", "HandleMap");
+  for (size_t liveCount : config.live)
+  {
+    double stdMap = RunMapBench<StdMap>(liveCount, config.ops);
+    double handleMap = RunMapBench<HandleMap<MapValue> >(liveCount, config.ops);
+    printf("  %-9zu %10.1f %10.1f\n", liveCount, stdMap, handleMap);
+    fflush(stdout);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Command line
+
+template<typename T, typename Parse>
+bool ParseList(const char *arg, std::vector<T> &out, Parse parse)
+{
+  out.clear();
+  std::string list = arg;
+  size_t pos = 0;
+  while (pos <= list.size())
+  {
+    size_t comma = list.find(',', pos);
+    if (comma == std::string::npos)
+      comma = list.size();
+
+    T value;
+    if (!parse(list.substr(pos, comma - pos), value))
+      return false;
+
+    out.push_back(value);
+    pos = comma + 1;
+  }
+  return !out.empty();
+}
+
+bool ParseNumber(const std::string &text, size_t &value)
+{
+  char *end;
+  value = strtoull(text.c_str(), &end, 10);
+  return !text.empty() && *end == 0;
+}
+
+bool ParseThreads(const std::string &text, uint32_t &value)
+{
+  size_t number;
+  if (!ParseNumber(text, number) || number == 0 || number > 1024)
+    return false;
+
+  value = (uint32_t)number;
+  return true;
+}
+
+bool ParsePattern(const std::string &text, Pattern &value)
+{
+  for (int i = 0; i < PatternCount; i++)
+  {
+    if (text == pattern_names[i])
+    {
+      value = (Pattern)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ParseArgs(int argc, char **argv, BenchConfig &config)
+{
+  config.threads = { 1, 2, 4, 8, 16, 32, 64 };
+  config.live = { 1000, 10000, 100000, 1000000 };
+  config.patterns = { PatternLifo, PatternFifo, PatternRandom, PatternBurst };
+  config.ops = 200000;
+  config.map = false;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *name = argv[i];
+    if (!strcmp(name, "--map"))
+    {
+      config.map = true;
+      continue;
+    }
+    if (i + 1 == argc)
+      return false;
+
+    const char *value = argv[++i];
+    bool ok;
+    if (!strcmp(name, "--threads"))
+      ok = ParseList(value, config.threads, ParseThreads);
+    else if (!strcmp(name, "--live"))
+      ok = ParseList(value, config.live, ParseNumber);
+    else if (!strcmp(name, "--pattern"))
+      ok = ParseList(value, config.patterns, ParsePattern);
+    else if (!strcmp(name, "--ops"))
+      ok = ParseNumber(value, config.ops) && config.ops > 0;
+    else
+      ok = false;
+
+    if (!ok)
+      return false;
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// main
+
+void PrintResult(const char *path, const BenchResult &result)
+{
+  printf("  %-6s %9.0f %9.0f %9.0f   %9.0f %9.0f %9.0f   %10.2f\n", path,
+         result.allocateP50, result.allocateP99, result.allocateP999,
+         result.freeP50, result.freeP99, result.freeP999, result.callsPerSecond / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+  BenchConfig config;
+  if (!ParseArgs(argc, argv, config))
+  {
+    fprintf(stderr, "usage: %s [--threads 1,8] [--live 1000,100000] [--pattern %s,%s,%s,%s] [--ops N]\n"
+                    "       %s --map [--live 1000,100000] [--ops N]\n",
+            argv[0], pattern_names[0], pattern_names[1], pattern_names[2], pattern_names[3], argv[0]);
+    return 1;
+  }
+
+  if (config.map)
+  {
+    RunMapBenches(config);
+    return 0;
+  }
+
+  VkInstance instance;
+  VkDevice device;
+  if (FakeCreateInstance(&instance) != VK_SUCCESS || FakeCreateDevice(instance, &device) != VK_SUCCESS)
+  {
+    fprintf(stderr, "can't create a device through the layer\n");
+    return 1;
+  }
+
+  VkLayerDispatchTable layer, direct;
+  FakeGetDispatchTable(device, &MemoryTrack_GetDeviceProcAddr, &layer);
+  FakeGetDispatchTable(device, &FakeGetDeviceProcAddr, &direct);
+
+  printf("latencies in ns, throughput in million calls per second over all threads\n");
+  for (Pattern pattern : config.patterns)
+  {
+    for (size_t liveCount : config.live)
+    {
+      for (uint32_t threadCount : config.threads)
+      {
+        printf("\n%s, %zu live, %u threads\n", pattern_names[pattern], liveCount, threadCount);
+        printf("  %-6s %9s %9s %9s   %9s %9s %9s   %10s\n", "",
+               "alloc p50", "p99", "p999", "free p50", "p99", "p999", "Mcalls/s");
+
+        BenchResult directResult = RunBench(device, direct, pattern, threadCount, liveCount, config.ops);
+        BenchResult layerResult = RunBench(device, layer, pattern, threadCount, liveCount, config.ops);
+        PrintResult("direct", directResult);
+        PrintResult("layer", layerResult);
+        fflush(stdout);
+      }
+    }
+  }
+
+  FakeDestroyDevice(device);
+  FakeDestroyInstance(instance);
+  return 0;
+}
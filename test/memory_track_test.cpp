@@ -0,0 +1,1601 @@
+#include "fake_next_layer.h"
+#include "handle_map.h"
+#include "histogram.h"
+#include "memory_track_ext.h"
+#include "memory_track_shm.h"
+#include "memory_track_trace.h"
+#include "range_index.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// functional tests of the layer on top of the fake next layer. run through
+// "make test", which also points MEMORY_TRACK_SHM_NAME at a segment so the
+// statistics the layer keeps can be checked from the outside. tests of
+// settings that change how every allocation behaves are skipped unless their
+// environment variable is set, and "make test" runs them on their own, by
+// passing their names on the command line.
+
+int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) \
+    { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+const VkDeviceSize MiB = 1024 * 1024;
+
+// operator new counts what the calling thread allocates, for checking that a
+// path allocates nothing. it is used by the layer as well
+thread_local uint64_t thread_allocations = 0;
+
+void *operator new(size_t size)
+{
+  thread_allocations++;
+  void *ptr = malloc(size ? size : 1);
+  if (ptr == NULL)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+// an instance and device created through the layer, with the layer's functions
+struct TestDevice
+{
+  explicit TestDevice(const char *extension = NULL)
+  {
+    CHECK(FakeCreateInstance(&instance) == VK_SUCCESS);
+    CHECK(FakeCreateDevice(instance, &device, extension) == VK_SUCCESS);
+    FakeGetDispatchTable(device, &MemoryTrack_GetDeviceProcAddr, &vk);
+  }
+
+  ~TestDevice()
+  {
+    Destroy();
+    FakeDestroyInstance(instance);
+  }
+
+  void Destroy()
+  {
+    if (device != VK_NULL_HANDLE)
+      FakeDestroyDevice(device);
+    device = VK_NULL_HANDLE;
+  }
+
+  VkDeviceMemory Allocate(VkDeviceSize size, uint32_t memoryTypeIndex, VkResult expected = VK_SUCCESS)
+  {
+    VkMemoryAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, NULL, size, memoryTypeIndex };
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    CHECK(vk.AllocateMemory(device, &allocateInfo, NULL, &memory) == expected);
+    return memory;
+  }
+
+  void Free(VkDeviceMemory memory)
+  {
+    vk.FreeMemory(device, memory, NULL);
+  }
+
+  VkInstance instance;
+  VkDevice device;
+  VkLayerDispatchTable vk;
+};
+
+// destroys the device and returns the report the layer printed for it
+std::string DestroyCapturingReport(TestDevice &t)
+{
+  char path[] = "/tmp/memory_track_report_XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  if (fd < 0)
+  {
+    t.Destroy();
+    return std::string();
+  }
+  unlink(path);
+
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  dup2(fd, STDOUT_FILENO);
+  t.Destroy();
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  std::string report;
+  char block[4096];
+  lseek(fd, 0, SEEK_SET);
+  for (ssize_t length; (length = read(fd, block, sizeof(block))) > 0;)
+    report.append(block, length);
+  close(fd);
+  return report;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// Tests
+
+// random inserts, erases and lookups checked against std::unordered_map. the
+// keys come from a small range at first, so that nearly every slot of the
+// small tables is taken, probe runs wrap around their end, and erasing has to
+// shift colliding entries back. then handle-like keys grow the table, which
+// is emptied and shrunk
+void TestHandleMap()
+{
+  HandleMap<uint64_t> map;
+  std::unordered_map<uint64_t, uint64_t> model;
+  std::mt19937 random(1);
+
+  auto checkAll = [&]()
+  {
+    CHECK(map.Size() == model.size());
+    size_t visited = 0;
+    map.ForEach([&](uint64_t key, uint64_t value) {
+      auto it = model.find(key);
+      CHECK(it != model.end() && it->second == value);
+      visited++;
+    });
+    CHECK(visited == model.size());
+  };
+
+  const uint64_t keyRanges[] = { 12, 24, 100, 1000, 100000 };
+  for (uint64_t keyRange : keyRanges)
+  {
+    for (int i = 0; i < 50000; i++)
+    {
+      uint64_t key = keyRange < 1000 ? random() % keyRange + 1 : 0x10000 + (random() % keyRange) * 0x40;
+      uint64_t value = random();
+      switch (random() % 8)
+      {
+      case 0:
+      case 1:
+      case 2:
+        map.Insert(key) = value;
+        model[key] = value;
+        break;
+      case 3:
+      case 4:
+      {
+        uint64_t erased = 0;
+        bool found = model.count(key) != 0;
+        CHECK(map.Erase(key, &erased) == found);
+        CHECK(!found || erased == model[key]);
+        model.erase(key);
+        break;
+      }
+      case 5:
+      case 6:
+      {
+        const uint64_t *found = map.Find(key);
+        auto it = model.find(key);
+        CHECK((found == NULL) == (it == model.end()));
+        CHECK(found == NULL || *found == it->second);
+        break;
+      }
+      default:
+        if (random() % 64 == 0)
+          map.Shrink();
+        break;
+      }
+
+      if (i % 5000 == 0)
+        checkAll();
+    }
+    checkAll();
+
+    // every entry can still be found after the table shrinks
+    map.Shrink();
+    CHECK(map.Capacity() <= 16 || map.Size() * 4 > map.Capacity() / 2 * 3);
+    checkAll();
+  }
+
+  for (auto &entry : model)
+    CHECK(map.Erase(entry.first));
+  model.clear();
+  CHECK(map.Find(0x10000) == NULL);
+  map.Shrink();
+  CHECK(map.Capacity() == 0);
+  checkAll();
+}
+
+// random binds and unbinds checked against a std::multimap from offset to
+// size. offsets repeat often, and many ranges share one offset, more than
+// fit in a chunk, as aliasing resources do
+void TestRangeIndex()
+{
+  RangeIndex index;
+  std::multimap<uint64_t, uint64_t> model;
+  std::mt19937 random(1);
+
+  auto checkAll = [&]()
+  {
+    CHECK(index.Size() == model.size());
+    CHECK(index.Empty() == model.empty());
+
+    std::vector<std::pair<uint64_t, uint64_t> > ranges, expected(model.begin(), model.end());
+    index.ForEach([&](const BoundRange &range) { ranges.push_back(std::make_pair(range.offset, range.size)); });
+    for (size_t i = 1; i < ranges.size(); i++)
+      CHECK(ranges[i - 1].first <= ranges[i].first);
+
+    // ranges at the same offset may come in any order
+    std::sort(ranges.begin(), ranges.end());
+    std::sort(expected.begin(), expected.end());
+    CHECK(ranges == expected);
+  };
+
+  uint64_t nextOffset = 0;
+  for (int i = 0; i < 200000; i++)
+  {
+    uint32_t op = random() % 16;
+    if (op < 9 || model.empty())
+    {
+      // mostly appends, as sub-allocators bind, then anywhere before, and
+      // sometimes at the offset that is already the busiest
+      uint64_t offset;
+      if (op < 4)
+        offset = nextOffset += 256 * (random() % 4);
+      else if (op < 8)
+        offset = nextOffset ? 256 * (random() % (nextOffset / 256 + 1)) : 0;
+      else
+        offset = 4096;
+      uint64_t size = 256 * (random() % 8 + 1);
+      index.Insert(offset, size);
+      model.insert(std::make_pair(offset, size));
+    }
+    else if (op < 15)
+    {
+      // erase one that is bound: among the lowest, or the first from a random offset on
+      auto it = model.begin();
+      std::advance(it, random() % std::min<size_t>(model.size(), 64));
+      if (random() % 2)
+      {
+        it = model.lower_bound(256 * (random() % (nextOffset / 256 + 1)));
+        if (it == model.end())
+          it = model.begin();
+      }
+      CHECK(index.Erase(it->first, it->second));
+      model.erase(it);
+    }
+    else
+    {
+      // nothing bound has this size
+      CHECK(!index.Erase(256 * (random() % (nextOffset / 256 + 1)), 100));
+    }
+
+    if (i % 10000 == 0)
+      checkAll();
+  }
+  checkAll();
+
+  while (!model.empty())
+  {
+    CHECK(index.Erase(model.begin()->first, model.begin()->second));
+    model.erase(model.begin());
+  }
+  checkAll();
+}
+
+void TestForwarding()
+{
+  TestDevice t;
+  uint64_t allocateCalls = FakeAllocateCalls(), freeCalls = FakeFreeCalls();
+
+  std::vector<VkDeviceMemory> memory;
+  for (int i = 0; i < 100; i++)
+    memory.push_back(t.Allocate(MiB, i % 4));
+
+  for (size_t i = 0; i < memory.size(); i++)
+  {
+    CHECK(memory[i] != VK_NULL_HANDLE);
+    CHECK(i == 0 || memory[i] != memory[i - 1]);
+  }
+  CHECK(FakeLiveAllocations() == 100);
+
+  for (VkDeviceMemory m : memory)
+    t.Free(m);
+
+  // freeing the null handle is allowed and still reaches the driver
+  t.Free(VK_NULL_HANDLE);
+
+  CHECK(FakeLiveAllocations() == 0);
+  CHECK(FakeAllocateCalls() - allocateCalls == 100);
+  CHECK(FakeFreeCalls() - freeCalls == 101);
+
+  // handles the layer never created have no next layer to ask
+  void *unknownTable = NULL;
+  void *unknownObject = &unknownTable;
+  CHECK(MemoryTrack_GetDeviceProcAddr((VkDevice)&unknownObject, "vkGetDeviceQueue") == NULL);
+  CHECK(MemoryTrack_GetDeviceProcAddr(t.device, "vkGetDeviceQueue") != NULL);
+  CHECK(MemoryTrack_GetDeviceProcAddr(VK_NULL_HANDLE, "vkGetDeviceQueue") == NULL);
+  CHECK(MemoryTrack_GetInstanceProcAddr((VkInstance)&unknownObject, "vkGetPhysicalDeviceMemoryProperties") == NULL);
+  CHECK(MemoryTrack_GetInstanceProcAddr(VK_NULL_HANDLE, "vkGetPhysicalDeviceMemoryProperties") == NULL);
+  CHECK(MemoryTrack_GetInstanceProcAddr(t.instance, "vkGetPhysicalDeviceMemoryProperties") != NULL);
+}
+
+void TestFailedAllocation()
+{
+  TestDevice t;
+
+  FakeSetAllocateResult(VK_ERROR_OUT_OF_DEVICE_MEMORY);
+  VkDeviceMemory memory = t.Allocate(MiB, 0, VK_ERROR_OUT_OF_DEVICE_MEMORY);
+  FakeSetAllocateResult(VK_SUCCESS);
+
+  CHECK(memory == VK_NULL_HANDLE);
+  CHECK(FakeLiveAllocations() == 0);
+}
+
+void TestThreads()
+{
+  TestDevice t;
+
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < 8; i++)
+  {
+    threads.emplace_back([&t, i]()
+    {
+      std::vector<VkDeviceMemory> memory;
+      for (int round = 0; round < 10; round++)
+      {
+        for (int j = 0; j < 1000; j++)
+          memory.push_back(t.Allocate(64 * 1024, i % 4));
+        for (int j = 0; j < 500; j++)
+        {
+          t.Free(memory.back());
+          memory.pop_back();
+        }
+      }
+      for (VkDeviceMemory m : memory)
+        t.Free(m);
+    });
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+
+  CHECK(FakeLiveAllocations() == 0);
+}
+
+void TestBinding()
+{
+  TestDevice t;
+  VkDeviceMemory memory = t.Allocate(64 * MiB, 0);
+
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.size = 4096;
+
+  std::vector<VkBuffer> buffers(256);
+  for (size_t i = 0; i < buffers.size(); i++)
+  {
+    VkMemoryRequirements memoryRequirements;
+    CHECK(t.vk.CreateBuffer(t.device, &bufferCreateInfo, NULL, &buffers[i]) == VK_SUCCESS);
+    t.vk.GetBufferMemoryRequirements(t.device, buffers[i], &memoryRequirements);
+    CHECK(t.vk.BindBufferMemory(t.device, buffers[i], memory, i * 2 * memoryRequirements.size) == VK_SUCCESS);
+  }
+
+  VkImageCreateInfo imageCreateInfo = {};
+  imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+
+  VkImage image;
+  VkMemoryRequirements memoryRequirements;
+  CHECK(t.vk.CreateImage(t.device, &imageCreateInfo, NULL, &image) == VK_SUCCESS);
+  t.vk.GetImageMemoryRequirements(t.device, image, &memoryRequirements);
+  CHECK(t.vk.BindImageMemory(t.device, image, memory, 32 * MiB) == VK_SUCCESS);
+
+  for (size_t i = 0; i < buffers.size(); i += 2)
+    t.vk.DestroyBuffer(t.device, buffers[i], NULL);
+
+  // memory is freed with resources still bound to it, and the handle of the
+  // next allocation may be the same, which must not confuse later unbinds
+  t.Free(memory);
+  VkDeviceMemory other = t.Allocate(MiB, 1);
+
+  void *data = NULL;
+  CHECK(t.vk.MapMemory(t.device, other, 0, VK_WHOLE_SIZE, 0, &data) == VK_SUCCESS);
+  CHECK(data != NULL);
+  t.vk.UnmapMemory(t.device, other);
+
+  for (size_t i = 1; i < buffers.size(); i += 2)
+    t.vk.DestroyBuffer(t.device, buffers[i], NULL);
+  t.vk.DestroyImage(t.device, image, NULL);
+
+  t.Free(other);
+  CHECK(FakeLiveAllocations() == 0);
+}
+
+void TestPresent()
+{
+  TestDevice t;
+  uint64_t presentCalls = FakePresentCalls();
+
+  VkQueue queue;
+  t.vk.GetDeviceQueue(t.device, 0, 0, &queue);
+  CHECK(t.vk.QueuePresentKHR != NULL);
+
+  // frame f allocates f + 1 MiB on heap 0 and frees what the previous frame
+  // allocated there, so every frame churns more than the one before. heap 1
+  // gets 64 KiB allocated and freed within each frame
+  std::vector<VkDeviceMemory> memory;
+  for (int frame = 0; frame < 20; frame++)
+  {
+    std::vector<VkDeviceMemory> previous;
+    previous.swap(memory);
+    for (int i = 0; i <= frame; i++)
+      memory.push_back(t.Allocate(MiB, 0));
+    for (VkDeviceMemory m : previous)
+      t.Free(m);
+    t.Free(t.Allocate(64 * 1024, 1));
+
+    VkPresentInfoKHR presentInfo = {};
+    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    CHECK(t.vk.QueuePresentKHR(queue, &presentInfo) == VK_SUCCESS);
+  }
+
+  // frees after the last present belong to no frame
+  for (VkDeviceMemory m : memory)
+    t.Free(m);
+
+  CHECK(FakePresentCalls() - presentCalls == 20);
+
+  std::string report = DestroyCapturingReport(t);
+  CHECK(report.find("Frames presented: 20\n") != std::string::npos);
+  char line[256];
+  snprintf(line, sizeof(line), "Average over the last 20 frames: %llu bytes allocated and %llu bytes freed per frame\n",
+           (unsigned long long)(210 * MiB + 20 * 65536) / 20, (unsigned long long)(190 * MiB + 20 * 65536) / 20);
+  CHECK(report.find(line) != std::string::npos);
+
+  // the ten busiest frames, busiest first, with what each heap saw
+  size_t pos = report.find("Frames with the most memory allocated and freed:\n");
+  CHECK(pos != std::string::npos);
+  for (int frame = 19; frame >= 10 && pos != std::string::npos; frame--)
+  {
+    snprintf(line, sizeof(line), " frame %d (", frame);
+    pos = report.find(line, pos);
+    CHECK(pos != std::string::npos && report.find(" frame ", pos + 1) > report.find("   heap 1:", pos));
+    if (pos == std::string::npos)
+      break;
+
+    size_t end = report.find("\n", report.find("   heap 1:", pos));
+    std::string lines = report.substr(pos, end - pos);
+    snprintf(line, sizeof(line), "   heap 0: %llu bytes allocated in %d allocations, %llu bytes freed in %d frees,"
+             " %llu bytes in use at the end\n", (unsigned long long)((frame + 1) * MiB), frame + 1,
+             (unsigned long long)(frame * MiB), frame, (unsigned long long)((frame + 1) * MiB));
+    CHECK(lines.find(line) != std::string::npos);
+    CHECK(lines.find("   heap 1: 65536 bytes allocated in 1 allocations, 65536 bytes freed in 1 frees,"
+                     " 0 bytes in use at the end") != std::string::npos);
+  }
+  CHECK(report.find(" frame 9 (") == std::string::npos);
+}
+
+void TestLifetimes()
+{
+  // powers of two of microseconds, and sizes from 4 KiB
+  CHECK(GetLifetimeBucket(0) == 0);
+  CHECK(GetLifetimeBucket(1) == 1);
+  CHECK(GetLifetimeBucket(2) == 2 && GetLifetimeBucket(3) == 2);
+  CHECK(GetLifetimeBucket(1000) == 10);
+  CHECK(GetLifetimeBucket(1ULL << 40) == LifetimeBucketCount - 1);
+  for (uint32_t i = 1; i < LifetimeBucketCount; i++)
+  {
+    CHECK(GetLifetimeBucket(GetLifetimeBucketStart(i)) == i);
+    CHECK(GetLifetimeBucket(GetLifetimeBucketStart(i) - 1) == i - 1);
+  }
+  CHECK(GetSizeClass(0) == 0 && GetSizeClass(8191) == 0);
+  CHECK(GetSizeClass(8192) == 1 && GetSizeClass(MiB) == 8);
+  CHECK(GetSizeClass(1ULL << 40) == SizeClassCount - 1);
+  for (uint32_t i = 1; i < SizeClassCount; i++)
+    CHECK(GetSizeClass(GetSizeClassStart(i)) == i && GetSizeClass(GetSizeClassStart(i) - 1) == i - 1);
+
+  // the median is the bucket holding the lower middle count
+  const uint64_t lifetimes[] = { 3, 3, 3, 3, 3, 100, 100, 100, 50000, 50000, 50000, 50000 };
+  uint64_t counts[LifetimeBucketCount] = {};
+  for (uint64_t lifetime : lifetimes)
+    counts[GetLifetimeBucket(lifetime)]++;
+  CHECK(counts[2] == 5 && counts[7] == 3 && counts[16] == 4);
+  CHECK(GetMedianBucket(counts, 12) == 7);
+  uint64_t even[LifetimeBucketCount] = { 0, 1, 0, 0, 0, 1 };
+  CHECK(GetMedianBucket(even, 2) == 1);
+
+  // the report lists the size classes whose median lifetime is under
+  // MEMORY_TRACK_CHURN_LIFETIME, 100 ms. 64 KiB allocations are mostly freed
+  // right away, 256 KiB ones mostly kept for longer, and too few 1 MiB ones
+  // are freed to make a pattern
+  TestDevice t;
+  std::vector<VkDeviceMemory> kept;
+  for (int i = 0; i < 20; i++)
+  {
+    t.Free(t.Allocate(64 * 1024, 0));
+    kept.push_back(t.Allocate(256 * 1024, 0));
+  }
+  for (int i = 0; i < 10; i++)
+  {
+    kept.push_back(t.Allocate(64 * 1024, 0));
+    t.Free(t.Allocate(256 * 1024, 0));
+  }
+  for (int i = 0; i < 5; i++)
+    t.Free(t.Allocate(MiB, 0));
+  std::this_thread::sleep_for(std::chrono::milliseconds(150));
+  for (VkDeviceMemory m : kept)
+    t.Free(m);
+
+  std::string report = DestroyCapturingReport(t);
+  CHECK(report.find("Allocations with a median lifetime under 100 ms, by memory type and size:\n") != std::string::npos);
+  const char *line = "   0: 65536 to 131071 bytes, 30 freed, median lifetime ";
+  size_t pos = report.find(line);
+  unsigned long long start = 0, end = 0;
+  CHECK(pos != std::string::npos &&
+        sscanf(report.c_str() + pos + strlen(line), "%llu to %llu us", &start, &end) == 2);
+  CHECK(end <= 100000 && start < end);
+  CHECK(report.find("   0: 262144 to 524287 bytes") == std::string::npos);
+  CHECK(report.find("   0: 1048576 to 2097151 bytes") == std::string::npos);
+}
+
+void TestLatencies()
+{
+  // a bucket per nanosecond up to 16 ns, then eight per power of two
+  for (uint64_t i = 0; i < 16; i++)
+    CHECK(GetLatencyBucket(i) == i);
+  CHECK(GetLatencyBucket(16) == 16 && GetLatencyBucket(17) == 16 && GetLatencyBucket(18) == 17);
+  CHECK(GetLatencyBucket(1000) == 63 && GetLatencyBucketStart(63) == 960 && GetLatencyBucketStart(64) == 1024);
+  CHECK(GetLatencyBucket(1000000) == 143 && GetLatencyBucketStart(143) == 983040);
+  CHECK(GetLatencyBucket((1ULL << 36) - 1) == LatencyBucketCount - 1);
+  CHECK(GetLatencyBucket(1ULL << 50) == LatencyBucketCount - 1);
+  for (uint32_t i = 1; i < LatencyBucketCount; i++)
+  {
+    CHECK(GetLatencyBucket(GetLatencyBucketStart(i)) == i);
+    CHECK(GetLatencyBucket(GetLatencyBucketStart(i) - 1) == i - 1);
+    // so every time is known to within an eighth of itself
+    CHECK(i < 8 || i + 1 == LatencyBucketCount ||
+          (GetLatencyBucketStart(i + 1) - GetLatencyBucketStart(i)) * 8 <= GetLatencyBucketStart(i));
+  }
+
+  // percentiles are the end of the bucket holding them, and never more than
+  // the longest time
+  uint64_t counts[LatencyBucketCount] = {};
+  counts[GetLatencyBucket(1000)] += 90;
+  counts[GetLatencyBucket(50000)] += 9;
+  counts[GetLatencyBucket(2000000)] += 1;
+  CHECK(GetLatencyPercentile(counts, 100, 2000000, 0.5) == 1023);
+  CHECK(GetLatencyPercentile(counts, 100, 2000000, 0.9) == 1023);
+  CHECK(GetLatencyPercentile(counts, 100, 2000000, 0.91) == 53247);
+  CHECK(GetLatencyPercentile(counts, 100, 2000000, 0.99) == 53247);
+  CHECK(GetLatencyPercentile(counts, 100, 2000000, 0.999) == 2000000);
+  CHECK(GetLatencyPercentile(counts, 100, 2000000, 0.0) == 1023);
+
+  uint64_t single[LatencyBucketCount] = {};
+  single[GetLatencyBucket(700)]++;
+  CHECK(GetLatencyPercentile(single, 1, 700, 0.5) == 700);
+  CHECK(GetLatencyPercentile(single, 1, 700, 0.99) == 700);
+}
+
+// the allocations of a call stack, as the report lists them
+struct ReportedStack
+{
+  unsigned long long maximum, live, allocations, samples;
+};
+
+// the entries of the call stack report, largest first
+std::vector<ReportedStack> GetReportedStacks(const std::string &report)
+{
+  std::vector<ReportedStack> stacks;
+  size_t pos = report.find("Allocation call stacks by maximum usage");
+  for (pos = report.find("\n", pos); pos != std::string::npos && pos + 1 < report.size(); pos = report.find("\n", pos + 1))
+  {
+    ReportedStack stack = {};
+    unsigned index;
+    int fields = sscanf(report.c_str() + pos + 1, " %u: %llu bytes maximum, %llu bytes live, %llu allocations (%llu sampled)",
+                        &index, &stack.maximum, &stack.live, &stack.allocations, &stack.samples);
+    if (fields >= 4)
+      stacks.push_back(stack);
+    else if (report.compare(pos + 1, 5, "     ") != 0)
+      break;
+  }
+  return stacks;
+}
+
+__attribute__((noinline)) VkDeviceMemory AllocateFromStack(TestDevice &t, VkDeviceSize size)
+{
+  return t.Allocate(size, 0);
+}
+
+// expects MEMORY_TRACK_STACK_DEPTH to be set
+void TestCallStacks()
+{
+  if (getenv("MEMORY_TRACK_STACK_DEPTH") == NULL || getenv("MEMORY_TRACK_SAMPLE_BYTES") != NULL)
+  {
+    printf("  skipped, MEMORY_TRACK_STACK_DEPTH isn't set, or MEMORY_TRACK_SAMPLE_BYTES is\n");
+    return;
+  }
+
+  // allocations made from the same place share a stack, however they
+  // interleave with those made from elsewhere
+  TestDevice t;
+  std::vector<VkDeviceMemory> memory;
+  for (int i = 0; i < 10; i++)
+  {
+    memory.push_back(AllocateFromStack(t, MiB));
+    if (i % 3 == 0)
+      memory.push_back(AllocateFromStack(t, 4 * MiB));
+  }
+  for (VkDeviceMemory m : memory)
+    t.Free(m);
+
+  // and the stack's live bytes go back to 0 once they are all freed
+  std::string report = DestroyCapturingReport(t);
+  CHECK(report.find("Allocation call stacks by maximum usage, 2 of 2:\n") != std::string::npos);
+  std::vector<ReportedStack> stacks = GetReportedStacks(report);
+  CHECK(stacks.size() == 2);
+  if (stacks.size() != 2)
+    return;
+
+  CHECK(stacks[0].maximum == 16 * MiB && stacks[0].live == 0 && stacks[0].allocations == 4);
+  CHECK(stacks[1].maximum == 10 * MiB && stacks[1].live == 0 && stacks[1].allocations == 10);
+}
+
+// expects MEMORY_TRACK_SAMPLE_BYTES to be 1048576
+void TestStackSampling()
+{
+  const char *sampleBytes = getenv("MEMORY_TRACK_SAMPLE_BYTES");
+  if (sampleBytes == NULL || strcmp(sampleBytes, "1048576") != 0)
+  {
+    printf("  skipped, MEMORY_TRACK_SAMPLE_BYTES isn't 1048576\n");
+    return;
+  }
+
+  // 20000 allocations of 64 to 512 KiB from one place. each is sampled with
+  // probability 1 - exp(-size / 1 MiB), about a quarter of them, and the
+  // estimated totals have a standard deviation under 2%, so they land within
+  // 10% of the real ones unless the estimate is biased
+  TestDevice t;
+  std::mt19937 random(1);
+  std::vector<VkDeviceMemory> memory;
+  uint64_t total = 0;
+  for (int i = 0; i < 20000; i++)
+  {
+    VkDeviceSize size = (16 + random() % 113) * 4096;
+    memory.push_back(AllocateFromStack(t, size));
+    total += size;
+  }
+  for (VkDeviceMemory m : memory)
+    t.Free(m);
+
+  std::string report = DestroyCapturingReport(t);
+  CHECK(report.find("Allocation call stacks by maximum usage, 1 of 1, estimated from one sample per 1048576 bytes:\n") !=
+        std::string::npos);
+  std::vector<ReportedStack> stacks = GetReportedStacks(report);
+  CHECK(stacks.size() == 1);
+  if (stacks.size() != 1)
+    return;
+
+  CHECK(fabs((double)stacks[0].maximum / total - 1.0) < 0.1);
+  CHECK(fabs(stacks[0].allocations / 20000.0 - 1.0) < 0.1);
+  CHECK(stacks[0].samples > 2000 && stacks[0].samples < 10000);
+  CHECK(stacks[0].live == 0);
+}
+
+void TestMapping()
+{
+  TestDevice t;
+
+  // mapped and unmapped every frame, which the report lists, apart from the
+  // last two that are only mapped for fewer frames than that takes. the
+  // first three are mapped together on heaps 1 and 2, and two of them are
+  // freed while mapped
+  struct
+  {
+    VkDeviceSize size;
+    uint32_t memoryTypeIndex;
+    VkDeviceSize offset, mapSize;
+    int frames;
+  } allocations[5] = {
+    { MiB, 1, 0, VK_WHOLE_SIZE, 20 },
+    { MiB, 2, 4096, VK_WHOLE_SIZE, 20 },
+    { 2 * MiB, 3, 0, 65536, 20 },
+    { 2 * MiB, 3, 0, VK_WHOLE_SIZE, 7 },
+    { 65536, 1, 0, VK_WHOLE_SIZE, 8 },
+  };
+  VkDeviceMemory memory[5];
+  for (int i = 0; i < 5; i++)
+    memory[i] = t.Allocate(allocations[i].size, allocations[i].memoryTypeIndex);
+
+  for (int frame = 0; frame < 20; frame++)
+  {
+    for (int i = 0; i < 5; i++)
+    {
+      if (frame >= allocations[i].frames)
+        continue;
+      void *data = NULL;
+      CHECK(t.vk.MapMemory(t.device, memory[i], allocations[i].offset, allocations[i].mapSize, 0, &data) == VK_SUCCESS);
+      CHECK(data != NULL);
+    }
+    for (int i = 0; i < 5; i++)
+    {
+      if (frame < allocations[i].frames && (frame < 19 || i == 0))
+        t.vk.UnmapMemory(t.device, memory[i]);
+    }
+  }
+
+  // unmapping what isn't mapped, or isn't known, is harmless to the accounting
+  t.vk.UnmapMemory(t.device, memory[0]);
+  for (int i = 0; i < 5; i++)
+    t.Free(memory[i]);
+  CHECK(FakeLiveAllocations() == 0);
+
+  std::string report = DestroyCapturingReport(t);
+  size_t pos = report.find("Mapped memory by memory heap:\n");
+  CHECK(pos != std::string::npos);
+  char line[256];
+  snprintf(line, sizeof(line), "   1: %llu bytes mapped at most, 0 bytes now, 48 maps, median mapping lifetime ",
+           (unsigned long long)(2 * MiB - 4096 + 65536));
+  CHECK(report.find(line, pos) != std::string::npos);
+  snprintf(line, sizeof(line), "   2: %llu bytes mapped at most, 0 bytes now, 27 maps, median mapping lifetime ",
+           (unsigned long long)(2 * MiB + 65536));
+  CHECK(report.find(line, pos) != std::string::npos);
+  CHECK(report.find("   0: ", pos) > report.find("Allocations mapped", pos));
+
+  // from MinRemapCount maps on
+  pos = report.find("Allocations mapped 8 times or more, which could stay mapped instead:\n");
+  CHECK(pos != std::string::npos);
+  for (int i = 0; i < 5 && pos != std::string::npos; i++)
+  {
+    snprintf(line, sizeof(line), ": 0x%llx, %llu bytes of type %u, mapped %d times for ",
+             (unsigned long long)(uint64_t)memory[i], (unsigned long long)allocations[i].size,
+             allocations[i].memoryTypeIndex, allocations[i].frames);
+    size_t found = report.find(line, pos);
+    CHECK((found != std::string::npos) == (allocations[i].frames >= 8));
+    CHECK(found == std::string::npos || report.compare(report.find("\n", found) - 7, 7, ", freed") == 0);
+  }
+}
+
+void TestFlushes()
+{
+  // make the cached type non-coherent, as on mobile hardware
+  VkPhysicalDeviceMemoryProperties memoryProperties = FakeDefaultMemoryProperties();
+  memoryProperties.memoryTypes[2].propertyFlags &= ~VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  FakeSetMemoryProperties(memoryProperties);
+
+  TestDevice t;
+  uint64_t flushCalls = FakeFlushCalls(), invalidateCalls = FakeInvalidateCalls();
+
+  VkQueue queue;
+  t.vk.GetDeviceQueue(t.device, 0, 0, &queue);
+
+  // the first allocation is flushed whole every frame, the second only where
+  // written, and invalidated there too. the third is flushed whole for 5
+  // frames, then for 7 after a break, twice a frame, which is never 8 in a
+  // row. the last is coherent and needs no flushing at all
+  VkDeviceMemory memory[4] = { t.Allocate(MiB, 2), t.Allocate(MiB, 2), t.Allocate(MiB, 2), t.Allocate(65536, 1) };
+  void *data;
+  for (VkDeviceMemory m : memory)
+    CHECK(t.vk.MapMemory(t.device, m, 0, VK_WHOLE_SIZE, 0, &data) == VK_SUCCESS);
+
+  for (int frame = 0; frame < 20; frame++)
+  {
+    std::vector<VkMappedMemoryRange> ranges = {
+      { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, NULL, memory[0], 0, VK_WHOLE_SIZE },
+      { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, NULL, memory[1], (VkDeviceSize)frame * 256, 256 },
+    };
+    VkMappedMemoryRange third = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, NULL, memory[2], 0, MiB };
+    if (frame < 5 || (frame >= 6 && frame < 13))
+      ranges.push_back(third);
+    if (frame < 10)
+      ranges.push_back({ VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, NULL, memory[3], 0, VK_WHOLE_SIZE });
+    CHECK(t.vk.FlushMappedMemoryRanges(t.device, (uint32_t)ranges.size(), ranges.data()) == VK_SUCCESS);
+    if (frame >= 6 && frame < 13)
+      CHECK(t.vk.FlushMappedMemoryRanges(t.device, 1, &third) == VK_SUCCESS);
+    CHECK(t.vk.InvalidateMappedMemoryRanges(t.device, 1, &ranges[1]) == VK_SUCCESS);
+
+    VkPresentInfoKHR presentInfo = {};
+    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    t.vk.QueuePresentKHR(queue, &presentInfo);
+  }
+
+  CHECK(FakeFlushCalls() - flushCalls == 27);
+  CHECK(FakeInvalidateCalls() - invalidateCalls == 20);
+
+  for (VkDeviceMemory m : memory)
+    t.Free(m);
+  std::string report = DestroyCapturingReport(t);
+  FakeSetMemoryProperties(FakeDefaultMemoryProperties());
+
+  // the bytes flushed against the sizes of the allocations they were in
+  size_t pos = report.find("Flushed and invalidated ranges by memory type:\n");
+  CHECK(pos != std::string::npos);
+  char line[256];
+  snprintf(line, sizeof(line), "   2: flushed %llu bytes in 27 calls, 59 ranges of which 39 whole, %.1f%% of the allocations they're in\n",
+           (unsigned long long)(39 * MiB + 20 * 256), 100.0 * (39 * MiB + 20 * 256) / (59 * MiB));
+  CHECK(report.find(line, pos) != std::string::npos);
+  CHECK(report.find("   2: invalidated 5120 bytes in 20 calls, 20 ranges of which 0 whole, 0.0% of the allocations they're in\n",
+                    pos) != std::string::npos);
+  CHECK(report.find("   1: flushed 655360 bytes in 10 calls, 10 ranges of which 10 whole, 100.0% of the allocations they're in,"
+                    " not needed as the type is coherent\n", pos) != std::string::npos);
+
+  // and the allocations flushed whole at least MinWholeFlushStreak frames in a row
+  pos = report.find("Allocations flushed or invalidated whole 8 frames in a row or more:\n");
+  CHECK(pos != std::string::npos);
+  const int streaks[4] = { 20, 0, 0, 10 };
+  for (int i = 0; i < 4 && pos != std::string::npos; i++)
+  {
+    snprintf(line, sizeof(line), ": 0x%llx, ", (unsigned long long)(uint64_t)memory[i]);
+    size_t found = report.find(line, pos);
+    CHECK((found != std::string::npos) == (streaks[i] != 0));
+    snprintf(line, sizeof(line), ", whole for up to %d frames in a row, freed\n", streaks[i]);
+    CHECK(found == std::string::npos || report.find(line, found) == report.find("\n", found) - strlen(line) + 1);
+  }
+}
+
+// reads what the layer published for its only device after it was destroyed
+bool ReadPublishedDevice(MemoryTrackShmDevice *out)
+{
+  const char *name = getenv("MEMORY_TRACK_SHM_NAME");
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+
+  void *ptr = mmap(NULL, sizeof(MemoryTrackShmSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED)
+    return false;
+
+  const MemoryTrackShmSegment *segment = (const MemoryTrackShmSegment *)ptr;
+  bool ok = segment->magic == MEMORY_TRACK_SHM_MAGIC &&
+            MemoryTrackShmReadDevice(&segment->devices[0], out);
+  munmap(ptr, sizeof(MemoryTrackShmSegment));
+  return ok;
+}
+
+void TestStatistics()
+{
+  if (getenv("MEMORY_TRACK_SHM_NAME") == NULL)
+  {
+    printf("  skipped, MEMORY_TRACK_SHM_NAME isn't set\n");
+    return;
+  }
+
+  TestDevice t;
+  VkDeviceMemory memory[3];
+  for (int i = 0; i < 3; i++)
+    memory[i] = t.Allocate(MiB, 0);
+  t.Allocate(64 * 1024, 1);
+  t.Free(memory[2]);
+
+  FakeSetAllocateResult(VK_ERROR_OUT_OF_DEVICE_MEMORY);
+  t.Allocate(MiB, 0, VK_ERROR_OUT_OF_DEVICE_MEMORY);
+  FakeSetAllocateResult(VK_SUCCESS);
+
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.size = 4096;
+
+  VkBuffer buffer;
+  VkMemoryRequirements memoryRequirements;
+  t.vk.CreateBuffer(t.device, &bufferCreateInfo, NULL, &buffer);
+  t.vk.GetBufferMemoryRequirements(t.device, buffer, &memoryRequirements);
+  t.vk.BindBufferMemory(t.device, buffer, memory[0], 0);
+
+  t.Destroy();
+
+  MemoryTrackShmDevice device;
+  CHECK(ReadPublishedDevice(&device));
+  CHECK(device.active == 0);
+  CHECK(device.memoryTypeCount == 4);
+  CHECK(device.memoryHeapCount == 3);
+  CHECK(device.types[0].currentUsage == 2 * MiB);
+  CHECK(device.types[0].maximumUsage == 3 * MiB);
+  CHECK(device.types[0].allocationCount == 2);
+  CHECK(device.types[0].totalAllocations == 3);
+  CHECK(device.types[1].currentUsage == 64 * 1024);
+  CHECK(device.heaps[0].currentUsage == 2 * MiB);
+  CHECK(device.heaps[0].currentBound == memoryRequirements.size);
+  CHECK(device.heaps[1].currentUsage == 64 * 1024);
+  CHECK(device.heaps[2].totalAllocations == 0);
+}
+
+void TestStatsExtension()
+{
+  TestDevice t(VK_NXT_MEMORY_TRACK_STATS_EXTENSION_NAME);
+
+  // the layer lists the extension as its own
+  PFN_vkEnumerateDeviceExtensionProperties enumerate = (PFN_vkEnumerateDeviceExtensionProperties)
+    MemoryTrack_GetInstanceProcAddr(t.instance, "vkEnumerateDeviceExtensionProperties");
+  uint32_t count = 0;
+  CHECK(enumerate(FakeGetPhysicalDevice(t.instance), "VK_LAYER_NXT_MemoryTrack", &count, NULL) == VK_SUCCESS);
+  CHECK(count == 1);
+  VkExtensionProperties properties;
+  CHECK(enumerate(FakeGetPhysicalDevice(t.instance), "VK_LAYER_NXT_MemoryTrack", &count, &properties) == VK_SUCCESS);
+  CHECK(strcmp(properties.extensionName, VK_NXT_MEMORY_TRACK_STATS_EXTENSION_NAME) == 0);
+  CHECK(enumerate(FakeGetPhysicalDevice(t.instance), "VK_LAYER_NXT_MemoryTrack", NULL, NULL) == VK_SUCCESS);
+  CHECK(enumerate(FakeGetPhysicalDevice(t.instance), "VK_LAYER_NXT_MemoryTrack", NULL, &properties) == VK_INCOMPLETE);
+
+  PFN_vkGetMemoryTrackStatsNXT getStats =
+    (PFN_vkGetMemoryTrackStatsNXT)MemoryTrack_GetDeviceProcAddr(t.device, "vkGetMemoryTrackStatsNXT");
+  CHECK(getStats != NULL);
+  if (getStats == NULL)
+    return;
+
+  VkDeviceMemory memory[2] = { t.Allocate(4 * MiB, 0), t.Allocate(MiB, 1) };
+  t.Free(t.Allocate(8 * MiB, 0));
+
+  VkBufferCreateInfo bufferCreateInfo = {};
+  bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCreateInfo.size = 4096;
+
+  VkBuffer buffer;
+  VkMemoryRequirements memoryRequirements;
+  t.vk.CreateBuffer(t.device, &bufferCreateInfo, NULL, &buffer);
+  t.vk.GetBufferMemoryRequirements(t.device, buffer, &memoryRequirements);
+  t.vk.BindBufferMemory(t.device, buffer, memory[0], 0);
+
+  VkMemoryTrackStatsNXT stats;
+  getStats(t.device, &stats);
+  CHECK(stats.memoryHeapCount == 3);
+  CHECK(stats.memoryHeaps[0].size == 8ULL << 30);
+  CHECK(stats.memoryHeaps[0].currentUsage == 4 * MiB);
+  CHECK(stats.memoryHeaps[0].maximumUsage == 12 * MiB);
+  CHECK(stats.memoryHeaps[0].currentBound == memoryRequirements.size);
+  CHECK(stats.memoryHeaps[0].allocationCount == 1);
+  CHECK(stats.memoryHeaps[0].totalAllocations == 2);
+  CHECK(stats.memoryHeaps[1].currentUsage == MiB);
+  CHECK(stats.memoryHeaps[2].totalAllocations == 0);
+
+  t.vk.DestroyBuffer(t.device, buffer, NULL);
+  t.Free(memory[0]);
+  t.Free(memory[1]);
+
+  // each heap's figures come from one moment, even while other threads
+  // allocate, bind and free memory that is still bound
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++)
+  {
+    threads.emplace_back([&]()
+    {
+      for (int j = 0; j < 20000; j++)
+      {
+        VkDeviceMemory m = t.Allocate(MiB, 0);
+        VkBuffer b;
+        t.vk.CreateBuffer(t.device, &bufferCreateInfo, NULL, &b);
+        t.vk.BindBufferMemory(t.device, b, m, 0);
+        t.Free(m);
+        t.vk.DestroyBuffer(t.device, b, NULL);
+      }
+    });
+  }
+  std::thread reader([&]()
+  {
+    VkMemoryTrackStatsNXT snapshot;
+    while (!stop.load())
+    {
+      getStats(t.device, &snapshot);
+      const VkMemoryTrackHeapStatsNXT &heap = snapshot.memoryHeaps[0];
+      CHECK(heap.currentUsage == heap.allocationCount * MiB);
+      CHECK(heap.currentBound <= heap.allocationCount * memoryRequirements.size);
+      CHECK(heap.allocationCount <= 4 && heap.totalAllocations >= heap.allocationCount);
+    }
+  });
+  for (std::thread &thread : threads)
+    thread.join();
+  stop = true;
+  reader.join();
+
+  // and the function only exists on devices that enabled it
+  TestDevice other;
+  CHECK(MemoryTrack_GetDeviceProcAddr(other.device, "vkGetMemoryTrackStatsNXT") == NULL);
+}
+
+// expects MEMORY_TRACK_HEAP_BUDGET=0,0,16777216, only limiting the small heap
+void TestBudget()
+{
+  const char *budget = getenv("MEMORY_TRACK_HEAP_BUDGET");
+  if (budget == NULL || strcmp(budget, "0,0,16777216") != 0)
+  {
+    printf("  skipped, MEMORY_TRACK_HEAP_BUDGET isn't 0,0,16777216\n");
+    return;
+  }
+
+  TestDevice t;
+  uint64_t allocateCalls = FakeAllocateCalls();
+
+  // memory type 3 is the only one on heap 2
+  std::vector<VkDeviceMemory> memory;
+  for (int i = 0; i < 16; i++)
+    memory.push_back(t.Allocate(MiB, 3));
+  CHECK(t.Allocate(MiB, 3, VK_ERROR_OUT_OF_DEVICE_MEMORY) == VK_NULL_HANDLE);
+  CHECK(FakeAllocateCalls() - allocateCalls == 16);
+
+  // other heaps aren't limited
+  t.Free(t.Allocate(64 * MiB, 0));
+
+  // freeing makes room again, and allocations the driver fails give theirs back
+  t.Free(memory.back());
+  memory.pop_back();
+  FakeSetAllocateResult(VK_ERROR_OUT_OF_DEVICE_MEMORY);
+  t.Allocate(MiB, 3, VK_ERROR_OUT_OF_DEVICE_MEMORY);
+  FakeSetAllocateResult(VK_SUCCESS);
+  memory.push_back(t.Allocate(MiB, 3));
+
+  for (VkDeviceMemory m : memory)
+    t.Free(m);
+
+  // threads racing for the budget get exactly as much as fits
+  std::vector<std::vector<VkDeviceMemory>> allocated(8);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < allocated.size(); i++)
+  {
+    threads.emplace_back([&t, &allocated, i]()
+    {
+      VkMemoryAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, NULL, MiB, 3 };
+      for (int j = 0; j < 8; j++)
+      {
+        VkDeviceMemory m;
+        if (t.vk.AllocateMemory(t.device, &allocateInfo, NULL, &m) == VK_SUCCESS)
+          allocated[i].push_back(m);
+      }
+    });
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+
+  CHECK(FakeLiveAllocations() == 16);
+  for (std::vector<VkDeviceMemory> &thread : allocated)
+    for (VkDeviceMemory m : thread)
+      t.Free(m);
+}
+
+// expects either MEMORY_TRACK_FAIL_EVERY or MEMORY_TRACK_FAIL_PROBABILITY
+void TestFaultInjection()
+{
+  const char *every = getenv("MEMORY_TRACK_FAIL_EVERY");
+  const char *probability = getenv("MEMORY_TRACK_FAIL_PROBABILITY");
+  if (every == NULL && probability == NULL)
+  {
+    printf("  skipped, neither MEMORY_TRACK_FAIL_EVERY nor MEMORY_TRACK_FAIL_PROBABILITY is set\n");
+    return;
+  }
+
+  TestDevice t;
+  uint64_t allocateCalls = FakeAllocateCalls();
+
+  const int count = 1000;
+  int failed = 0;
+  VkMemoryAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, NULL, MiB, 0 };
+  for (int i = 1; i <= count; i++)
+  {
+    VkDeviceMemory m;
+    VkResult res = t.vk.AllocateMemory(t.device, &allocateInfo, NULL, &m);
+    if (res == VK_SUCCESS)
+      t.Free(m);
+    else
+    {
+      CHECK(res == VK_ERROR_OUT_OF_DEVICE_MEMORY);
+      CHECK(every == NULL || i % atoi(every) == 0);
+      failed++;
+    }
+  }
+
+  CHECK(FakeAllocateCalls() - allocateCalls == (uint64_t)(count - failed));
+  if (every != NULL)
+    CHECK(failed == count / atoi(every));
+  else
+    CHECK(fabs((double)failed / count - atof(probability)) < 0.1);
+}
+
+// expects MEMORY_TRACK_RECYCLE_BYTES=16777216
+void TestRecycling()
+{
+  const char *recycleBytes = getenv("MEMORY_TRACK_RECYCLE_BYTES");
+  if (recycleBytes == NULL || strcmp(recycleBytes, "16777216") != 0)
+  {
+    printf("  skipped, MEMORY_TRACK_RECYCLE_BYTES isn't 16777216\n");
+    return;
+  }
+
+  TestDevice t;
+  uint64_t allocateCalls = FakeAllocateCalls(), freeCalls = FakeFreeCalls();
+
+  // a freed block is parked and handed out again
+  VkDeviceMemory memory = t.Allocate(MiB, 0);
+  t.Free(memory);
+  CHECK(FakeFreeCalls() == freeCalls);
+  CHECK(t.Allocate(MiB, 0) == memory);
+  CHECK(FakeAllocateCalls() - allocateCalls == 1);
+
+  // but never when it is too small
+  t.Free(memory);
+  VkDeviceMemory larger = t.Allocate(MiB + 64 * 1024, 0);
+  CHECK(larger != memory);
+  CHECK(FakeAllocateCalls() - allocateCalls == 2);
+  t.Free(larger);
+  CHECK(FakeFreeCalls() == freeCalls);
+
+  // host visible memory and allocations with a pNext chain go straight to the driver
+  t.Free(t.Allocate(MiB, 1));
+  t.Free(t.Allocate(MiB, 3));
+  VkDedicatedAllocationMemoryAllocateInfoNV dedicated = {};
+  dedicated.sType = VK_STRUCTURE_TYPE_DEDICATED_ALLOCATION_MEMORY_ALLOCATE_INFO_NV;
+  VkMemoryAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO, &dedicated, MiB, 0 };
+  VkDeviceMemory dedicatedMemory;
+  CHECK(t.vk.AllocateMemory(t.device, &allocateInfo, NULL, &dedicatedMemory) == VK_SUCCESS);
+  t.Free(dedicatedMemory);
+  CHECK(FakeFreeCalls() - freeCalls == 3);
+
+  // the first two allocations reuse what is parked, the most recent first.
+  // once all are freed, 20 MiB and a bit are parked, so the four freed first go
+  freeCalls = FakeFreeCalls();
+  std::vector<VkDeviceMemory> blocks;
+  for (int i = 0; i < 20; i++)
+    blocks.push_back(t.Allocate(MiB, 0));
+  CHECK(blocks[0] == larger && blocks[1] == memory);
+  for (VkDeviceMemory m : blocks)
+    t.Free(m);
+  CHECK(FakeFreeCalls() - freeCalls == 4);
+
+  // parked blocks are freed with the device
+  t.Destroy();
+  CHECK(FakeLiveAllocations() == 0);
+
+  // a block handed out for a smaller request counts with its real size, while
+  // it is used and once it is parked again
+  TestDevice u(VK_NXT_MEMORY_TRACK_STATS_EXTENSION_NAME);
+  PFN_vkGetMemoryTrackStatsNXT getStats =
+    (PFN_vkGetMemoryTrackStatsNXT)MemoryTrack_GetDeviceProcAddr(u.device, "vkGetMemoryTrackStatsNXT");
+  VkMemoryTrackStatsNXT stats;
+  VkDeviceMemory big = u.Allocate(MiB + 192 * 1024, 0);
+  u.Free(big);
+  memory = u.Allocate(MiB, 0);
+  CHECK(memory == big);
+  getStats(u.device, &stats);
+  CHECK(stats.memoryHeaps[0].currentUsage == MiB + 192 * 1024);
+
+  // so the last of another 15 MiB parked takes it over the cap, and the
+  // block parked first goes
+  blocks.clear();
+  for (int i = 0; i < 15; i++)
+    blocks.push_back(u.Allocate(MiB, 0));
+  freeCalls = FakeFreeCalls();
+  u.Free(memory);
+  for (VkDeviceMemory m : blocks)
+    u.Free(m);
+  CHECK(FakeFreeCalls() - freeCalls == 1);
+  getStats(u.device, &stats);
+  CHECK(stats.memoryHeaps[0].currentUsage == 0);
+}
+
+// expects MEMORY_TRACK_DEFERRED_FREE to be set
+void TestDeferredFree()
+{
+  if (getenv("MEMORY_TRACK_DEFERRED_FREE") == NULL)
+  {
+    printf("  skipped, MEMORY_TRACK_DEFERRED_FREE isn't set\n");
+    return;
+  }
+
+  TestDevice t;
+  uint64_t freeCalls = FakeFreeCalls();
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++)
+  {
+    threads.emplace_back([&t]()
+    {
+      std::vector<VkDeviceMemory> memory;
+      for (int j = 0; j < 1000; j++)
+        memory.push_back(t.Allocate(64 * 1024, 0));
+      for (VkDeviceMemory m : memory)
+        t.Free(m);
+    });
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+
+  // whatever the worker didn't get to yet is freed with the device
+  t.Destroy();
+  CHECK(FakeFreeCalls() - freeCalls == 8000);
+  CHECK(FakeLiveAllocations() == 0);
+
+  // the requests are kept, so a burst of frees after that allocates nothing
+  TestDevice u;
+  std::vector<VkDeviceMemory> memory;
+  for (int i = 0; i < 4000; i++)
+    memory.push_back(u.Allocate(64 * 1024, 0));
+  uint64_t allocations = thread_allocations;
+  for (VkDeviceMemory m : memory)
+    u.Free(m);
+  CHECK(thread_allocations == allocations);
+}
+
+// application allocation callbacks that count what goes through them
+struct CountingAllocator
+{
+  static void *VKAPI_PTR Allocation(void *pUserData, size_t size, size_t alignment, VkSystemAllocationScope scope)
+  {
+    CountingAllocator *counting = (CountingAllocator *)pUserData;
+    counting->live++;
+    counting->allocations++;
+    void *ptr = NULL;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : NULL;
+  }
+
+  static void *VKAPI_PTR Reallocation(void *pUserData, void *pOriginal, size_t size, size_t alignment,
+                                      VkSystemAllocationScope scope)
+  {
+    // the layer never passes reallocations on
+    ((CountingAllocator *)pUserData)->reallocations++;
+    return NULL;
+  }
+
+  static void VKAPI_PTR Free(void *pUserData, void *pMemory)
+  {
+    if (pMemory)
+      ((CountingAllocator *)pUserData)->live--;
+    free(pMemory);
+  }
+
+  static void VKAPI_PTR InternalAllocation(void *pUserData, size_t size, VkInternalAllocationType allocationType,
+                                           VkSystemAllocationScope scope)
+  {
+    ((CountingAllocator *)pUserData)->internalBytes += size;
+  }
+
+  static void VKAPI_PTR InternalFree(void *pUserData, size_t size, VkInternalAllocationType allocationType,
+                                     VkSystemAllocationScope scope)
+  {
+    ((CountingAllocator *)pUserData)->internalBytes -= size;
+  }
+
+  VkAllocationCallbacks Callbacks()
+  {
+    return { this, &Allocation, &Reallocation, &Free, &InternalAllocation, &InternalFree };
+  }
+
+  std::atomic<int64_t> live{0};
+  std::atomic<int64_t> allocations{0};
+  std::atomic<int64_t> reallocations{0};
+  std::atomic<int64_t> internalBytes{0};
+};
+
+// expects MEMORY_TRACK_HOST_MEMORY to be set
+void TestHostMemory()
+{
+  if (getenv("MEMORY_TRACK_HOST_MEMORY") == NULL)
+  {
+    printf("  skipped, MEMORY_TRACK_HOST_MEMORY isn't set\n");
+    return;
+  }
+
+  CountingAllocator counting;
+  VkAllocationCallbacks callbacks = counting.Callbacks();
+
+  VkInstance instance;
+  VkDevice device;
+  VkLayerDispatchTable vk;
+  CHECK(FakeCreateInstance(&instance) == VK_SUCCESS);
+  CHECK(FakeCreateDevice(instance, &device, NULL, &callbacks) == VK_SUCCESS);
+  FakeGetDispatchTable(device, &MemoryTrack_GetDeviceProcAddr, &vk);
+  CHECK(counting.live == 1);
+
+  // a pool created without callbacks still ends up with the device's
+  VkCommandPoolCreateInfo commandPoolInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+  VkCommandPool commandPool;
+  CHECK(vk.CreateCommandPool(device, &commandPoolInfo, NULL, &commandPool) == VK_SUCCESS);
+  CHECK((uintptr_t)commandPool % 16 == 0);
+  CHECK(counting.live == 2);
+
+  // reallocating keeps the contents, without the application's reallocation
+  VkDescriptorPoolCreateInfo descriptorPoolInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+  VkDescriptorPool descriptorPool;
+  CHECK(vk.CreateDescriptorPool(device, &descriptorPoolInfo, &callbacks, &descriptorPool) == VK_SUCCESS);
+  CHECK(((unsigned char *)(uintptr_t)descriptorPool)[255] == 0x5a);
+  CHECK(counting.live == 3);
+  CHECK(counting.reallocations == 0);
+
+  VkComputePipelineCreateInfo pipelineInfos[2] = {};
+  VkPipeline pipelines[2];
+  CHECK(vk.CreateComputePipelines(device, VK_NULL_HANDLE, 2, pipelineInfos, NULL, pipelines) == VK_SUCCESS);
+  CHECK(counting.live == 5);
+  CHECK(counting.internalBytes > 0);
+
+  // callbacks that only leave out the internal notifications are wrapped on
+  // their own, and never hear about the pipeline's internal memory
+  VkAllocationCallbacks quiet = callbacks;
+  quiet.pfnInternalAllocation = NULL;
+  quiet.pfnInternalFree = NULL;
+  int64_t internalBytes = counting.internalBytes;
+  VkPipeline quietPipeline;
+  CHECK(vk.CreateComputePipelines(device, VK_NULL_HANDLE, 1, pipelineInfos, &quiet, &quietPipeline) == VK_SUCCESS);
+  CHECK(counting.live == 6);
+  CHECK(counting.internalBytes == internalBytes);
+  vk.DestroyPipeline(device, quietPipeline, &quiet);
+
+  // threads creating pools at the same time each count on their own
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++)
+  {
+    threads.emplace_back([&]()
+    {
+      for (int j = 0; j < 100; j++)
+      {
+        VkCommandPool pool;
+        CHECK(vk.CreateCommandPool(device, &commandPoolInfo, NULL, &pool) == VK_SUCCESS);
+        vk.DestroyCommandPool(device, pool, NULL);
+      }
+    });
+  }
+  for (std::thread &thread : threads)
+    thread.join();
+  CHECK(counting.live == 5);
+
+  for (VkPipeline pipeline : pipelines)
+    vk.DestroyPipeline(device, pipeline, NULL);
+  vk.DestroyDescriptorPool(device, descriptorPool, &callbacks);
+  vk.DestroyCommandPool(device, commandPool, NULL);
+  FakeDestroyDevice(device, &callbacks);
+  FakeDestroyInstance(instance);
+
+  CHECK(counting.live == 0);
+  CHECK(counting.internalBytes == 0);
+  CHECK(counting.allocations == 1 + 1 + 2 + 2 + 1 + 800);
+
+  // without any callbacks the layer allocates from the C heap
+  TestDevice t;
+  CHECK(t.vk.CreateDescriptorPool(t.device, &descriptorPoolInfo, NULL, &descriptorPool) == VK_SUCCESS);
+  CHECK(((unsigned char *)(uintptr_t)descriptorPool)[0] == 0x5a);
+  t.vk.DestroyDescriptorPool(t.device, descriptorPool, NULL);
+}
+
+std::string ReadFile(const char *path)
+{
+  std::string contents;
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return contents;
+
+  char block[4096];
+  for (size_t length; (length = fread(block, 1, sizeof(block), file)) != 0;)
+    contents.append(block, length);
+  fclose(file);
+  return contents;
+}
+
+// the number of times text appears in haystack from start on
+size_t CountOccurrences(const std::string &haystack, size_t start, const char *text)
+{
+  size_t count = 0;
+  for (size_t pos = haystack.find(text, start); pos != std::string::npos; pos = haystack.find(text, pos + 1))
+    count++;
+  return count;
+}
+
+// expects MEMORY_TRACK_TRACE_FILE to be set
+void TestBinaryTrace()
+{
+  const char *path = getenv("MEMORY_TRACK_TRACE_FILE");
+  if (path == NULL)
+  {
+    printf("  skipped, MEMORY_TRACK_TRACE_FILE isn't set\n");
+    return;
+  }
+
+  // as with the Chrome trace, the events of earlier devices come first. the
+  // header is only written out along with the first events
+  size_t start;
+  VkDeviceMemory memory[2];
+  VkBuffer buffer;
+  VkMemoryRequirements memoryRequirements;
+  {
+    TestDevice t;
+    start = std::max(ReadFile(path).size(), sizeof(TraceFileHeader));
+    memory[0] = t.Allocate(MiB, 0);
+    memory[1] = t.Allocate(2 * MiB, 1);
+
+    VkBufferCreateInfo bufferCreateInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+    CHECK(t.vk.CreateBuffer(t.device, &bufferCreateInfo, NULL, &buffer) == VK_SUCCESS);
+    t.vk.GetBufferMemoryRequirements(t.device, buffer, &memoryRequirements);
+    CHECK(t.vk.BindBufferMemory(t.device, buffer, memory[0], 256) == VK_SUCCESS);
+
+    void *data;
+    CHECK(t.vk.MapMemory(t.device, memory[1], 4096, VK_WHOLE_SIZE, 0, &data) == VK_SUCCESS);
+    t.vk.UnmapMemory(t.device, memory[1]);
+
+    VkQueue queue;
+    t.vk.GetDeviceQueue(t.device, 0, 0, &queue);
+    VkPresentInfoKHR presentInfo = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
+    t.vk.QueuePresentKHR(queue, &presentInfo);
+
+    t.vk.DestroyBuffer(t.device, buffer, NULL);
+    for (VkDeviceMemory m : memory)
+      t.Free(m);
+  }
+
+  std::string trace = ReadFile(path);
+  CHECK(trace.size() >= sizeof(TraceFileHeader));
+  if (trace.size() < sizeof(TraceFileHeader))
+    return;
+
+  TraceFileHeader header;
+  memcpy(&header, trace.data(), sizeof(header));
+  CHECK(strcmp(header.magic, MEMORY_TRACK_TRACE_MAGIC) == 0);
+  CHECK(header.version == MEMORY_TRACK_TRACE_VERSION);
+  CHECK(header.eventSize == sizeof(TraceEvent));
+  CHECK((trace.size() - sizeof(header)) % sizeof(TraceEvent) == 0);
+  CHECK((start - sizeof(header)) % sizeof(TraceEvent) == 0);
+
+  // one thread made every call, so its events are in order
+  std::vector<TraceEvent> events((trace.size() - start) / sizeof(TraceEvent));
+  memcpy(events.data(), trace.data() + start, events.size() * sizeof(TraceEvent));
+  static const uint8_t types[] = {
+    TraceEventAllocate, TraceEventAllocate, TraceEventBindBuffer, TraceEventMap, TraceEventUnmap,
+    TraceEventPresent, TraceEventUnbindBuffer, TraceEventFree, TraceEventFree,
+  };
+  CHECK(events.size() == sizeof(types));
+  if (events.size() != sizeof(types))
+    return;
+
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    CHECK(events[i].type == types[i]);
+    CHECK(events[i].threadId == events[0].threadId);
+    CHECK(events[i].deviceIndex == events[0].deviceIndex);
+    CHECK(i == 0 || events[i].timestamp >= events[i - 1].timestamp);
+  }
+
+  const TraceEvent &allocate0 = events[0], &allocate1 = events[1];
+  CHECK(allocate0.memory == (uint64_t)memory[0] && allocate0.size == MiB && allocate0.memoryTypeIndex == 0 &&
+        allocate0.heapIndex == 0 && allocate0.heapUsage == MiB);
+  CHECK(allocate1.memory == (uint64_t)memory[1] && allocate1.size == 2 * MiB && allocate1.memoryTypeIndex == 1 &&
+        allocate1.heapIndex == 1 && allocate1.heapUsage == 2 * MiB);
+
+  const TraceEvent &bind = events[2], &unbind = events[6];
+  CHECK(bind.memory == (uint64_t)memory[0] && bind.object == (uint64_t)buffer && bind.offset == 256 &&
+        bind.size == memoryRequirements.size);
+  CHECK(unbind.memory == bind.memory && unbind.object == bind.object && unbind.offset == bind.offset &&
+        unbind.size == bind.size);
+
+  const TraceEvent &map = events[3], &unmap = events[4];
+  CHECK(map.memory == (uint64_t)memory[1] && map.offset == 4096 && map.size == 2 * MiB - 4096);
+  CHECK(unmap.memory == (uint64_t)memory[1]);
+
+  CHECK(events[5].object == 1);
+
+  const TraceEvent &free0 = events[7], &free1 = events[8];
+  CHECK(free0.memory == (uint64_t)memory[0] && free0.size == MiB && free0.heapUsage == 0);
+  CHECK(free1.memory == (uint64_t)memory[1] && free1.size == 2 * MiB && free1.heapUsage == 0);
+}
+
+// expects MEMORY_TRACK_CHROME_TRACE to be set
+void TestChromeTrace()
+{
+  const char *path = getenv("MEMORY_TRACK_CHROME_TRACE");
+  if (path == NULL)
+  {
+    printf("  skipped, MEMORY_TRACK_CHROME_TRACE isn't set\n");
+    return;
+  }
+
+  size_t start;
+  {
+    // the first device opens the trace. it covers every test run before this
+    // one, and was flushed up to here when their devices were destroyed
+    TestDevice t;
+    start = ReadFile(path).size();
+    VkDeviceMemory memory[2] = { t.Allocate(MiB, 0), t.Allocate(MiB, 1) };
+
+    VkBufferCreateInfo bufferCreateInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+    VkBuffer buffer;
+    CHECK(t.vk.CreateBuffer(t.device, &bufferCreateInfo, NULL, &buffer) == VK_SUCCESS);
+    CHECK(t.vk.BindBufferMemory(t.device, buffer, memory[0], 0) == VK_SUCCESS);
+
+    void *data;
+    CHECK(t.vk.MapMemory(t.device, memory[1], 0, VK_WHOLE_SIZE, 0, &data) == VK_SUCCESS);
+    t.vk.UnmapMemory(t.device, memory[1]);
+
+    VkQueue queue;
+    t.vk.GetDeviceQueue(t.device, 0, 0, &queue);
+    VkPresentInfoKHR presentInfo = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
+    t.vk.QueuePresentKHR(queue, &presentInfo);
+
+    t.vk.DestroyBuffer(t.device, buffer, NULL);
+    for (VkDeviceMemory m : memory)
+      t.Free(m);
+  }
+
+  // so did destroying this one. the file is an array of one event per line,
+  // until the layer is unloaded and closes it
+  std::string trace = ReadFile(path);
+  CHECK(trace.compare(0, 2, "[\n") == 0);
+  CHECK(trace.find("}\n{") == std::string::npos);
+  CHECK(CountOccurrences(trace, start, "\"name\":\"allocation\",\"cat\":\"memory\",\"ph\":\"b\"") == 2);
+  CHECK(CountOccurrences(trace, start, "\"name\":\"allocation\",\"cat\":\"memory\",\"ph\":\"e\"") == 2);
+  CHECK(CountOccurrences(trace, start, "\"ph\":\"C\"") == 4);
+  CHECK(CountOccurrences(trace, start, "\"name\":\"mapping\"") == 2);
+  CHECK(CountOccurrences(trace, start, "\"name\":\"bind buffer\"") == 1);
+  CHECK(CountOccurrences(trace, start, "\"name\":\"unbind buffer\"") == 1);
+  CHECK(CountOccurrences(trace, start, "\"name\":\"present\"") == 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////
+// main
+
+struct Test
+{
+  const char *name;
+  void (*func)();
+};
+
+const Test tests[] = {
+  { "handle map", &TestHandleMap },
+  { "range index", &TestRangeIndex },
+  { "binary trace", &TestBinaryTrace },
+  { "forwarding", &TestForwarding },
+  { "failed allocation", &TestFailedAllocation },
+  { "threads", &TestThreads },
+  { "binding", &TestBinding },
+  { "present", &TestPresent },
+  { "lifetimes", &TestLifetimes },
+  { "latencies", &TestLatencies },
+  { "call stacks", &TestCallStacks },
+  { "stack sampling", &TestStackSampling },
+  { "mapping", &TestMapping },
+  { "flushes", &TestFlushes },
+  { "statistics", &TestStatistics },
+  { "stats extension", &TestStatsExtension },
+  { "budget", &TestBudget },
+  { "fault injection", &TestFaultInjection },
+  { "recycling", &TestRecycling },
+  { "deferred free", &TestDeferredFree },
+  { "host memory", &TestHostMemory },
+  { "chrome trace", &TestChromeTrace },
+};
+
+// runs every test, or only those named on the command line
+int main(int argc, char **argv)
+{
+  for (const Test &test : tests)
+  {
+    bool selected = argc == 1;
+    for (int i = 1; i < argc; i++)
+      selected |= strcmp(argv[i], test.name) == 0;
+    if (!selected)
+      continue;
+
+    printf("test %s\n", test.name);
+    test.func();
+  }
+
+  if (failures)
+  {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("all tests passed\n");
+  return 0;
+}